@@ -15,6 +15,14 @@ double CustomSlider::getCurrentCustomValue()
     return roundedValue;
 }
 
+double CustomSlider::getCustomMin() const {
+    return customMin;
+}
+
+double CustomSlider::getCustomMax() const {
+    return customMax;
+}
+
 void CustomSlider::setCurrentCustomValue(double v) {
     if (v >= customMin && v <= customMax) {
         double percent = (double)(v - customMin) / (customMax - customMin);
@@ -10,6 +10,8 @@ class CustomSlider : public QSlider
 public:
     explicit CustomSlider(QWidget *parent = 0);
     double getCurrentCustomValue();
+    double getCustomMin() const;
+    double getCustomMax() const;
 signals:
     void customValueChanged(QString text);
     void customValueChanged(double value);
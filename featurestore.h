@@ -0,0 +1,70 @@
+#ifndef FEATURESTORE_H
+#define FEATURESTORE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QMutex>
+#include <QString>
+
+#include <opencv2/opencv.hpp>
+
+// Keypoints, descriptors and raw matches only depend on what they were computed from (the
+// pixels, or the descriptors being matched) and the settings used, so they are stored under
+// a hash of exactly that (see Key). The most recently used entries are kept in memory, with
+// a directory set every entry is also written there and read back through a memory map, so
+// running a flight again with other thresholds or another algorithm skips detection and
+// matching. Safe to use from several threads at once.
+class FeatureStore
+{
+public:
+    // whatever was computed, the parts that weren't are left empty
+    struct Entry {
+        std::vector<cv::KeyPoint> keypoints;
+        cv::Mat descriptors;
+        std::vector<cv::DMatch> matches;
+    };
+
+    // Hashes the settings and every input given to add(). Two keys are the same only if all of
+    // them were, so everything that changes the result has to go in.
+    class Key {
+    public:
+        explicit Key(const QByteArray &settings);
+        Key& add(const cv::Mat &data);     // size, type and pixels
+        Key& add(const std::vector<cv::KeyPoint> &keypoints);
+        Key& add(int value);
+        Key& add(const QByteArray &data);
+        QByteArray result() const;
+    private:
+        QCryptographicHash hash;
+    };
+
+    FeatureStore();
+    // forgets what is in memory, the directory is left alone
+    void clear();
+    // entries over bytes are dropped least recently used first, 0 keeps nothing in memory
+    void setMemoryLimit(size_t bytes);
+    // Entries are also written to and looked for in directory, which is created if it doesn't exist.
+    // Empty (the default) keeps them in memory only. False if the directory can't be used.
+    bool setDirectory(const QString &directory);
+
+    // false if nothing has been stored under key. The entry is a copy, it can be changed freely.
+    bool find(const QByteArray &key, Entry &entry);
+    void store(const QByteArray &key, const Entry &entry);
+    int hits() const;
+    int misses() const;
+
+private:
+    QString fileName(const QByteArray &key) const;
+    bool read(const QString &file, Entry &entry) const;
+    void write(const QString &file, const Entry &entry) const;
+    void remember(const QByteArray &key, const Entry &entry);
+
+    mutable QMutex lock;
+    QCache<QByteArray, Entry> cache;    // protected by lock, cost in kilobytes
+    QString directory;
+    int hitCount;   // protected by lock
+    int missCount;  // protected by lock
+};
+
+#endif // FEATURESTORE_H
@@ -0,0 +1,142 @@
+#include "featuretracker.h"
+
+#include <algorithm>
+
+using namespace cv;
+
+namespace {
+
+const int GRID_SIZE = 8;                // cells across and down
+const double QUALITY_LEVEL = 0.01;      // of the strongest corner, as goodFeaturesToTrack takes it
+const double MIN_CORNER_DISTANCE = 8;
+const Size WINDOW_SIZE(21, 21);
+const int PYRAMID_LEVELS = 3;           // above the image, enough for a few tens of pixels of motion
+
+Rect cellRect(Size imageSize, int cx, int cy) {
+    int x0 = imageSize.width * cx / GRID_SIZE;
+    int y0 = imageSize.height * cy / GRID_SIZE;
+    int x1 = imageSize.width * (cx + 1) / GRID_SIZE;
+    int y1 = imageSize.height * (cy + 1) / GRID_SIZE;
+    return Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+// orders track indices by their Lucas-Kanade error
+class ByError {
+public:
+    explicit ByError(const std::vector<float> &errors) : errors(errors) {}
+    bool operator()(int a, int b) const { return errors[a] < errors[b]; }
+private:
+    const std::vector<float> &errors;
+};
+
+}
+
+FeatureTracker::FeatureTracker(int maxCorners) : maxCorners(std::max(GRID_SIZE * GRID_SIZE, maxCorners))
+{
+}
+
+void FeatureTracker::clear() {
+    previous = Mat();
+    current = Mat();
+    previousPyramid.clear();
+    currentPyramid.clear();
+    points.clear();
+}
+
+void FeatureTracker::start(const Mat &gray) {
+    clear();
+    current = gray.clone();
+    buildOpticalFlowPyramid(current, currentPyramid, WINDOW_SIZE, PYRAMID_LEVELS);
+    seed();
+}
+
+void FeatureTracker::track(const Mat &gray, std::vector<Point2f> &from, std::vector<Point2f> &to) {
+    previous = current;
+    current = gray.clone();
+    previousPyramid.swap(currentPyramid);
+    buildOpticalFlowPyramid(current, currentPyramid, WINDOW_SIZE, PYRAMID_LEVELS);
+    std::vector<Point2f> corners;
+    corners.swap(points);
+    follow(corners, from, to);
+}
+
+void FeatureTracker::retrack(std::vector<Point2f> &from, std::vector<Point2f> &to) {
+    from.clear();
+    to.clear();
+    if (previous.empty()) return;
+    // the previous frame becomes current just long enough to be seeded, its pyramid is still there
+    std::swap(previous, current);
+    points.clear();
+    seed();
+    std::swap(previous, current);
+    std::vector<Point2f> corners;
+    corners.swap(points);
+    follow(corners, from, to);
+}
+
+// corners from previous into current, the ones that make it become the corners of current
+void FeatureTracker::follow(const std::vector<Point2f> &corners, std::vector<Point2f> &from, std::vector<Point2f> &to) {
+    from.clear();
+    to.clear();
+    points.clear();
+    if (corners.empty()) return;
+    std::vector<Point2f> tracked;
+    std::vector<uchar> status;
+    std::vector<float> errors;
+    calcOpticalFlowPyrLK(previousPyramid, currentPyramid, corners, tracked, status, errors,
+                         WINDOW_SIZE, PYRAMID_LEVELS);
+
+    Rect inside(0, 0, current.cols, current.rows);
+    std::vector<int> order;
+    for (unsigned i = 0; i < tracked.size(); i++) {
+        if (status[i] && inside.contains(Point(cvFloor(tracked[i].x), cvFloor(tracked[i].y)))) {
+            order.push_back(i);
+        }
+    }
+    // the estimator tries the best tracks first
+    std::stable_sort(order.begin(), order.end(), ByError(errors));
+    for (unsigned i = 0; i < order.size(); i++) {
+        from.push_back(corners[order[i]]);
+        to.push_back(tracked[order[i]]);
+    }
+    points = to;
+}
+
+void FeatureTracker::keepInliers(const std::vector<uchar> &inliers) {
+    unsigned kept = 0;
+    for (unsigned i = 0; i < points.size() && i < inliers.size(); i++) {
+        if (!inliers[i]) continue;
+        points[kept++] = points[i];
+    }
+    points.resize(kept);
+    seed();
+}
+
+int FeatureTracker::size() const {
+    return points.size();
+}
+
+// Fills up the cells of current that have fewer than half their share of the corners
+void FeatureTracker::seed() {
+    if (current.empty()) return;
+    int perCell = maxCorners / (GRID_SIZE * GRID_SIZE);
+    std::vector<int> counts(GRID_SIZE * GRID_SIZE, 0);
+    for (unsigned i = 0; i < points.size(); i++) {
+        int cx = std::min(GRID_SIZE - 1, (int)(points[i].x * GRID_SIZE / current.cols));
+        int cy = std::min(GRID_SIZE - 1, (int)(points[i].y * GRID_SIZE / current.rows));
+        counts[cy * GRID_SIZE + cx]++;
+    }
+    for (int cy = 0; cy < GRID_SIZE; cy++) {
+        for (int cx = 0; cx < GRID_SIZE; cx++) {
+            int count = counts[cy * GRID_SIZE + cx];
+            if (count * 2 >= perCell) continue;
+            Rect cell = cellRect(current.size(), cx, cy);
+            if (cell.area() == 0) continue;
+            std::vector<Point2f> corners;
+            goodFeaturesToTrack(current(cell), corners, perCell - count, QUALITY_LEVEL, MIN_CORNER_DISTANCE);
+            for (unsigned i = 0; i < corners.size(); i++) {
+                points.push_back(corners[i] + Point2f((float)cell.x, (float)cell.y));
+            }
+        }
+    }
+}
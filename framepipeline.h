@@ -0,0 +1,81 @@
+#ifndef FRAMEPIPELINE_H
+#define FRAMEPIPELINE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <opencv2/opencv.hpp>
+
+#include "phasecorrelator.h"
+
+class ImageStitcher;
+
+// An input image after it has been decoded, scaled and run through the detector
+struct PreparedFrame {
+    PreparedFrame() : index(-1) {}
+    int index;
+    cv::Mat image;  // scaled colour image
+    cv::Mat gray;
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+    PhaseCorrelator::Frame phase;   // only for PHASE_CORRELATION and the phase guess
+};
+
+// Decodes and extracts features from the upcoming input images on a thread pool
+// while the stitcher registers and composites the current one. Decoding and
+// feature extraction are separate tasks, a frame moves on to the detect stage as
+// soon as it is decoded. No more than maxInFlight frames are ever started but not
+// yet taken, which keeps memory bounded however far ahead the workers could get.
+// A maxInFlight of 0 does all the work in takeNext() on the calling thread.
+// Without detect the frames only get decoded.
+class FramePipeline
+{
+public:
+    FramePipeline(const ImageStitcher* stitcher, QThreadPool* pool, int firstIndex, int endIndex, int maxInFlight,
+                  bool detect = true);
+    ~FramePipeline();   // waits for any work still running
+
+    bool atEnd() const;
+    // blocks until the next frame is ready, frames come out in input order
+    PreparedFrame takeNext();
+
+private:
+    enum Stage {
+        DECODE,
+        DETECT
+    };
+
+    class Task : public QRunnable {
+    public:
+        Task(FramePipeline* pipeline, Stage stage, PreparedFrame* frame);
+        void run();
+    private:
+        FramePipeline* pipeline;
+        Stage stage;
+        PreparedFrame* frame;
+    };
+
+    void submitMore();  // mutex must be held
+    void decodeStage(PreparedFrame* frame);
+    void detectStage(PreparedFrame* frame);
+    void finish(PreparedFrame* frame);
+
+    const ImageStitcher* stitcher;
+    QThreadPool* pool;
+    const int endIndex;
+    const int maxInFlight;
+    const bool detect;
+
+    QMutex mutex;
+    QWaitCondition stateChanged;
+    QHash<int, PreparedFrame> ready;    // protected by mutex
+    int nextToSubmit;                   // protected by mutex
+    int nextToTake;                     // protected by mutex
+    int running;                        // protected by mutex
+    bool abandoned;                     // protected by mutex
+};
+
+#endif // FRAMEPIPELINE_H
@@ -0,0 +1,316 @@
+#include "globalaligner.h"
+
+#include <queue>
+
+using namespace cv;
+
+namespace {
+
+// where normalized point p lands under the homography with parameters g (the ninth is 1),
+// and optionally the derivative of that with respect to g
+template <typename Parameters>
+Point2d project(const Parameters &g, const Point2d &p, Matx<double, 2, 8>* jacobian) {
+    double w = g[6] * p.x + g[7] * p.y + 1.0;
+    double x = (g[0] * p.x + g[1] * p.y + g[2]) / w;
+    double y = (g[3] * p.x + g[4] * p.y + g[5]) / w;
+    if (jacobian) {
+        Matx<double, 2, 8> &J = *jacobian;
+        J = Matx<double, 2, 8>::zeros();
+        J(0,0) = p.x / w;   J(0,1) = p.y / w;   J(0,2) = 1.0 / w;
+        J(1,3) = p.x / w;   J(1,4) = p.y / w;   J(1,5) = 1.0 / w;
+        J(0,6) = -x * p.x / w;  J(0,7) = -x * p.y / w;
+        J(1,6) = -y * p.x / w;  J(1,7) = -y * p.y / w;
+    }
+    return Point2d(x, y);
+}
+
+// Huber weight and cost of a residual of length distance
+void robustWeight(double distance, double threshold, double &weight, double &cost) {
+    if (distance <= threshold) {
+        weight = 1.0;
+        cost = distance * distance;
+    } else {
+        weight = threshold / distance;
+        cost = 2.0 * threshold * distance - threshold * threshold;
+    }
+}
+
+}
+
+// One pair at a time, every pair writes only its own system so they can run in parallel
+class GlobalAligner::AssemblePairs : public ParallelLoopBody {
+public:
+    AssemblePairs(const GlobalAligner &aligner, const std::vector<ImagePairMatches> &pairs,
+                  const std::vector<BlockVector> &parameters, std::vector<PairSystem> &systems)
+        : aligner(aligner), pairs(pairs), parameters(parameters), systems(systems) {}
+
+    void operator()(const Range &range) const {
+        for (int e = range.start; e < range.end; e++) {
+            const ImagePairMatches &pair = pairs[e];
+            PairSystem &system = systems[e];
+            system.fromFrom = Block::zeros();
+            system.toTo = Block::zeros();
+            system.fromTo = Block::zeros();
+            system.fromGradient = BlockVector::all(0);
+            system.toGradient = BlockVector::all(0);
+            system.cost = 0;
+            system.numPoints = pair.fromPoints.size();
+
+            Matx<double, 2, 8> Jfrom, Jto;
+            for (unsigned k = 0; k < pair.fromPoints.size(); k++) {
+                Point2d a = project(parameters[pair.from], aligner.normalized(pair.fromPoints[k]), &Jfrom);
+                Point2d b = project(parameters[pair.to], aligner.normalized(pair.toPoints[k]), &Jto);
+                Vec2d residual(a.x - b.x, a.y - b.y);
+                double weight, cost;
+                robustWeight(norm(residual), aligner.robustThreshold, weight, cost);
+                system.cost += cost;
+
+                // the residual is from minus to, so the to Jacobian enters negated
+                Matx<double, 8, 2> JfromT = Jfrom.t() * weight;
+                Matx<double, 8, 2> JtoT = Jto.t() * weight;
+                system.fromFrom += JfromT * Jfrom;
+                system.toTo += JtoT * Jto;
+                system.fromTo -= JfromT * Jto;
+                system.fromGradient += JfromT * residual;
+                system.toGradient -= JtoT * residual;
+            }
+        }
+    }
+
+private:
+    const GlobalAligner &aligner;
+    const std::vector<ImagePairMatches> &pairs;
+    const std::vector<BlockVector> &parameters;
+    std::vector<PairSystem> &systems;
+};
+
+GlobalAligner::GlobalAligner(Size imageSize) : maxIterations(50), lastRms(0)
+{
+    pixelScale = 0.5 * sqrt((double)imageSize.width * imageSize.width + (double)imageSize.height * imageSize.height);
+    center = Point2d(imageSize.width / 2.0, imageSize.height / 2.0);
+    normalize = (Mat_<double>(3,3) << 1.0 / pixelScale, 0, -center.x / pixelScale,
+                                      0, 1.0 / pixelScale, -center.y / pixelScale,
+                                      0, 0, 1);
+    setRobustThreshold(3.0);
+}
+
+void GlobalAligner::setMaxIterations(int iterations) {
+    maxIterations = iterations;
+}
+
+void GlobalAligner::setRobustThreshold(double pixels) {
+    robustThreshold = pixels / pixelScale;
+}
+
+double GlobalAligner::rmsError() const {
+    return lastRms;
+}
+
+Point2d GlobalAligner::normalized(const Point2f &pixel) const {
+    return Point2d((pixel.x - center.x) / pixelScale, (pixel.y - center.y) / pixelScale);
+}
+
+GlobalAligner::BlockVector GlobalAligner::toParameters(const Mat &homography) const {
+    Mat G = normalize * homography * normalize.inv();
+    G /= G.at<double>(2,2);
+    BlockVector g;
+    for (int i = 0; i < 8; i++) {
+        g[i] = G.at<double>(i / 3, i % 3);
+    }
+    return g;
+}
+
+Mat GlobalAligner::fromParameters(const BlockVector &g) const {
+    Mat G = (Mat_<double>(3,3) << g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7], 1.0);
+    Mat H = normalize.inv() * G * normalize;
+    return H / H.at<double>(2,2);
+}
+
+bool GlobalAligner::initialize(int numImages, const std::vector<ImagePairMatches> &pairs, int root, std::vector<Mat> &transforms) const {
+    std::vector< std::vector<int> > pairsOf(numImages);
+    for (unsigned e = 0; e < pairs.size(); e++) {
+        pairsOf[pairs[e].from].push_back(e);
+        pairsOf[pairs[e].to].push_back(e);
+    }
+
+    // Prim's algorithm, grows the tree through the pair with the most inliers each time
+    transforms.assign(numImages, Mat());
+    transforms[root] = Mat::eye(3, 3, CV_64FC1);
+    int numPlaced = 1;
+    std::priority_queue< std::pair<int, int> > candidates;  // (inliers, pair)
+    for (unsigned k = 0; k < pairsOf[root].size(); k++) {
+        int e = pairsOf[root][k];
+        candidates.push(std::make_pair((int)pairs[e].fromPoints.size(), e));
+    }
+    while (!candidates.empty()) {
+        const ImagePairMatches &pair = pairs[candidates.top().second];
+        candidates.pop();
+        int added;
+        if (transforms[pair.to].empty()) {
+            added = pair.to;
+            transforms[added] = transforms[pair.from] * pair.homography.inv();
+        } else if (transforms[pair.from].empty()) {
+            added = pair.from;
+            transforms[added] = transforms[pair.to] * pair.homography;
+        } else {
+            continue;   // both ends already placed
+        }
+        transforms[added] /= transforms[added].at<double>(2,2);
+        numPlaced++;
+        for (unsigned k = 0; k < pairsOf[added].size(); k++) {
+            int e = pairsOf[added][k];
+            candidates.push(std::make_pair((int)pairs[e].fromPoints.size(), e));
+        }
+    }
+    return numPlaced == numImages;
+}
+
+void GlobalAligner::assemble(const std::vector<ImagePairMatches> &pairs, const std::vector<BlockVector> &parameters,
+                             std::vector<PairSystem> &systems) const {
+    systems.resize(pairs.size());
+    parallel_for_(Range(0, pairs.size()), AssemblePairs(*this, pairs, parameters, systems));
+}
+
+double GlobalAligner::totalCost(const std::vector<ImagePairMatches> &pairs, const std::vector<BlockVector> &parameters) const {
+    double total = 0;
+    for (unsigned e = 0; e < pairs.size(); e++) {
+        const ImagePairMatches &pair = pairs[e];
+        for (unsigned k = 0; k < pair.fromPoints.size(); k++) {
+            Point2d a = project(parameters[pair.from], normalized(pair.fromPoints[k]), NULL);
+            Point2d b = project(parameters[pair.to], normalized(pair.toPoints[k]), NULL);
+            double weight, cost;
+            robustWeight(norm(a - b), robustThreshold, weight, cost);
+            total += cost;
+        }
+    }
+    return total;
+}
+
+// Solves (A + lambda diag(A)) step = -gradient with preconditioned conjugate gradients.
+// A is never put together, multiplying by it goes through the diagonal blocks and the
+// blocks of each pair.
+void GlobalAligner::solve(const std::vector<ImagePairMatches> &pairs, const std::vector<PairSystem> &systems, int numImages,
+                          int fixed, double lambda, std::vector<BlockVector> &step) const {
+    std::vector< Block > diagonal(numImages, Block::zeros());
+    std::vector< BlockVector > residual(numImages, BlockVector::all(0));
+    for (unsigned e = 0; e < pairs.size(); e++) {
+        diagonal[pairs[e].from] += systems[e].fromFrom;
+        diagonal[pairs[e].to] += systems[e].toTo;
+        residual[pairs[e].from] -= systems[e].fromGradient;
+        residual[pairs[e].to] -= systems[e].toGradient;
+    }
+    std::vector< Block > preconditioner(numImages);
+    for (int i = 0; i < numImages; i++) {
+        for (int k = 0; k < 8; k++) {
+            // the small constant keeps an image with barely enough points invertible
+            diagonal[i](k,k) += lambda * diagonal[i](k,k) + 1e-9;
+        }
+        if (i == fixed) {
+            diagonal[i] = Block::eye();
+            residual[i] = BlockVector::all(0);
+        }
+        preconditioner[i] = diagonal[i].inv(DECOMP_CHOLESKY);
+    }
+
+    step.assign(numImages, BlockVector::all(0));
+    std::vector< BlockVector > z(numImages), direction(numImages), product(numImages);
+    double rz = 0, initialNorm = 0;
+    for (int i = 0; i < numImages; i++) {
+        z[i] = preconditioner[i] * residual[i];
+        direction[i] = z[i];
+        rz += residual[i].dot(z[i]);
+        initialNorm += residual[i].dot(residual[i]);
+    }
+    if (initialNorm == 0) return;
+
+    int maxCgIterations = std::min(8 * numImages, 500);
+    for (int iteration = 0; iteration < maxCgIterations; iteration++) {
+        for (int i = 0; i < numImages; i++) {
+            product[i] = diagonal[i] * direction[i];
+        }
+        for (unsigned e = 0; e < pairs.size(); e++) {
+            int a = pairs[e].from, b = pairs[e].to;
+            if (a == fixed || b == fixed) continue;
+            product[a] += systems[e].fromTo * direction[b];
+            product[b] += systems[e].fromTo.t() * direction[a];
+        }
+        double curvature = 0;
+        for (int i = 0; i < numImages; i++) {
+            curvature += direction[i].dot(product[i]);
+        }
+        if (curvature <= 0) break;
+        double alpha = rz / curvature;
+        double residualNorm = 0;
+        for (int i = 0; i < numImages; i++) {
+            step[i] += direction[i] * alpha;
+            residual[i] -= product[i] * alpha;
+            residualNorm += residual[i].dot(residual[i]);
+        }
+        if (residualNorm < 1e-12 * initialNorm) break;
+
+        double rzNext = 0;
+        for (int i = 0; i < numImages; i++) {
+            z[i] = preconditioner[i] * residual[i];
+            rzNext += residual[i].dot(z[i]);
+        }
+        double beta = rzNext / rz;
+        rz = rzNext;
+        for (int i = 0; i < numImages; i++) {
+            direction[i] = z[i] + direction[i] * beta;
+        }
+    }
+}
+
+void GlobalAligner::refine(const std::vector<ImagePairMatches> &pairs, int fixed, std::vector<Mat> &transforms) {
+    int numImages = transforms.size();
+    std::vector< BlockVector > parameters(numImages);
+    for (int i = 0; i < numImages; i++) {
+        parameters[i] = toParameters(transforms[i]);
+    }
+
+    double cost = totalCost(pairs, parameters);
+    double lambda = 1e-3;
+    std::vector< PairSystem > systems;
+    std::vector< BlockVector > step, candidate(numImages);
+    bool reassemble = true;
+    for (int iteration = 0; iteration < maxIterations; iteration++) {
+        if (reassemble) {
+            assemble(pairs, parameters, systems);
+        }
+        solve(pairs, systems, numImages, fixed, lambda, step);
+        for (int i = 0; i < numImages; i++) {
+            candidate[i] = parameters[i] + step[i];
+        }
+        double candidateCost = totalCost(pairs, candidate);
+        if (candidateCost < cost) {
+            parameters.swap(candidate);
+            lambda = std::max(lambda / 3.0, 1e-9);
+            reassemble = true;
+            bool converged = cost - candidateCost < 1e-8 * cost;
+            cost = candidateCost;
+            if (converged) break;
+        } else {
+            // the linearisation was too optimistic, lean further towards gradient descent
+            lambda *= 4.0;
+            reassemble = false;
+            if (lambda > 1e8) break;
+        }
+    }
+
+    double squared = 0;
+    int numPoints = 0;
+    for (unsigned e = 0; e < pairs.size(); e++) {
+        const ImagePairMatches &pair = pairs[e];
+        for (unsigned k = 0; k < pair.fromPoints.size(); k++) {
+            Point2d d = project(parameters[pair.from], normalized(pair.fromPoints[k]), NULL)
+                      - project(parameters[pair.to], normalized(pair.toPoints[k]), NULL);
+            squared += d.dot(d);
+            numPoints++;
+        }
+    }
+    lastRms = numPoints > 0 ? sqrt(squared / numPoints) * pixelScale : 0;
+
+    for (int i = 0; i < numImages; i++) {
+        if (i != fixed) transforms[i] = fromParameters(parameters[i]);
+    }
+}
@@ -0,0 +1,359 @@
+#include "hammingmatcher.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAMMINGMATCHER_SIMD 1
+#include <immintrin.h>
+#if __GNUC__ >= 8
+#define HAMMINGMATCHER_VPOPCNT 1
+#endif
+#endif
+
+using namespace cv;
+
+namespace {
+
+const int QUERY_BLOCK = 64;     // queries per parallel work item
+const int TRAIN_TILE = 256;     // train rows per tile, 8KB of ORB descriptors
+
+// distances from one query to count train rows step bytes apart
+typedef void (*DistanceRow)(const uchar* query, const uchar* train, size_t step, int count, int bytes, int* distances);
+
+void distancesScalar(const uchar* query, const uchar* train, size_t step, int count, int bytes, int* distances) {
+    for (int t = 0; t < count; t++) {
+        distances[t] = normHamming(query, train + t * step, bytes);
+    }
+}
+
+#ifdef HAMMINGMATCHER_SIMD
+
+// bytes from begin to the end that are not a whole 32 byte chunk
+inline int tailDistance(const uchar* a, const uchar* b, int begin, int bytes) {
+    int distance = 0;
+    int i = begin;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64 x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        distance += __builtin_popcountll(x ^ y);
+    }
+    for (; i < bytes; i++) {
+        distance += __builtin_popcount(a[i] ^ b[i]);
+    }
+    return distance;
+}
+
+__attribute__((target("popcnt")))
+void distancesPopcnt(const uchar* query, const uchar* train, size_t step, int count, int bytes, int* distances) {
+    for (int t = 0; t < count; t++) {
+        distances[t] = tailDistance(query, train + t * step, 0, bytes);
+    }
+}
+
+// popcount of every byte from a 16 entry nibble table, summed into the four 64 bit lanes
+__attribute__((target("avx2")))
+inline __m256i popcountAvx2(__m256i v) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                                     _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+inline int horizontalSum(__m256i v) {
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return (int)(_mm_cvtsi128_si64(sum) + _mm_extract_epi64(sum, 1));
+}
+
+__attribute__((target("avx2,popcnt")))
+void distancesAvx2(const uchar* query, const uchar* train, size_t step, int count, int bytes, int* distances) {
+    int chunks = bytes / 32;
+    if (bytes == 32) {
+        // ORB, the query stays in a register for the whole tile
+        __m256i q = _mm256_loadu_si256((const __m256i*)query);
+        for (int t = 0; t < count; t++) {
+            __m256i x = _mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)(train + t * step)));
+            distances[t] = horizontalSum(popcountAvx2(x));
+        }
+        return;
+    }
+    for (int t = 0; t < count; t++) {
+        const uchar* row = train + t * step;
+        __m256i sum = _mm256_setzero_si256();
+        for (int c = 0; c < chunks; c++) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(query + 32 * c)),
+                                         _mm256_loadu_si256((const __m256i*)(row + 32 * c)));
+            sum = _mm256_add_epi64(sum, popcountAvx2(x));
+        }
+        distances[t] = horizontalSum(sum) + tailDistance(query, row, chunks * 32, bytes);
+    }
+}
+
+#ifdef HAMMINGMATCHER_VPOPCNT
+
+__attribute__((target("avx512f,avx512vl,avx512vpopcntdq,avx2,popcnt")))
+void distancesVpopcnt(const uchar* query, const uchar* train, size_t step, int count, int bytes, int* distances) {
+    int chunks = bytes / 32;
+    if (bytes == 32) {
+        __m256i q = _mm256_loadu_si256((const __m256i*)query);
+        for (int t = 0; t < count; t++) {
+            __m256i x = _mm256_xor_si256(q, _mm256_loadu_si256((const __m256i*)(train + t * step)));
+            distances[t] = horizontalSum(_mm256_popcnt_epi64(x));
+        }
+        return;
+    }
+    for (int t = 0; t < count; t++) {
+        const uchar* row = train + t * step;
+        __m256i sum = _mm256_setzero_si256();
+        for (int c = 0; c < chunks; c++) {
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(query + 32 * c)),
+                                         _mm256_loadu_si256((const __m256i*)(row + 32 * c)));
+            sum = _mm256_add_epi64(sum, _mm256_popcnt_epi64(x));
+        }
+        distances[t] = horizontalSum(sum) + tailDistance(query, row, chunks * 32, bytes);
+    }
+}
+
+#endif
+#endif
+
+struct Kernel {
+    DistanceRow row;
+    const char* name;
+};
+
+Kernel selectKernel() {
+    Kernel selected = {distancesScalar, "scalar"};
+#ifdef HAMMINGMATCHER_SIMD
+    __builtin_cpu_init();
+#ifdef HAMMINGMATCHER_VPOPCNT
+    if (__builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512vl")) {
+        selected.row = distancesVpopcnt;
+        selected.name = "avx512 vpopcntdq";
+        return selected;
+    }
+#endif
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        selected.row = distancesAvx2;
+        selected.name = "avx2";
+    } else if (__builtin_cpu_supports("popcnt")) {
+        selected.row = distancesPopcnt;
+        selected.name = "popcnt";
+    }
+#endif
+    return selected;
+}
+
+const Kernel &kernel() {
+    static const Kernel selected = selectKernel();
+    return selected;
+}
+
+// keeps the k smallest of a query sorted, a tie stays with the earlier train row as in BFMatcher
+inline void insertBest(int* bestDistance, int* bestIndex, int k, int distance, int index) {
+    int i = k - 1;
+    if (distance >= bestDistance[i]) return;
+    while (i > 0 && distance < bestDistance[i - 1]) {
+        bestDistance[i] = bestDistance[i - 1];
+        bestIndex[i] = bestIndex[i - 1];
+        i--;
+    }
+    bestDistance[i] = distance;
+    bestIndex[i] = index;
+}
+
+}
+
+// One block of queries against every train descriptor, tile by tile
+class HammingMatcher::MatchBlocks : public ParallelLoopBody {
+public:
+    MatchBlocks(const Mat &queries, const Mat &train, int k, bool crossCheck,
+                std::vector<int> &bestDistance, std::vector<int> &bestIndex,
+                std::vector<int> &trainDistance, std::vector<int> &trainQuery)
+        : queries(queries), train(train), k(k), crossCheck(crossCheck),
+          bestDistance(bestDistance), bestIndex(bestIndex), trainDistance(trainDistance), trainQuery(trainQuery) {}
+
+    void operator()(const Range &range) const {
+        DistanceRow row = kernel().row;
+        int numTrain = train.rows;
+        int bytes = queries.cols;
+        int distances[TRAIN_TILE];
+        for (int block = range.start; block < range.end; block++) {
+            int begin = block * QUERY_BLOCK;
+            int end = std::min(begin + QUERY_BLOCK, queries.rows);
+            int* blockDistance = crossCheck ? &trainDistance[(size_t)block * numTrain] : NULL;
+            int* blockQuery = crossCheck ? &trainQuery[(size_t)block * numTrain] : NULL;
+            for (int tile = 0; tile < numTrain; tile += TRAIN_TILE) {
+                int count = std::min(TRAIN_TILE, numTrain - tile);
+                for (int q = begin; q < end; q++) {
+                    row(queries.ptr(q), train.ptr(tile), train.step, count, bytes, distances);
+                    int* best = &bestDistance[(size_t)q * k];
+                    int* index = &bestIndex[(size_t)q * k];
+                    for (int t = 0; t < count; t++) {
+                        insertBest(best, index, k, distances[t], tile + t);
+                    }
+                    if (crossCheck) {
+                        // queries go up so a strict compare keeps the first of equally good ones
+                        for (int t = 0; t < count; t++) {
+                            if (distances[t] < blockDistance[tile + t]) {
+                                blockDistance[tile + t] = distances[t];
+                                blockQuery[tile + t] = q;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    const Mat &queries;
+    const Mat &train;
+    int k;
+    bool crossCheck;
+    std::vector<int> &bestDistance;
+    std::vector<int> &bestIndex;
+    std::vector<int> &trainDistance;
+    std::vector<int> &trainQuery;
+};
+
+HammingMatcher::HammingMatcher(bool checkMutual) : crossCheck(checkMutual), trained(false)
+{
+}
+
+HammingMatcher::~HammingMatcher()
+{
+}
+
+const char* HammingMatcher::kernelName() {
+    return kernel().name;
+}
+
+void HammingMatcher::add(const std::vector<Mat> &descriptors) {
+    DescriptorMatcher::add(descriptors);
+    trained = false;
+}
+
+bool HammingMatcher::isMaskSupported() const {
+    return false;
+}
+
+void HammingMatcher::train() {
+    if (trained) return;
+    int total = 0;
+    for (unsigned i = 0; i < trainDescCollection.size(); i++) {
+        total += trainDescCollection[i].rows;
+    }
+    imageOf.resize(total);
+    rowInImage.resize(total);
+    merged.release();
+    if (total > 0) {
+        vconcat(trainDescCollection, merged);
+        int row = 0;
+        for (unsigned i = 0; i < trainDescCollection.size(); i++) {
+            for (int r = 0; r < trainDescCollection[i].rows; r++, row++) {
+                imageOf[row] = i;
+                rowInImage[row] = r;
+            }
+        }
+    }
+    trained = true;
+}
+
+void HammingMatcher::clear() {
+    DescriptorMatcher::clear();
+    merged.release();
+    imageOf.clear();
+    rowInImage.clear();
+    trained = false;
+}
+
+Ptr<DescriptorMatcher> HammingMatcher::clone(bool emptyTrainData) const {
+    HammingMatcher* matcher = new HammingMatcher(crossCheck);
+    if (!emptyTrainData) {
+        for (unsigned i = 0; i < trainDescCollection.size(); i++) {
+            matcher->trainDescCollection.push_back(trainDescCollection[i].clone());
+        }
+    }
+    return matcher;
+}
+
+void HammingMatcher::knnMatchImpl(const Mat &queryDescriptors, std::vector< std::vector<DMatch> > &matches, int k,
+                                  const std::vector<Mat> &/*masks*/, bool compactResult) {
+    train();
+    matches.clear();
+    if (queryDescriptors.empty() || merged.empty()) return;
+    CV_Assert(queryDescriptors.type() == CV_8U && merged.type() == CV_8U && queryDescriptors.cols == merged.cols);
+
+    int numQuery = queryDescriptors.rows;
+    int numTrain = merged.rows;
+    int numBlocks = (numQuery + QUERY_BLOCK - 1) / QUERY_BLOCK;
+    // above any real distance, the descriptors have cols * 8 bits
+    int unset = queryDescriptors.cols * 8 + 1;
+    std::vector< int > bestDistance((size_t)numQuery * k, unset);
+    std::vector< int > bestIndex((size_t)numQuery * k, -1);
+    std::vector< int > trainDistance, trainQuery;
+    if (crossCheck) {
+        trainDistance.assign((size_t)numBlocks * numTrain, unset);
+        trainQuery.assign((size_t)numBlocks * numTrain, -1);
+    }
+    parallel_for_(Range(0, numBlocks),
+                  MatchBlocks(queryDescriptors, merged, k, crossCheck, bestDistance, bestIndex, trainDistance, trainQuery));
+
+    // the best query of each train row over all blocks, earlier blocks win ties
+    for (int b = 1; b < numBlocks && crossCheck; b++) {
+        for (int t = 0; t < numTrain; t++) {
+            if (trainDistance[(size_t)b * numTrain + t] < trainDistance[t]) {
+                trainDistance[t] = trainDistance[(size_t)b * numTrain + t];
+                trainQuery[t] = trainQuery[(size_t)b * numTrain + t];
+            }
+        }
+    }
+
+    matches.reserve(numQuery);
+    for (int q = 0; q < numQuery; q++) {
+        const int* best = &bestDistance[(size_t)q * k];
+        const int* index = &bestIndex[(size_t)q * k];
+        bool mutual = !crossCheck || (index[0] >= 0 && trainQuery[index[0]] == q);
+        if (!mutual) {
+            if (!compactResult) matches.push_back(std::vector< DMatch >());
+            continue;
+        }
+        matches.push_back(std::vector< DMatch >());
+        std::vector< DMatch > &queryMatches = matches.back();
+        for (int i = 0; i < k && index[i] >= 0; i++) {
+            queryMatches.push_back(DMatch(q, rowInImage[index[i]], imageOf[index[i]], (float)best[i]));
+        }
+    }
+}
+
+void HammingMatcher::radiusMatchImpl(const Mat &queryDescriptors, std::vector< std::vector<DMatch> > &matches, float maxDistance,
+                                     const std::vector<Mat> &/*masks*/, bool compactResult) {
+    train();
+    matches.clear();
+    if (queryDescriptors.empty() || merged.empty()) return;
+    CV_Assert(queryDescriptors.type() == CV_8U && merged.type() == CV_8U && queryDescriptors.cols == merged.cols);
+
+    // there is no single best match to check within a radius, cross checking does not apply
+    DistanceRow row = kernel().row;
+    int distances[TRAIN_TILE];
+    for (int q = 0; q < queryDescriptors.rows; q++) {
+        std::vector< DMatch > queryMatches;
+        for (int tile = 0; tile < merged.rows; tile += TRAIN_TILE) {
+            int count = std::min(TRAIN_TILE, merged.rows - tile);
+            row(queryDescriptors.ptr(q), merged.ptr(tile), merged.step, count, queryDescriptors.cols, distances);
+            for (int t = 0; t < count; t++) {
+                if (distances[t] <= maxDistance) {
+                    queryMatches.push_back(DMatch(q, rowInImage[tile + t], imageOf[tile + t], (float)distances[t]));
+                }
+            }
+        }
+        std::stable_sort(queryMatches.begin(), queryMatches.end());
+        if (compactResult && queryMatches.empty()) continue;
+        matches.push_back(queryMatches);
+    }
+}
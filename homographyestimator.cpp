@@ -0,0 +1,491 @@
+#include "homographyestimator.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HOMOGRAPHYESTIMATOR_AVX2 1
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+
+namespace {
+
+const int SAMPLE_SIZE = 4;                  // for a homography, the biggest sample of any model
+const int LOCAL_OPTIMISATION_STEPS = 4;    // refits of a new best model while they keep finding more inliers
+const double MIN_TRIANGLE_AREA = 1.0;      // in pixels, three sample points closer to a line than this are degenerate
+const double MIN_SAMPLE_SPAN = 1.0;        // in pixels, two sample points closer than this are degenerate
+const double ESCALATION_RADIUS = 4.0;      // a richer model is fitted to the points this many thresholds from the simpler one
+const double ESCALATION_GAIN = 0.05;       // and kept if it has this much more inliers
+
+int sampleSize(HomographyEstimator::Model model) {
+    switch (model) {
+    case HomographyEstimator::SIMILARITY: return 2;
+    case HomographyEstimator::AFFINE: return 3;
+    default: return SAMPLE_SIZE;
+    }
+}
+
+// The points as flat float arrays, what the inlier count runs over
+struct PointSet {
+    PointSet(const std::vector<Point2f> &from, const std::vector<Point2f> &to)
+        : fromX(from.size()), fromY(from.size()), toX(to.size()), toY(to.size()) {
+        for (unsigned i = 0; i < from.size(); i++) {
+            fromX[i] = from[i].x;
+            fromY[i] = from[i].y;
+            toX[i] = to[i].x;
+            toY[i] = to[i].y;
+        }
+    }
+    int size() const { return fromX.size(); }
+    std::vector<float> fromX, fromY, toX, toY;
+};
+
+bool collinear(const std::vector<float> &x, const std::vector<float> &y, int a, int b, int c) {
+    double cross = ((double)x[b] - x[a]) * ((double)y[c] - y[a]) - ((double)y[b] - y[a]) * ((double)x[c] - x[a]);
+    return std::abs(cross) < 2 * MIN_TRIANGLE_AREA;
+}
+
+bool tooClose(const std::vector<float> &x, const std::vector<float> &y, int a, int b) {
+    double dx = (double)x[b] - x[a], dy = (double)y[b] - y[a];
+    return dx * dx + dy * dy < MIN_SAMPLE_SPAN * MIN_SAMPLE_SPAN;
+}
+
+// Two points on top of each other or any three on a line, on either side, and the model
+// through them isn't pinned down
+bool degenerate(const PointSet &points, const int sample[SAMPLE_SIZE], int size) {
+    if (size == 2) {
+        return tooClose(points.fromX, points.fromY, sample[0], sample[1])
+            || tooClose(points.toX, points.toY, sample[0], sample[1]);
+    }
+    if (size == 3) {
+        return collinear(points.fromX, points.fromY, sample[0], sample[1], sample[2])
+            || collinear(points.toX, points.toY, sample[0], sample[1], sample[2]);
+    }
+    for (int skip = 0; skip < SAMPLE_SIZE; skip++) {
+        int t[3], k = 0;
+        for (int i = 0; i < SAMPLE_SIZE; i++) {
+            if (i != skip) t[k++] = sample[i];
+        }
+        if (collinear(points.fromX, points.fromY, t[0], t[1], t[2])) return true;
+        if (collinear(points.toX, points.toY, t[0], t[1], t[2])) return true;
+    }
+    return false;
+}
+
+// scale and shift that put the sample points around the origin at an average distance of sqrt(2)
+void normalisation(const std::vector<float> &x, const std::vector<float> &y, const int sample[SAMPLE_SIZE],
+                   double &cx, double &cy, double &scale) {
+    cx = cy = 0;
+    for (int i = 0; i < SAMPLE_SIZE; i++) {
+        cx += x[sample[i]];
+        cy += y[sample[i]];
+    }
+    cx /= SAMPLE_SIZE;
+    cy /= SAMPLE_SIZE;
+    double distance = 0;
+    for (int i = 0; i < SAMPLE_SIZE; i++) {
+        distance += std::sqrt((x[sample[i]] - cx) * (x[sample[i]] - cx) + (y[sample[i]] - cy) * (y[sample[i]] - cy));
+    }
+    distance /= SAMPLE_SIZE;
+    scale = distance > 0 ? std::sqrt(2.0) / distance : 1.0;
+}
+
+// The homography through four correspondences (h33 = 1): the normalised 8x8 system of the
+// DLT solved by elimination. False if the points don't pin it down.
+bool solveHomography(const PointSet &points, const int sample[SAMPLE_SIZE], double H[9]) {
+    double fcx, fcy, fs, tcx, tcy, ts;
+    normalisation(points.fromX, points.fromY, sample, fcx, fcy, fs);
+    normalisation(points.toX, points.toY, sample, tcx, tcy, ts);
+
+    double A[8][9];
+    for (int i = 0; i < SAMPLE_SIZE; i++) {
+        double x = (points.fromX[sample[i]] - fcx) * fs;
+        double y = (points.fromY[sample[i]] - fcy) * fs;
+        double u = (points.toX[sample[i]] - tcx) * ts;
+        double v = (points.toY[sample[i]] - tcy) * ts;
+        double rowU[9] = { x, y, 1, 0, 0, 0, -u * x, -u * y, u };
+        double rowV[9] = { 0, 0, 0, x, y, 1, -v * x, -v * y, v };
+        std::copy(rowU, rowU + 9, A[2 * i]);
+        std::copy(rowV, rowV + 9, A[2 * i + 1]);
+    }
+    for (int col = 0; col < 8; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < 8; row++) {
+            if (std::abs(A[row][col]) > std::abs(A[pivot][col])) pivot = row;
+        }
+        if (std::abs(A[pivot][col]) < 1e-10) return false;
+        if (pivot != col) {
+            for (int k = 0; k < 9; k++) std::swap(A[pivot][k], A[col][k]);
+        }
+        for (int row = col + 1; row < 8; row++) {
+            double f = A[row][col] / A[col][col];
+            for (int k = col; k < 9; k++) A[row][k] -= f * A[col][k];
+        }
+    }
+    double h[9];
+    h[8] = 1.0;
+    for (int row = 7; row >= 0; row--) {
+        double sum = A[row][8];
+        for (int k = row + 1; k < 8; k++) sum -= A[row][k] * h[k];
+        h[row] = sum / A[row][row];
+    }
+
+    // undo the normalisation, H = T_to^-1 * h * T_from
+    double m[9];
+    for (int r = 0; r < 3; r++) {
+        m[3 * r] = h[3 * r] * fs;
+        m[3 * r + 1] = h[3 * r + 1] * fs;
+        m[3 * r + 2] = h[3 * r + 2] - fs * (fcx * h[3 * r] + fcy * h[3 * r + 1]);
+    }
+    for (int c = 0; c < 3; c++) {
+        H[c] = m[c] / ts + tcx * m[6 + c];
+        H[3 + c] = m[3 + c] / ts + tcy * m[6 + c];
+        H[6 + c] = m[6 + c];
+    }
+    double last = H[8];
+    if (std::abs(last) < 1e-12) return false;
+    for (int i = 0; i < 9; i++) {
+        H[i] /= last;
+    }
+    return true;
+}
+
+// The least squares similarity or affine map of the n points in index, exact through a minimal
+// sample. Both are linear in their parameters, around the centroids they have closed forms.
+bool fitLinear(const PointSet &points, const int *index, int n, HomographyEstimator::Model model, double H[9]) {
+    double fcx = 0, fcy = 0, tcx = 0, tcy = 0;
+    for (int i = 0; i < n; i++) {
+        fcx += points.fromX[index[i]];
+        fcy += points.fromY[index[i]];
+        tcx += points.toX[index[i]];
+        tcy += points.toY[index[i]];
+    }
+    fcx /= n;
+    fcy /= n;
+    tcx /= n;
+    tcy /= n;
+    double sxx = 0, sxy = 0, syy = 0, sxu = 0, sxv = 0, syu = 0, syv = 0;
+    for (int i = 0; i < n; i++) {
+        double x = points.fromX[index[i]] - fcx, y = points.fromY[index[i]] - fcy;
+        double u = points.toX[index[i]] - tcx, v = points.toY[index[i]] - tcy;
+        sxx += x * x;
+        sxy += x * y;
+        syy += y * y;
+        sxu += x * u;
+        sxv += x * v;
+        syu += y * u;
+        syv += y * v;
+    }
+
+    double a, b, d, e;
+    if (model == HomographyEstimator::SIMILARITY) {
+        // [a -d; d a], a scaled rotation
+        double norm = sxx + syy;
+        if (norm < MIN_SAMPLE_SPAN * MIN_SAMPLE_SPAN) return false;
+        a = e = (sxu + syv) / norm;
+        d = (sxv - syu) / norm;
+        b = -d;
+    } else {
+        double det = sxx * syy - sxy * sxy;
+        if (std::abs(det) <= 1e-9 * (sxx + syy) * (sxx + syy)) return false;
+        a = (sxu * syy - syu * sxy) / det;
+        b = (syu * sxx - sxu * sxy) / det;
+        d = (sxv * syy - syv * sxy) / det;
+        e = (syv * sxx - sxv * sxy) / det;
+    }
+    double h[9] = { a, b, tcx - a * fcx - b * fcy,
+                    d, e, tcy - d * fcx - e * fcy,
+                    0, 0, 1 };
+    std::copy(h, h + 9, H);
+    return true;
+}
+
+bool solveMinimal(const PointSet &points, HomographyEstimator::Model model, const int sample[SAMPLE_SIZE], double H[9]) {
+    if (model == HomographyEstimator::HOMOGRAPHY) {
+        return solveHomography(points, sample, H);
+    }
+    return fitLinear(points, sample, sampleSize(model), model, H);
+}
+
+// a point is an inlier if H puts it within the threshold of its match, as findHomography decides
+int countScalar(const PointSet &points, const float h[9], float threshold2, int begin, int end, uchar* mask) {
+    int count = 0;
+    for (int i = begin; i < end; i++) {
+        float x = points.fromX[i], y = points.fromY[i];
+        float w = 1.0f / (h[6] * x + h[7] * y + h[8]);
+        float dx = (h[0] * x + h[1] * y + h[2]) * w - points.toX[i];
+        float dy = (h[3] * x + h[4] * y + h[5]) * w - points.toY[i];
+        bool inlier = dx * dx + dy * dy <= threshold2;
+        if (mask) mask[i] = inlier;
+        count += inlier;
+    }
+    return count;
+}
+
+#ifdef HOMOGRAPHYESTIMATOR_AVX2
+
+__attribute__((target("avx2")))
+int countAvx2(const PointSet &points, const float h[9], float threshold2) {
+    __m256 h0 = _mm256_set1_ps(h[0]), h1 = _mm256_set1_ps(h[1]), h2 = _mm256_set1_ps(h[2]);
+    __m256 h3 = _mm256_set1_ps(h[3]), h4 = _mm256_set1_ps(h[4]), h5 = _mm256_set1_ps(h[5]);
+    __m256 h6 = _mm256_set1_ps(h[6]), h7 = _mm256_set1_ps(h[7]), h8 = _mm256_set1_ps(h[8]);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 limit = _mm256_set1_ps(threshold2);
+    int count = 0;
+    int size = points.size();
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m256 x = _mm256_loadu_ps(&points.fromX[i]);
+        __m256 y = _mm256_loadu_ps(&points.fromY[i]);
+        __m256 w = _mm256_div_ps(one, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h6, x), _mm256_mul_ps(h7, y)), h8));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h0, x), _mm256_mul_ps(h1, y)), h2), w);
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h3, x), _mm256_mul_ps(h4, y)), h5), w);
+        __m256 dx = _mm256_sub_ps(u, _mm256_loadu_ps(&points.toX[i]));
+        __m256 dy = _mm256_sub_ps(v, _mm256_loadu_ps(&points.toY[i]));
+        __m256 error = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(error, limit, _CMP_LE_OQ)));
+    }
+    return count + countScalar(points, h, threshold2, i, size, NULL);
+}
+
+#endif
+
+int countInliers(const PointSet &points, const Mat &H, double threshold, uchar* mask = NULL) {
+    float h[9];
+    for (int i = 0; i < 9; i++) {
+        h[i] = (float)H.at<double>(i / 3, i % 3);
+    }
+    float threshold2 = (float)(threshold * threshold);
+#ifdef HOMOGRAPHYESTIMATOR_AVX2
+    if (!mask && HomographyEstimator::usingAvx2()) {
+        return countAvx2(points, h, threshold2);
+    }
+#endif
+    return countScalar(points, h, threshold2, 0, points.size(), mask);
+}
+
+// Model fitted to the points H has within threshold. A homography by least squares then
+// Levenberg-Marquardt on their reprojection error, the others by plain least squares.
+Mat refit(const std::vector<Point2f> &from, const std::vector<Point2f> &to, const PointSet &points,
+          const Mat &H, double threshold, HomographyEstimator::Model model) {
+    std::vector<uchar> mask(points.size());
+    countInliers(points, H, threshold, &mask[0]);
+    if (model != HomographyEstimator::HOMOGRAPHY) {
+        std::vector<int> index;
+        for (unsigned i = 0; i < mask.size(); i++) {
+            if (mask[i]) index.push_back(i);
+        }
+        double h[9];
+        if ((int)index.size() < sampleSize(model) || !fitLinear(points, &index[0], index.size(), model, h)) {
+            return Mat();
+        }
+        return Mat(3, 3, CV_64FC1, h).clone();
+    }
+    std::vector<Point2f> inFrom, inTo;
+    for (unsigned i = 0; i < mask.size(); i++) {
+        if (!mask[i]) continue;
+        inFrom.push_back(from[i]);
+        inTo.push_back(to[i]);
+    }
+    if (inFrom.size() < (unsigned)SAMPLE_SIZE) return Mat();
+    return findHomography(inFrom, inTo, 0);
+}
+
+// draws before a sample of only inliers has turned up with the given confidence
+int iterationsFor(int inliers, int count, int sampleSize, double confidence, int maxIterations) {
+    double p = std::pow((double)inliers / count, sampleSize);
+    if (p >= 1.0) return 0;
+    if (p <= 0.0) return maxIterations;
+    double k = std::log(1.0 - confidence) / std::log(1.0 - p);
+    return k >= maxIterations ? maxIterations : (int)std::ceil(k);
+}
+
+// What a sample of sampleSize needs at the lowest inlier ratio maxIterations homography samples
+// can still cope with, a search for a simpler model gets no more
+int budgetFor(int sampleSize, double confidence, int maxIterations) {
+    double ratio = std::pow(1.0 - std::pow(1.0 - confidence, 1.0 / maxIterations), 1.0 / SAMPLE_SIZE);
+    return std::min(maxIterations, iterationsFor(cvCeil(ratio * 1000), 1000, sampleSize, confidence, maxIterations));
+}
+
+}
+
+HomographyEstimator::HomographyEstimator(Method method, double reprojectionThreshold, double confidence, int maxIterations)
+    : method(method), modelSelection(false), threshold(reprojectionThreshold), confidence(confidence),
+      maxIterations(maxIterations)
+{
+}
+
+void HomographyEstimator::setMethod(Method m) {
+    method = m;
+}
+
+HomographyEstimator::Method HomographyEstimator::getMethod() const {
+    return method;
+}
+
+void HomographyEstimator::setModelSelection(bool enabled) {
+    modelSelection = enabled;
+}
+
+bool HomographyEstimator::getModelSelection() const {
+    return modelSelection;
+}
+
+bool HomographyEstimator::usingAvx2() {
+#ifdef HOMOGRAPHYESTIMATOR_AVX2
+    static bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+Mat HomographyEstimator::estimate(const std::vector<Point2f> &from, const std::vector<Point2f> &to,
+                                  std::vector<uchar> *inliers, Report *report) const {
+    int64 start = getTickCount();
+    std::vector<uchar> mask;
+    Mat H;
+    int iterations = 0;
+    Model model = HOMOGRAPHY;
+    if (from.size() >= (unsigned)SAMPLE_SIZE && from.size() == to.size()) {
+        if (method == RANSAC) {
+            H = findHomography( from, to, CV_RANSAC, threshold, mask );
+        } else if (modelSelection) {
+            H = selectModel(from, to, mask, iterations, model);
+        } else {
+            H = prosac(from, to, HOMOGRAPHY, maxIterations, mask, iterations);
+        }
+    }
+    if (H.empty()) {
+        mask.assign(from.size(), 0);
+    }
+    if (report) {
+        report->iterations = iterations;
+        report->inliers = mask.empty() ? 0 : countNonZero(mask);
+        report->milliseconds = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        report->model = model;
+    }
+    if (inliers) {
+        inliers->swap(mask);
+    }
+    return H;
+}
+
+// Chum and Matas, "Matching with PROSAC - progressive sample consensus", CVPR 2005. Sample t is
+// drawn from the best n points, n grows on the schedule that makes the first T_N samples as likely
+// to hold a given subset as plain RANSAC would be.
+Mat HomographyEstimator::prosac(const std::vector<Point2f> &from, const std::vector<Point2f> &to,
+                                Model model, int budget, std::vector<uchar> &mask, int &iterations) const {
+    PointSet points(from, to);
+    int count = points.size();
+    int m = sampleSize(model);
+    RNG rng(count);     // the same matches give the same model
+
+    double Tn = budget;
+    for (int i = 0; i < m; i++) {
+        Tn *= (double)(m - i) / (count - i);
+    }
+    int TnPrime = 1;
+    int n = m;
+
+    Mat best;
+    int bestCount = 0;
+    int limit = budget;
+    int t = 0;
+    while (t < limit) {
+        t++;
+        if (t > TnPrime && n < count) {
+            double next = Tn * (n + 1) / (n + 1 - m);
+            TnPrime += std::max(1, (int)std::ceil(next - Tn));
+            Tn = next;
+            n++;
+        }
+        // until the schedule moves on the newest point is in every sample
+        int sample[SAMPLE_SIZE];
+        int drawn = 0;
+        int pool = n;
+        if (TnPrime >= t) {
+            sample[m - 1] = n - 1;
+            pool = n - 1;
+        }
+        int needed = TnPrime >= t ? m - 1 : m;
+        while (drawn < needed) {
+            int candidate = rng.uniform(0, pool);
+            if (std::find(sample, sample + drawn, candidate) == sample + drawn) {
+                sample[drawn++] = candidate;
+            }
+        }
+        if (degenerate(points, sample, m)) continue;
+
+        double h[9];
+        if (!solveMinimal(points, model, sample, h)) continue;
+        Mat H(3, 3, CV_64FC1, h);
+        int found = countInliers(points, H, threshold);
+        if (found <= bestCount) continue;
+        best = H.clone();
+        bestCount = found;
+
+        for (int step = 0; step < LOCAL_OPTIMISATION_STEPS; step++) {
+            Mat refined = refit(from, to, points, best, threshold, model);
+            if (refined.empty()) break;
+            int refinedCount = countInliers(points, refined, threshold);
+            if (refinedCount <= bestCount) break;
+            best = refined;
+            bestCount = refinedCount;
+        }
+        limit = std::min(limit, std::max(t, iterationsFor(bestCount, count, m, confidence, budget)));
+    }
+    iterations = t;
+    if (best.empty()) return Mat();
+
+    // the final model is fitted to all of its inliers, not just the sample it came from
+    Mat refined = refit(from, to, points, best, threshold, model);
+    if (!refined.empty() && countInliers(points, refined, threshold) >= bestCount) {
+        best = refined;
+    }
+    mask.resize(count);
+    countInliers(points, best, threshold, &mask[0]);
+    return best;
+}
+
+// A similarity first. An affine map and then a homography are fitted to the points near the best
+// model so far and refined on their own inliers, each replaces it only if it has clearly more: a
+// richer model always fits the noise a little better, only a real change of view makes it pay.
+Mat HomographyEstimator::selectModel(const std::vector<Point2f> &from, const std::vector<Point2f> &to,
+                                     std::vector<uchar> &mask, int &iterations, Model &model) const {
+    model = SIMILARITY;
+    Mat best = prosac(from, to, SIMILARITY, budgetFor(sampleSize(SIMILARITY), confidence, maxIterations), mask, iterations);
+    if (best.empty()) {
+        // nothing like a similarity at all, the full search may still find a homography
+        int more = 0;
+        model = HOMOGRAPHY;
+        best = prosac(from, to, HOMOGRAPHY, maxIterations, mask, more);
+        iterations += more;
+        return best;
+    }
+
+    PointSet points(from, to);
+    int bestCount = countInliers(points, best, threshold);
+    for (int richer = AFFINE; richer <= HOMOGRAPHY; richer++) {
+        Model candidateModel = (Model)richer;
+        Mat candidate = refit(from, to, points, best, threshold * ESCALATION_RADIUS, candidateModel);
+        if (candidate.empty()) continue;
+        int candidateCount = countInliers(points, candidate, threshold);
+        for (int step = 0; step < LOCAL_OPTIMISATION_STEPS; step++) {
+            Mat refined = refit(from, to, points, candidate, threshold, candidateModel);
+            if (refined.empty()) break;
+            int refinedCount = countInliers(points, refined, threshold);
+            if (refinedCount <= candidateCount) break;
+            candidate = refined;
+            candidateCount = refinedCount;
+        }
+        if (candidateCount <= bestCount * (1.0 + ESCALATION_GAIN)) continue;
+        best = candidate;
+        bestCount = candidateCount;
+        model = candidateModel;
+    }
+    mask.resize(points.size());
+    countInliers(points, best, threshold, &mask[0]);
+    return best;
+}
@@ -0,0 +1,21 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <string>
+#include <opencv2/opencv.hpp>
+
+class ImageLoader
+{
+public:
+    // The same size as imread followed by resize(scale, scale, INTER_AREA) and close to
+    // it, not pixel for pixel the same. JPEGs are decoded straight to the smallest 1/2,
+    // 1/4 or 1/8 size that is still at least as big as the target (libjpeg scales in
+    // the DCT domain so the full size image never exists) and only the remaining factor
+    // is done with INTER_AREA.
+    static cv::Mat loadScaled(const std::string &path, double scale);
+private:
+    ImageLoader();  // the methods are all static so there is no need to instantiate this class
+    static bool decodeJpeg(const std::string &path, double scale, cv::Mat &image);
+};
+
+#endif // IMAGELOADER_H
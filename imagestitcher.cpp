@@ -1,5 +1,13 @@
 #include "imagestitcher.h"
 #include "sharedfunctions.h"
+#include "featuretracker.h"
+#include "hammingmatcher.h"
+#include "homographyestimator.h"
+#include "imageloader.h"
+#include "matchfilter.h"
+#include "metadataparser.h"
+#include "mosaicexporter.h"
+#include "warpcomposite.h"
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/stitching/stitcher.hpp>
@@ -10,23 +18,104 @@
 #include "opencv2/imgproc/imgproc.hpp"
 
 #include <QImage>
+#include <QMutexLocker>
+#include <QVector>
+#include <algorithm>
 #include <fstream>
+#include <sstream>
+#include <climits>
 
 
 using namespace cv;
 
-StitchingUpdateData* stitchImages(Mat &objImage, Mat &sceneImage);
+namespace {
 
-StitchingUpdateData::StitchingUpdateData() : QObject(NULL)
+const int GLOBAL_NEIGHBOURS = 2;            // images this close in input order are always matched in GLOBAL mode
+const int GLOBAL_MIN_INLIERS = 15;          // fewer and a pair is left out of the solve
+const int GLOBAL_MAX_POINTS_PER_PAIR = 100;
+const int SURF_MIN_HESSIAN = 400;
+const int ORB_MAX_FEATURES = 5000;          // the default is 500
+const double PHASE_GUESS_TOLERANCE = 0.05;  // of the image diagonal, how far off the phase guess is taken to be
+const int TRACKING_MAX_CORNERS = 1000;
+const int TRACKING_MIN_INLIERS = 15;        // fewer and the corners are detected all over again
+const double FULL_MATCHES_REACH = 1.0;      // of the longer image side, how far around the last image FULL_MATCHES searches
+
+}
+
+StitchingUpdateData::StitchingUpdateData() : curIndex(0), totalImages(0), success(false), sceneScale(1.0)
 {
 }
 
+bool StitchingUpdateData::hasScene() const {
+    return !scene.empty();
+}
+
+Mat StitchingUpdateData::currentScene() const {
+    if (scene.empty()) return Mat();
+    return scene.render(sceneScale);
+}
+
+Mat StitchingUpdateData::currentFeatureMatches() const {
+    if (matchPairs.empty()) return Mat();
+    Mat sceneImage = matchSceneImage;
+    if (sceneImage.empty()) {
+        cvtColor( matchScene.render(), sceneImage, CV_BGR2GRAY );
+    }
+    Mat img_matches;
+    drawMatches( matchObject, matchedObject, sceneImage, matchedScene,
+                 matchPairs, img_matches, Scalar::all(-1), Scalar::all(-1),
+                 vector<char>(), DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS );
+    return img_matches;
+}
+
+void StitchingUpdateData::setScene(const MosaicSnapshot &snapshot, double scale) {
+    scene = snapshot;
+    sceneScale = scale;
+}
+
+void StitchingUpdateData::setMatches(const Mat &object, const std::vector<KeyPoint> &objFeatures,
+                                     const Mat &sceneImage, const std::vector<KeyPoint> &sceneFeatures,
+                                     const std::vector<DMatch> &matches) {
+    matchObject = object;
+    matchSceneImage = sceneImage;
+    matchScene = MosaicSnapshot();
+    keepMatched(objFeatures, sceneFeatures, matches, Point2f(0, 0));
+}
+
+void StitchingUpdateData::setMatches(const Mat &object, const std::vector<KeyPoint> &objFeatures,
+                                     const MosaicSnapshot &sceneSnapshot, Point sceneOrigin, const std::vector<KeyPoint> &sceneFeatures,
+                                     const std::vector<DMatch> &matches) {
+    matchObject = object;
+    matchSceneImage = Mat();
+    matchScene = sceneSnapshot;
+    keepMatched(objFeatures, sceneFeatures, matches, sceneSnapshot.bounds().tl() - sceneOrigin);
+}
+
+// drawMatches only draws matched keypoints, the rest (every feature of the mosaic) isn't worth keeping
+void StitchingUpdateData::keepMatched(const std::vector<KeyPoint> &objFeatures, const std::vector<KeyPoint> &sceneFeatures,
+                                      const std::vector<DMatch> &matches, Point2f sceneShift) {
+    matchedObject.resize(matches.size());
+    matchedScene.resize(matches.size());
+    matchPairs.resize(matches.size());
+    for (unsigned i = 0; i < matches.size(); i++) {
+        matchedObject[i] = objFeatures[matches[i].queryIdx];
+        matchedScene[i] = sceneFeatures[matches[i].trainIdx];
+        matchedScene[i].pt -= sceneShift;
+        matchPairs[i] = DMatch(i, i, matches[i].distance);
+    }
+}
+
 ImageStitcher::ImageStitcher(QStringList inputFiles,
                              double scaleFactor, double roiSize, double angleStdDevs, double lenStdDevs, double distMins,
                              ImageStitcher::FeatureDetector featureDetector, ImageStitcher::FeatcherMatcher featureMatcher,
                              bool stepModeState, AlgorithmType type, QObject *parent) :
     QThread(parent), useROI(true), roi(cv::Rect(0, 0, 0, 0)), inputFiles(inputFiles), SCALE_FACTOR(scaleFactor), ROI_SIZE(roiSize), STD_ANGLE_DEVS_TO_KEEP(angleStdDevs),
-    STD_LEN_DEVS_TO_KEEP(lenStdDevs), NUM_MIN_DIST_TO_KEEP(distMins), F_DETECTOR(featureDetector), F_MATCHER(featureMatcher), stepMode(stepModeState), algorithm(type)
+    STD_LEN_DEVS_TO_KEEP(lenStdDevs), NUM_MIN_DIST_TO_KEEP(distMins), F_DETECTOR(featureDetector), F_MATCHER(featureMatcher),
+    gridDetector(featureDetector == ImageStitcher::ORB ? GridDetector::ORB : GridDetector::SURF, SURF_MIN_HESSIAN), currentlyPaused(false), stepMode(stepModeState), cancelled(false), algorithm(type), blending(ImageStitcher::OVERWRITE), phaseGuess(false),
+    maxFramesInFlight(QThread::idealThreadCount()), requestedFramesInFlight(QThread::idealThreadCount()), telemetryTolerance(0.1), tileFormat("png"),
+    lshTables(12), lshKeyBits(20), lshProbeLevel(2),
+    matchRatio(featureDetector == ImageStitcher::ORB && featureMatcher == ImageStitcher::FLANN ? 0.8 : 0.0),
+    crossCheck(false)
 {
 }
 
@@ -36,37 +125,230 @@ void ImageStitcher::nextStep(double angle, double length, double heuristic) {
     STD_LEN_DEVS_TO_KEEP = length;
     NUM_MIN_DIST_TO_KEEP = heuristic;
     currentlyPaused = false;
+    resumed.wakeAll();
     lock.unlock();
 }
 
+// Sleeps until nextStep(), run mode or cancel() wakes it
 void ImageStitcher::pauseThreadUntilReady() {
-    lock.lock();
-    if (stepMode) {
-        currentlyPaused = true;
-        lock.unlock();
-        while (true) {
-            sleep(1);   // 1 second sleep
-            lock.lock();
-            if (!currentlyPaused) {
-                break;  //look carefully, lock is actually unlocked after...
-            }
-            lock.unlock();
-        }
+    QMutexLocker locker(&lock);
+    if (!stepMode) return;
+    currentlyPaused = true;
+    while (currentlyPaused && stepMode && !cancelled) {
+        resumed.wait(&lock);
     }
-    lock.unlock();
+    currentlyPaused = false;
 }
 
 void ImageStitcher::setStepMode(bool inputStepMode) {
     lock.lock();
     stepMode = inputStepMode;
+    resumed.wakeAll();
+    lock.unlock();
+}
+
+void ImageStitcher::cancel() {
+    lock.lock();
+    cancelled = true;
+    resumed.wakeAll();
     lock.unlock();
 }
 
+bool ImageStitcher::isCancelled() const {
+    QMutexLocker locker(&lock);
+    return cancelled;
+}
+
+void ImageStitcher::setMaxFramesInFlight(int frames) {
+    requestedFramesInFlight = frames;
+    maxFramesInFlight = std::min(requestedFramesInFlight, workers.maxThreadCount());
+}
+
+void ImageStitcher::setWorkerThreads(int threads) {
+    workers.setMaxThreadCount(std::max(1, threads));
+    gridDetector.setThreads(threads);
+    maxFramesInFlight = std::min(requestedFramesInFlight, workers.maxThreadCount());
+}
+
+void ImageStitcher::setMemoryBudget(int megabytes, const QString &spillDirectory) {
+    canvas.setMemoryBudget((size_t)std::max(0, megabytes) * 1024 * 1024, spillDirectory);
+    blender.setMemoryBudget((size_t)std::max(0, megabytes) * 1024 * 1024, spillDirectory);
+}
+
+void ImageStitcher::setBlending(Blending mode, int bands) {
+    blending = mode;
+    blender.setNumBands(bands);
+}
+
+// A snapshot of the whole canvas for update, shrunk when there is a memory budget so the
+// image it renders takes no more than a quarter of it
+void ImageStitcher::setResult(StitchingUpdateData &update) const {
+    Rect bounds = canvas.bounds();
+    double scale = 1.0;
+    if (canvas.memoryBudget() > 0 && bounds.area() > 0) {
+        double maxPixels = canvas.memoryBudget() / 4.0 / CV_ELEM_SIZE(CV_8UC3);
+        scale = std::min(1.0, sqrt(maxPixels / bounds.area()));
+    }
+    update.setScene(canvas.snapshot(bounds), scale);
+}
+
+void ImageStitcher::clearCanvas() {
+    canvas.clear();
+    blender.clear();
+    geoPixels.clear();
+    geoLonLat.clear();
+}
+
+// Draws image index on the canvas and, when there is telemetry for it, keeps where its
+// corners and centre landed next to where they are on the ground for georeferencing the export
+Rect ImageStitcher::placeImage(const Mat &image, int index, const Mat &homography) {
+    Point2f points[5] = { Point2f(0, 0), Point2f(image.cols, 0), Point2f(image.cols, image.rows),
+                          Point2f(0, image.rows), Point2f(image.cols / 2.0f, image.rows / 2.0f) };
+    for (int i = 0; i < 5; i++) {
+        Point2d lonLat;
+        if (!prior.groundPosition(index, points[i], image.size(), lonLat)) break;
+        std::vector< Point2f > placed(1, points[i]);
+        perspectiveTransform(placed, placed, homography);
+        geoPixels.push_back(placed[0]);
+        geoLonLat.push_back(lonLat);
+    }
+    if (blending == ImageStitcher::MULTI_BAND) {
+        blender.add(image, homography);
+    }
+    return canvas.draw(image, homography);
+}
+
+void ImageStitcher::setLshParameters(int tables, int keyBits, int multiProbeLevel) {
+    lshTables = tables;
+    lshKeyBits = keyBits;
+    lshProbeLevel = multiProbeLevel;
+}
+
+void ImageStitcher::setMatchRatio(double ratio) {
+    matchRatio = ratio;
+}
+
+void ImageStitcher::setCrossCheck(bool enabled) {
+    crossCheck = enabled;
+}
+
+void ImageStitcher::setFeatureCache(const QString &directory, int megabytes) {
+    featureStore.setMemoryLimit((size_t)megabytes * 1024 * 1024);
+    featureStore.setDirectory(directory);
+}
+
+void ImageStitcher::setEstimator(HomographyEstimator::Method method) {
+    estimator.setMethod(method);
+}
+
+void ImageStitcher::setModelSelection(bool enabled) {
+    estimator.setModelSelection(enabled);
+}
+
+void ImageStitcher::setPhaseGuess(bool enabled) {
+    phaseGuess = enabled;
+}
+
+void ImageStitcher::setFeatureBudget(int keypoints) {
+    gridDetector.setBudget(keypoints);
+}
+
+bool ImageStitcher::usesPhase() const {
+    return algorithm == ImageStitcher::PHASE_CORRELATION
+        || (phaseGuess && (algorithm == ImageStitcher::CUMULATIVE || algorithm == ImageStitcher::COMPOUND_HOMOGRAPHY
+                           || algorithm == ImageStitcher::FULL_MATCHES));
+}
+
+void ImageStitcher::setExport(const QString &cogPath, const QString &tilePath, const QString &tileExtension) {
+    cogFile = cogPath;
+    tileDirectory = tilePath;
+    tileFormat = tileExtension;
+}
+
+// Blends the seams of the finished canvas and hands out the result as one last update
+void ImageStitcher::blendResult() {
+    if (blending != ImageStitcher::MULTI_BAND || canvas.empty()) return;
+    std::cout << "Blending " << blender.size() << " images in " << blender.numBands() << " bands" << std::endl;
+    blender.blend(canvas);
+    QSharedPointer<StitchingUpdateData> update(new StitchingUpdateData());
+    update->success = true;
+    setResult(*update);
+    update->curIndex = inputFiles.size();
+    update->totalImages = inputFiles.size();
+    emit stitchingUpdate(update);
+}
+
+bool ImageStitcher::exportResult() {
+    if (canvas.empty()) return true;
+    bool success = true;
+    if (!cogFile.isEmpty()) {
+        // the telemetry points are in canvas coordinates, the GeoTIFF starts at the top left of the mosaic
+        std::vector< Point2f > pixels(geoPixels);
+        Point2f origin = canvas.bounds().tl();
+        for (unsigned i = 0; i < pixels.size(); i++) {
+            pixels[i] -= origin;
+        }
+        Mat geoTransform = MosaicExporter::fitGeoTransform(pixels, geoLonLat);
+        if (geoTransform.empty()) {
+            std::cout << "Not enough telemetry to georeference " << cogFile.toStdString() << std::endl;
+        }
+        success = MosaicExporter::writeCog(canvas, cogFile.toStdString(), geoTransform) && success;
+    }
+    if (!tileDirectory.isEmpty()) {
+        success = MosaicExporter::writeTiles(canvas, tileDirectory.toStdString(), tileFormat.toStdString()) && success;
+    }
+    return success;
+}
+
+void ImageStitcher::setTelemetryFile(const QString &metaDataFile, double tolerance) {
+    telemetryFile = metaDataFile;
+    telemetryTolerance = tolerance;
+}
+
+void ImageStitcher::loadTelemetry() {
+    prior.clear();
+    if (telemetryFile.isEmpty()) return;
+
+    MetaDataParser parser;
+    parser.setFileName(telemetryFile);
+    std::vector< MetaData > frames;
+    int numValid = 0;
+    for (int i = 0; i < inputFiles.count(); i++) {
+        frames.push_back(parser.searchForImage(inputFiles.at(i)));
+        if (frames.back().dataIsValid) numValid++;
+    }
+    std::cout << "Telemetry found for " << numValid << " of " << inputFiles.count() << " images" << std::endl;
+    prior.setFrames(frames, SCALE_FACTOR);
+}
+
 void ImageStitcher::run() {
+    bool success = stitchAll();
+    if (isCancelled()) {
+        // nobody is waiting for the mosaic any more, let go of it now rather than when the stitcher is deleted
+        clearCanvas();
+        featureMap.clear();
+        success = false;
+    }
+    std::cout << "Feature store: " << featureStore.hits() << " hits " << featureStore.misses() << " misses" << std::endl;
+    emit stitchingFinished(success);
+}
+
+bool ImageStitcher::stitchAll() {
+    loadTelemetry();
 
     if (algorithm == ImageStitcher::CUMULATIVE || algorithm == ImageStitcher::FULL_MATCHES) {
-        cv::Mat result = imread(inputFiles.at(0).toStdString());
-        cv::resize(result, result, Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
+        // the next images are decoded and detected on the workers while this thread stitches
+        FramePipeline pipeline(this, &workers, 0, inputFiles.count(), maxFramesInFlight);
+        clearCanvas();
+        PreparedFrame first = pipeline.takeNext();
+        placeImage(first.image, 0, Mat::eye(3, 3, CV_64FC1));
+        lastPhase = first.phase;
+        roi = cv::Rect(0, 0, 0, 0);
+        featureMap.clear();
+        featureMap.setMatcherPrototype(createMatcher());
+        featureMap.setMatchRatio(matchRatio);
+        featureMapState = FeatureStore::Key(matcherSettings()).result();
+        lastPlacement = Mat::eye(3, 3, CV_64FC1);
         if (algorithm == ImageStitcher::CUMULATIVE) {
             useROI = true;
         } else {
@@ -74,15 +356,12 @@ void ImageStitcher::run() {
         }
 
         for (int i = 1; i < inputFiles.count(); i++ ) {
-            cv::Mat object = imread( inputFiles.at(i).toStdString() );
-            cv::Mat smallObject;
-            cv::resize(object, smallObject, Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
-            cv::Mat scene; result.copyTo(scene);
-            StitchingUpdateData* update = stitchImages(smallObject, scene);
+            if (isCancelled()) return false;
+            PreparedFrame object = pipeline.takeNext();
+            QSharedPointer<StitchingUpdateData> update = stitchImages(object, PreparedFrame());
             if( !update->success ) {
-                return;
+                return false;
             }
-            update->currentScene.copyTo(result);
             update->curIndex = i + 1;
             update->totalImages = inputFiles.size();
             emit stitchingUpdate(update);
@@ -90,267 +369,498 @@ void ImageStitcher::run() {
         }
     } else if (algorithm == ImageStitcher::COMPOUND_HOMOGRAPHY) {
 
-        cv::Mat lastObjectBig = imread(inputFiles.at(0).toStdString());
-        cv::Mat lastObject;
-        cv::resize(lastObjectBig, lastObject, Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
+        FramePipeline pipeline(this, &workers, 0, inputFiles.count(), maxFramesInFlight);
+        PreparedFrame last = pipeline.takeNext();
+        lastPhase = last.phase;
         useROI = false;
         cv::Mat lastHomography = cv::Mat::eye(cv::Size(3,3), CV_64FC1); // start with the 3x3 Identity matrix
-        cv::Mat scene;
-        lastObject.copyTo(scene);
+        clearCanvas();
+        placeImage(last.image, 0, lastHomography);
 
         for (int i = 1; i < inputFiles.count(); i++) {
-            cv::Mat object = imread( inputFiles.at(i).toStdString() );
-            cv::Mat smallObject;
-            cv::resize(object, smallObject, Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
-            StitchingUpdateData* update = stitchImages(smallObject, lastObject);
+            if (isCancelled()) return false;
+            PreparedFrame object = pipeline.takeNext();
+            QSharedPointer<StitchingUpdateData> update = stitchImages(object, last);
             if( !update->success ) {
-                return;
+                return false;
             }
 
-            // Pad the sceen to have sapce for the new obj
-            int padding = std::max(smallObject.cols, smallObject.rows)/2;
-            Mat paddedScene;
-            copyMakeBorder(scene, paddedScene, padding, padding, padding, padding, BORDER_CONSTANT, 0 );
-
-            Mat translate = Mat::eye(3, 3, CV_64FC1);
-            translate.row(0).col(2) = padding;   // Add padding offset coordinates to translation component
-            translate.row(1).col(2) = padding;
-
-            //std::cout << "padding" << padding << std::endl;
-            //std::cout << "last homography before " << std::endl << lastHomography << std::endl;
-            //lastHomography.at<double>(0,2) += padding;
-            //lastHomography.at<double>(1,2) += padding;
-            //std::cout << "last homography after " << std::endl << lastHomography << std::endl;
-
-            Mat combinedHomography = translate * lastHomography * update->homography;
-            //combinedHomography.at<double>(0,2) += padding;
-            //combinedHomography.at<double>(1,2) += padding;
-
-            Mat warpedObject;
-            warpPerspective(smallObject,warpedObject,combinedHomography,cv::Size(paddedScene.cols,paddedScene.rows));
-
-            // Find the non zero parts of the warped image
-            cv::Mat mask = warpedObject > 0;
-            warpedObject.copyTo(paddedScene,mask);
-            cv::Rect crop = SharedFunctions::findBoundingBox(paddedScene);
-            paddedScene = paddedScene(crop);
+            // the canvas origin never moves so the chain of homographies needs no padding or crop offsets
+            Mat combinedHomography = lastHomography * update->homography;
+            placeImage(object.image, object.index, combinedHomography);
 
-            paddedScene.copyTo(update->currentScene);
-            scene = paddedScene;
+            setResult(*update);
             update->curIndex = i + 1;
             update->totalImages = inputFiles.size();
             emit stitchingUpdate(update);
 
-            //double xOffset = update->homography.at<double>(0,2);
-            //double yOffset = update->homography.at<double>(1,2);
-
-            lastObject = smallObject;
-
-            //lastHomography = combinedHomography;
-
-            //lastHomography.at<double>(0,2) += xOffset;
-            //lastHomography.at<double>(1,2) += yOffset; //row(1).col(2) += yOffset;
-            translate.row(0).col(2) = -1*crop.x;   // Add padding offset coordinates to translation component
-            translate.row(1).col(2) = -1*crop.y;
-            combinedHomography = translate * combinedHomography;
-
+            last = object;
             combinedHomography.copyTo(lastHomography);
 
             printf("Finished I.S. iteration %d\n", i);
 
         }
     } else if (algorithm == ImageStitcher::REDUCE) {
-        //todo make this a last step to add
-        int numImagesProcessed = 0;
-        int numImages = inputFiles.count();
-        int numIters = ceil(log(numImages) / log(2));
-        useROI = false;
+        if (!runReduce()) return false;
+    } else if (algorithm == ImageStitcher::GLOBAL) {
+        if (!runGlobal()) return false;
+    } else if (algorithm == ImageStitcher::PHASE_CORRELATION) {
+        if (!runPhaseCorrelation()) return false;
+    } else if (algorithm == ImageStitcher::TRACKING) {
+        if (!runTracking()) return false;
+    }
+    if (isCancelled()) return false;
+    blendResult();
+    if (isCancelled()) return false;
+    return exportResult();
+}
+
+// Registers one pair of nodes on a worker thread
+class ImageStitcher::MergeTask : public QRunnable {
+public:
+    MergeTask(const ImageStitcher* stitcher, const ReduceNode* object, const ReduceNode* scene, cv::Size imageSize,
+              double angle, double length, double heuristic, ReduceNode* merged, cv::Mat* homography, bool* success)
+        : stitcher(stitcher), object(object), scene(scene), imageSize(imageSize), angle(angle), length(length), heuristic(heuristic),
+          merged(merged), homography(homography), success(success) {}
+    void run() {
+        if (stitcher->isCancelled()) return;    // *success stays false
+        std::vector< DMatch > matches;
+        stitcher->matchNodes(*object, *scene, imageSize, matches);
+        *success = stitcher->mergeNodes(*object, *scene, matches, angle, length, heuristic, *merged, *homography);
+    }
+private:
+    const ImageStitcher* stitcher;
+    const ReduceNode* object;
+    const ReduceNode* scene;
+    cv::Size imageSize;
+    double angle;
+    double length;
+    double heuristic;
+    ReduceNode* merged;
+    cv::Mat* homography;
+    bool* success;
+};
+
+// Pairs of nodes are merged level by level until one is left. Merging only needs
+// the features of the two nodes so every pair of a level is independent and runs on
+// the workers, and nothing is warped until the placement of every image is known.
+bool ImageStitcher::runReduce() {
+    useROI = false;
+    int numImages = inputFiles.count();
+    int numMerged = 0;
+
+    std::vector< Mat > images(numImages);
+    std::vector< ReduceNode > nodes(numImages);
+    FramePipeline pipeline(this, &workers, 0, numImages, maxFramesInFlight);
+    for (int i = 0; i < numImages; i++) {
+        if (isCancelled()) return false;
+        PreparedFrame frame = pipeline.takeNext();
+        images[i] = frame.image;
+        nodes[i].images.push_back(i);
+        nodes[i].transforms.push_back(Mat::eye(3, 3, CV_64FC1));
+        nodes[i].keypoints = frame.keypoints;
+        nodes[i].descriptors = frame.descriptors;
+    }
 
-        cv::Mat results[numImages/2];
+    while (nodes.size() > 1) {
+        if (isCancelled()) return false;
+        // an odd node out is carried up to the next level as it is
+        int numPairs = nodes.size() / 2;
+        std::vector< ReduceNode > next(numPairs + nodes.size() % 2);
+        std::vector< Mat > homographies(numPairs);
+        QVector< bool > merged(numPairs, false);
+
+        lock.lock();
+        bool reviewing = stepMode;
+        double angle = STD_ANGLE_DEVS_TO_KEEP;
+        double length = STD_LEN_DEVS_TO_KEEP;
+        double heuristic = NUM_MIN_DIST_TO_KEEP;
+        lock.unlock();
 
-        // get initail pairs of images
+        if (!reviewing) {
+            for (int p = 0; p < numPairs; p++) {
+                workers.start(new MergeTask(this, &nodes[2*p], &nodes[2*p + 1], images[0].size(), angle, length, heuristic,
+                                            &next[p], &homographies[p], merged.data() + p));
+            }
+            workers.waitForDone();
+        } else {
+            // one pair at a time so every merge can be looked at and tuned
+            for (int p = 0; p < numPairs; p++) {
+                std::vector< DMatch > matches;
+                matchNodes(nodes[2*p], nodes[2*p + 1], images[0].size(), matches);
+
+                Point2f objOrigin, sceneOrigin;
+                Mat object, scene;
+                cvtColor( compositeNode(nodes[2*p], images, objOrigin), object, CV_BGR2GRAY );
+                cvtColor( compositeNode(nodes[2*p + 1], images, sceneOrigin), scene, CV_BGR2GRAY );
+                std::vector< KeyPoint > objFeatures = nodes[2*p].keypoints;
+                std::vector< KeyPoint > sceneFeatures = nodes[2*p + 1].keypoints;
+                for (unsigned i = 0; i < objFeatures.size(); i++) objFeatures[i].pt -= objOrigin;
+                for (unsigned i = 0; i < sceneFeatures.size(); i++) sceneFeatures[i].pt -= sceneOrigin;
+                reviewMatches(object, objFeatures, scene, sceneFeatures, matches);
+                if (isCancelled()) return false;
+
+                lock.lock();
+                angle = STD_ANGLE_DEVS_TO_KEEP;
+                length = STD_LEN_DEVS_TO_KEEP;
+                heuristic = NUM_MIN_DIST_TO_KEEP;
+                lock.unlock();
+                merged[p] = mergeNodes(nodes[2*p], nodes[2*p + 1], matches, angle, length, heuristic,
+                                       next[p], homographies[p]);
+                if (!merged[p]) break;
+            }
+        }
 
-        for (int i = 0; i < inputFiles.count(); i+=2 ) {
-            numImagesProcessed++;
-            cv::Mat object = imread( inputFiles.at(i).toStdString() );
-            cv::Mat scene  = imread( inputFiles.at(i+1).toStdString() );
-            cv::Mat smallObject, smallScene;
-            cv::resize(object, smallObject, Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
-            cv::resize(scene,  smallScene,  Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
+        if (merged.contains(false)) {
+            return false;
+        }
 
-            StitchingUpdateData* update = stitchImages(smallObject, smallScene);
-            if( !update->success ) {
-                return;
+        if (nodes.size() % 2 != 0) {
+            next.back() = nodes.back();
+        }
+        nodes.swap(next);
+
+        for (int p = 0; p < numPairs; p++) {
+            numMerged++;
+            QSharedPointer<StitchingUpdateData> update(new StitchingUpdateData());
+            update->success = true;
+            homographies[p].copyTo(update->homography);
+            if (nodes.size() == 1) {
+                // last merge, this is the only time the mosaic is drawn
+                clearCanvas();
+                for (unsigned j = 0; j < nodes[0].images.size(); j++) {
+                    placeImage(images[nodes[0].images[j]], nodes[0].images[j], nodes[0].transforms[j]);
+                }
+                setResult(*update);
             }
-            update->currentScene.copyTo(results[i/2]);
-            update->curIndex = numImagesProcessed;
+            update->curIndex = numMerged;
             update->totalImages = inputFiles.size() - 1;
             emit stitchingUpdate(update);
-            printf("Finished I.S. iteration %d\n", i);
+            printf("Finished I.S. iteration %d\n", numMerged);
         }
+    }
+    return true;
+}
 
-        if (numImages % 2 != 0) {
-             numImagesProcessed++;
-             cv::Mat object = imread( inputFiles.at(numImages-1).toStdString() );
-             cv::Mat smallObject;
-             cv::resize(object, smallObject, Size(), SCALE_FACTOR, SCALE_FACTOR, INTER_AREA);
-             //scene = last results
-
-             StitchingUpdateData* update = stitchImages(smallObject, results[numImages/2 - 1]);
-             if( !update->success ) {
-                 return;
-             }
-             update->currentScene.copyTo(results[numImages/2-1]);
-             update->curIndex = numImagesProcessed;
-             update->totalImages = inputFiles.size() - 1;
-             emit stitchingUpdate(update);
-
-             numImages -= 1;
+// Matches one pair of images on a worker thread
+class ImageStitcher::PairTask : public QRunnable {
+public:
+    PairTask(const ImageStitcher* stitcher, const PreparedFrame* from, const PreparedFrame* to, cv::Size imageSize,
+             double angle, double length, double heuristic, ImagePairMatches* pair, bool* success)
+        : stitcher(stitcher), from(from), to(to), imageSize(imageSize), angle(angle), length(length), heuristic(heuristic),
+          pair(pair), success(success) {}
+    void run() {
+        if (stitcher->isCancelled()) return;    // *success stays false
+        *success = stitcher->matchPair(*from, *to, imageSize, angle, length, heuristic, *pair);
+    }
+private:
+    const ImageStitcher* stitcher;
+    const PreparedFrame* from;
+    const PreparedFrame* to;
+    cv::Size imageSize;
+    double angle;
+    double length;
+    double heuristic;
+    ImagePairMatches* pair;
+    bool* success;
+};
+
+// Every overlapping pair is matched independently on the workers, then the placements of all
+// the images are solved for together so registration errors are spread over the whole match
+// graph rather than piling up along a chain. Nothing is drawn until the solve is done.
+bool ImageStitcher::runGlobal() {
+    useROI = false;
+    int numImages = inputFiles.count();
+
+    // only the features are kept, the images are decoded again for compositing
+    std::vector< PreparedFrame > frames(numImages);
+    Size imageSize;
+    {
+        FramePipeline pipeline(this, &workers, 0, numImages, maxFramesInFlight);
+        for (int i = 0; i < numImages; i++) {
+            if (isCancelled()) return false;
+            frames[i] = pipeline.takeNext();
+            imageSize = frames[i].image.size();
+            frames[i].image.release();
+            frames[i].gray.release();
         }
+    }
+
+    lock.lock();
+    double angle = STD_ANGLE_DEVS_TO_KEEP;
+    double length = STD_LEN_DEVS_TO_KEEP;
+    double heuristic = NUM_MIN_DIST_TO_KEEP;
+    lock.unlock();
 
+    std::vector< std::pair<int, int> > candidates = candidatePairs(numImages, imageSize);
+    std::vector< ImagePairMatches > matched(candidates.size());
+    QVector< bool > found(candidates.size(), false);
+    for (unsigned p = 0; p < candidates.size(); p++) {
+        workers.start(new PairTask(this, &frames[candidates[p].first], &frames[candidates[p].second], imageSize,
+                                   angle, length, heuristic, &matched[p], found.data() + p));
+    }
+    workers.waitForDone();
+    if (isCancelled()) return false;
 
-        // first iteration was loading the images
-        for (int j = 1; j < numIters; j++) {
-            numImages /= 2;
+    std::vector< ImagePairMatches > pairs;
+    for (unsigned p = 0; p < candidates.size(); p++) {
+        if (found[p]) pairs.push_back(matched[p]);
+    }
+    std::cout << "Matched " << pairs.size() << " of " << candidates.size() << " candidate pairs" << std::endl;
+    frames.clear();
+    matched.clear();
+
+    GlobalAligner aligner(imageSize);
+    std::vector< Mat > transforms;
+    if (!aligner.initialize(numImages, pairs, 0, transforms)) {
+        std::cout << "Fatal error some images could not be matched to the rest I.S cannot proceed" << std::endl;
+        return false;
+    }
+    aligner.refine(pairs, 0, transforms);
+    std::cout << "Global alignment rms error " << aligner.rmsError() << " pixels" << std::endl;
+
+    clearCanvas();
+    FramePipeline pipeline(this, &workers, 0, numImages, maxFramesInFlight, false);
+    for (int i = 0; i < numImages; i++) {
+        if (isCancelled()) return false;
+        placeImage(pipeline.takeNext().image, i, transforms[i]);
+        QSharedPointer<StitchingUpdateData> update(new StitchingUpdateData());
+        update->success = true;
+        transforms[i].copyTo(update->homography);
+        if (i == numImages - 1) {
+            setResult(*update);
+        }
+        update->curIndex = i + 1;
+        update->totalImages = numImages;
+        emit stitchingUpdate(update);
+    }
+    return true;
+}
 
-            for (int i = 0; i < numImages; i+=2 ) {
-                numImagesProcessed++;
-                StitchingUpdateData* update = stitchImages(results[i], results[i+1]);
-                if( !update->success ) {
-                    return;
-                }
-                update->currentScene.copyTo(results[i/2]);
-                update->curIndex = numImagesProcessed;
-                update->totalImages = inputFiles.size() - 1;
-                emit stitchingUpdate(update);
-                printf("Finished I.S. iteration %d\n", i);
-            }
+// Neighbours in input order are always matched. With telemetry for both, any two images
+// whose predicted footprints overlap are as well, which is what closes the loops between
+// flight lines.
+std::vector< std::pair<int, int> > ImageStitcher::candidatePairs(int numImages, Size imageSize) const {
+    int reference = 0;
+    while (reference < numImages && !prior.hasPose(reference)) reference++;
+    std::vector< Rect > footprints(numImages);
+    std::vector< bool > predicted(numImages, false);
+    for (int i = 0; i < numImages && reference < numImages; i++) {
+        Mat H;
+        predicted[i] = prior.predictHomography(i, reference, imageSize, H) &&
+                       TelemetryPrior::predictFootprint(H, imageSize, telemetryMargin(imageSize), footprints[i]);
+    }
 
-            if (numImages % 2 != 0) {
-                numImagesProcessed++;
-                 StitchingUpdateData* update = stitchImages(results[numImages/2], results[numImages/2 - 1]);
-                 if( !update->success ) {
-                     return;
-                 }
-                 update->currentScene.copyTo(results[numImages/2-1]);
-                 update->curIndex = numImagesProcessed;
-                 update->totalImages = inputFiles.size() - 1;
-                 emit stitchingUpdate(update);
-                 numImages -= 1;
+    std::vector< std::pair<int, int> > pairs;
+    for (int i = 0; i < numImages; i++) {
+        for (int j = i + 1; j < numImages; j++) {
+            bool neighbours = j - i <= GLOBAL_NEIGHBOURS;
+            bool overlapping = predicted[i] && predicted[j] && (footprints[i] & footprints[j]).area() > 0;
+            if (neighbours || overlapping) {
+                pairs.push_back(std::make_pair(i, j));
             }
         }
     }
+    return pairs;
+}
+
+// The inliers of a homography between the two images, false if there aren't enough to trust.
+// Images that merely sit next to each other in a survey often don't overlap, that is not an error.
+bool ImageStitcher::matchPair(const PreparedFrame &from, const PreparedFrame &to, Size imageSize,
+                              double angle, double length, double heuristic, ImagePairMatches &pair) const {
+    if (from.descriptors.empty() || to.descriptors.empty()) return false;
+    std::vector< DMatch > matches;
+    matchDescriptors( from.descriptors, to.descriptors, matches );
+    Mat predicted;
+    if (prior.predictHomography(from.index, to.index, imageSize, predicted)) {
+        TelemetryPrior::rejectMatches( matches, from.keypoints, to.keypoints, predicted, telemetryMargin(imageSize) );
+    }
+    std::vector< DMatch > good_matches = pruneMatches(matches, from.keypoints, to.keypoints, angle, length, heuristic);
+    if ((int)good_matches.size() < GLOBAL_MIN_INLIERS) return false;
+    std::stable_sort(good_matches.begin(), good_matches.end());     // best first for the estimator
+
+    std::vector< Point2f > fromPoints, toPoints;
+    for (unsigned i = 0; i < good_matches.size(); i++) {
+        fromPoints.push_back( from.keypoints[ good_matches[i].queryIdx ].pt );
+        toPoints.push_back( to.keypoints[ good_matches[i].trainIdx ].pt );
+    }
+    std::vector< uchar > inliers;
+    Mat H = estimateHomography( fromPoints, toPoints, &inliers );
+    int numInliers = countNonZero(inliers);
+    if (H.empty() || numInliers < GLOBAL_MIN_INLIERS) return false;
+
+    // a spread out sample of the inliers constrains the solve as well as all of them would
+    int stride = std::max(1, numInliers / GLOBAL_MAX_POINTS_PER_PAIR);
+    pair.from = from.index;
+    pair.to = to.index;
+    pair.homography = H;
+    for (int i = 0, n = 0; i < (int)inliers.size(); i++) {
+        if (!inliers[i]) continue;
+        if (n++ % stride != 0) continue;
+        pair.fromPoints.push_back(fromPoints[i]);
+        pair.toPoints.push_back(toPoints[i]);
+    }
+    return true;
+}
+
+void ImageStitcher::matchNodes(const ReduceNode &object, const ReduceNode &scene, Size imageSize, std::vector<DMatch> &matches) const {
+    matches.clear();
+    if (object.descriptors.empty() || scene.descriptors.empty()) return;
+    matchDescriptors( object.descriptors, scene.descriptors, matches );
+
+    Mat predicted;
+    if (predictNodePlacement(object, scene, imageSize, predicted)) {
+        TelemetryPrior::rejectMatches( matches, object.keypoints, scene.keypoints, predicted, telemetryMargin(imageSize) );
+    }
+}
+
+// Nodes cover consecutive runs of images with object before scene, so the last image of
+// object and the first of scene are neighbours and telemetry relates the two nodes through them
+bool ImageStitcher::predictNodePlacement(const ReduceNode &object, const ReduceNode &scene, Size imageSize, Mat &homography) const {
+    int last = -1, lastIndex = -1;
+    for (unsigned i = 0; i < object.images.size(); i++) {
+        if (object.images[i] > last) { last = object.images[i]; lastIndex = i; }
+    }
+    int first = INT_MAX, firstIndex = -1;
+    for (unsigned i = 0; i < scene.images.size(); i++) {
+        if (scene.images[i] < first) { first = scene.images[i]; firstIndex = i; }
+    }
+    if (lastIndex < 0 || firstIndex < 0) return false;
+
+    Mat H;
+    if (!prior.predictHomography(last, first, imageSize, H)) return false;
+    homography = scene.transforms[firstIndex] * H * object.transforms[lastIndex].inv();
+    return true;
+}
+
+// Places object in the coordinates of scene, merged gets the images and features of both
+bool ImageStitcher::mergeNodes(const ReduceNode &object, const ReduceNode &scene, const std::vector<DMatch> &matches,
+                               double angle, double length, double heuristic, ReduceNode &merged, Mat &homography) const {
+    std::vector<DMatch> good_matches = pruneMatches(matches, object.keypoints, scene.keypoints, angle, length, heuristic);
+
+    // need at least 4 matches to do homography
+    if( good_matches.size() < 4 ) {
+        std::cout << "Fatal error detector did not find 4 good matches I.S cannot proceed" << std::endl;
+        return false;
+    }
+    std::stable_sort(good_matches.begin(), good_matches.end());     // best first for the estimator
+
+    std::vector< Point2f > obj;
+    std::vector< Point2f > scenePoints;
+    for( unsigned i = 0; i < good_matches.size(); i++ ) {
+        obj.push_back( object.keypoints[ good_matches[i].queryIdx ].pt );
+        scenePoints.push_back( scene.keypoints[ good_matches[i].trainIdx ].pt );
+    }
+    Mat H = estimateHomography( obj, scenePoints );
+    if (H.empty()) {
+        std::cout << "Fatal error no homography found I.S cannot proceed" << std::endl;
+        return false;
+    }
+    H.copyTo(homography);
+
+    merged.images = scene.images;
+    merged.transforms = scene.transforms;
+    for (unsigned i = 0; i < object.images.size(); i++) {
+        merged.images.push_back(object.images[i]);
+        merged.transforms.push_back(H * object.transforms[i]);
+    }
+
+    std::vector< Point2f > points(object.keypoints.size());
+    for (unsigned i = 0; i < object.keypoints.size(); i++) {
+        points[i] = object.keypoints[i].pt;
+    }
+    if (!points.empty()) {
+        perspectiveTransform(points, points, H);
+    }
+    merged.keypoints = scene.keypoints;
+    merged.keypoints.reserve(scene.keypoints.size() + object.keypoints.size());
+    for (unsigned i = 0; i < object.keypoints.size(); i++) {
+        KeyPoint kp = object.keypoints[i];
+        kp.pt = points[i];
+        merged.keypoints.push_back(kp);
+    }
+    vconcat(scene.descriptors, object.descriptors, merged.descriptors);
+    return true;
+}
+
+// Warps every image of the node onto one canvas, origin is the node coordinate of its top left corner
+Mat ImageStitcher::compositeNode(const ReduceNode &node, const std::vector<Mat> &images, Point2f &origin) const {
+    std::vector< Point2f > allCorners;
+    for (unsigned i = 0; i < node.images.size(); i++) {
+        const Mat &image = images[node.images[i]];
+        std::vector< Point2f > corners(4);
+        corners[0] = Point2f(0, 0);
+        corners[1] = Point2f(image.cols, 0);
+        corners[2] = Point2f(image.cols, image.rows);
+        corners[3] = Point2f(0, image.rows);
+        perspectiveTransform(corners, corners, node.transforms[i]);
+        allCorners.insert(allCorners.end(), corners.begin(), corners.end());
+    }
+    Rect bounds = boundingRect(allCorners);
+    origin = Point2f(bounds.x, bounds.y);
+
+    Mat shift = Mat::eye(3, 3, CV_64FC1);
+    shift.at<double>(0,2) = -bounds.x;
+    shift.at<double>(1,2) = -bounds.y;
+
+    Mat mosaic = Mat::zeros(bounds.size(), images[node.images[0]].type());
+    for (unsigned i = 0; i < node.images.size(); i++) {
+        // later images land on top, the same order stitching them one by one would give
+        WarpComposite::draw(images[node.images[i]], shift * node.transforms[i], mosaic);
+    }
+    return mosaic;
+}
+
+void ImageStitcher::reviewMatches(const Mat &object, const std::vector<KeyPoint> &objFeatures,
+                                  const Mat &scene, const std::vector<KeyPoint> &sceneFeatures,
+                                  const std::vector<DMatch> &matches) {
+    lock.lock();
+    if (stepMode && !scene.empty()) { // only emit if we are in step mode.
+        StitchingMatchesUpdateData* matchesUpdate = new StitchingMatchesUpdateData();
+        matchesUpdate->object = object;     // shared, neither is written again
+        matchesUpdate->scene = scene;
+        matchesUpdate->matches = matches;
+        matchesUpdate->objFeatures = objFeatures;
+        matchesUpdate->sceneFeatures = sceneFeatures;
+        emit stitchingUpdateMatches(StitchingMatchesUpdate(matchesUpdate));
+    }
+    lock.unlock();
+
+    //pause here if in step mode
+    pauseThreadUntilReady();
 }
 
 std::vector<DMatch> ImageStitcher::pruneMatches(const std::vector<DMatch>& allMatches,
             const std::vector<KeyPoint>& keypoints_object, const std::vector<KeyPoint>& keypoints_scene,
             double angleThreshold, double distanceThreshold, double heuristicThreshold) {
-    // Use only "good" matches
-    // find mean and stddev of magnitude
-    // and only take matches within a certain number of stddevs
-    std::vector< DMatch > good_matches;
-
-    // first find the means and the minimum openCV heuristic distance
-    double distanceMin  = 100.0;
-    double angleMean  = 0.0;
-    double lengthsMean = 0.0;
-    std::vector< double > angles;
-    std::vector< double > lengths;
-
-    for (unsigned int i = 0; i < allMatches.size(); i++) {
-        // distance is opencv score so best match is the minimum value
-        if( allMatches[i].distance < distanceMin ) distanceMin = allMatches[i].distance;
-    }
-
-    std::vector<DMatch> matches;
-    for (std::vector<DMatch>::const_iterator it = allMatches.begin(); it != allMatches.end(); ++it) {
-        if( it->distance > heuristicThreshold*distanceMin) {
-            // length is out of std dev range don't add to list of good values;
-            continue;
-        }
-        matches.push_back(*it);
-    }
-
-    for( unsigned i = 0; i < matches.size(); i++ ) {
-        //calculate the angle of the match and store it (to save doing calculation again)
-        double x1 = keypoints_object[matches[i].queryIdx].pt.x;
-        double y1 = keypoints_object[matches[i].queryIdx].pt.y;
-        double x2 = keypoints_scene [matches[i].trainIdx].pt.x;
-        double y2 = keypoints_scene [matches[i].trainIdx].pt.y;
-        double angle = atan2(y2-y1,x2-x1);
-        angles.push_back(angle);
-        angleMean += angle;
-
-        //calculate the euclidian distance between the features
-        double euDistance = std::sqrt(std::pow(x1 - x2, 2) + std::pow(y1 - y2, 2));
-        lengths.push_back(euDistance);
-        lengthsMean += euDistance;
-
-        //lengthsFile << matches[i].distance << std::endl;
-        //anglesFile  << angle << std::endl;
-    }
-    angleMean    /= matches.size();
-    lengthsMean  /= matches.size();
-
-    // next find the standard deviations
-    double angleStdDev    = 0.0;
-    double lengthsStdDev  = 0.0;
-
-    for( unsigned i = 0; i < matches.size(); i++ ) {
-        angleStdDev    += (angles[i]  - angleMean)    * (angles[i]  - angleMean);
-        lengthsStdDev  += (lengths[i] - lengthsMean)  * (lengths[i] - lengthsMean);
-    }
-    angleStdDev    /= matches.size();
-    angleStdDev     = sqrt(angleStdDev);
-    lengthsStdDev  /= matches.size();
-    lengthsStdDev   = sqrt(lengthsStdDev);
-
-    std::cout << "Angle mean = "  << angleMean   << " stddev = " << angleStdDev   << std::endl;
-    std::cout << "Length mean = " << lengthsMean << " stddev = " << lengthsStdDev << std::endl;
-
-    // finally prune the matches based off of stddev
-    for( unsigned i = 0; i < matches.size(); i++ ) {
-        if( angles[i] > angleMean + angleStdDev*angleThreshold || //*STD_DEVS_TO_KEEP ||
-            angles[i] < angleMean - angleStdDev*angleThreshold ){//*STD_DEVS_TO_KEEP ) {
-            // angle is out of std dev range
-            continue;
-        }
-        if ( lengths[i] > lengthsMean + lengthsStdDev*distanceThreshold ||
-             lengths[i] < lengthsMean - lengthsStdDev*distanceThreshold) {
-            // euculidian distance is out of std dev range
-            continue;
-        }
-        // point passed tests adding to good matches
-        good_matches.push_back(matches[i]);
-    }
-    return good_matches;
+    // Use only "good" matches: within heuristicThreshold of the best score, then within
+    // a certain number of stddevs of the mean angle and length
+    MatchFilter filter(allMatches, keypoints_object, keypoints_scene);
+    return filter.filter(angleThreshold, distanceThreshold, heuristicThreshold);
 }
 
 // obj is the small image
-// scene is the mosiac
-StitchingUpdateData* ImageStitcher::stitchImages(Mat &objImage, Mat &sceneImage) {
-    StitchingUpdateData* updateData = new StitchingUpdateData();
+// scene is the mosiac (canvas), for COMPOUND_HOMOGRAPHY it is the last object
+QSharedPointer<StitchingUpdateData> ImageStitcher::stitchImages(const PreparedFrame &object, const PreparedFrame &last) {
+    const Mat &lastImage = last.image;
+    const Mat &objImage = object.image;
+    const Mat &grayObjImage = object.gray;
+    const std::vector< KeyPoint > &keypoints_object = object.keypoints;
+    const Mat &descriptors_object = object.descriptors;
+
+    QSharedPointer<StitchingUpdateData> updateData(new StitchingUpdateData());
     updateData->success = true;
-    // Pad the sceen to have sapce for the new obj
-    int padding = std::max(objImage.cols, objImage.rows)/2;
-    printf("max padding is %d\n", padding);
-    Mat paddedScene;
-    if (algorithm == ImageStitcher::COMPOUND_HOMOGRAPHY) {
-        sceneImage.copyTo(paddedScene);
-    } else {
-        copyMakeBorder( sceneImage, paddedScene, padding, padding, padding, padding, BORDER_CONSTANT, 0 );
-    }
-    // Convert imagages to gray scale to be used with openCV's detection features
-    Mat grayObjImage, grayPadded;
-    cvtColor( objImage,    grayObjImage, CV_BGR2GRAY );
-    cvtColor( paddedScene, grayPadded, CV_BGR2GRAY );
+    // The canvas grows by itself so the scene never has to be padded, scene coordinates
+    // are canvas coordinates (and stay put from one image to the next).
+    bool useCanvas = algorithm != ImageStitcher::COMPOUND_HOMOGRAPHY;
+    Rect sceneBounds = useCanvas ? canvas.bounds() : Rect(0, 0, lastImage.cols, lastImage.rows);
+    // The features of images already stitched are kept in the feature map, so
+    // only the new object has to go through the detector.
+    bool useFeatureMap = algorithm == ImageStitcher::CUMULATIVE || algorithm == ImageStitcher::FULL_MATCHES;
 
     // only look at last image for stitching
 
     if (useROI && roi.height != 0) {
-        roi.x += padding;
-        roi.y += padding;
-
         int newWidth = roi.width * ROI_SIZE;
         roi.x = roi.x - ((newWidth - roi.width) / 2);
         roi.width = newWidth;
@@ -358,74 +868,123 @@ StitchingUpdateData* ImageStitcher::stitchImages(Mat &objImage, Mat &sceneImage)
         roi.y = roi.y - ((newHeight - roi.height) / 2);
         roi.height = newHeight;
 
-        if (roi.x < 0) roi.x = 0;
-        if (roi.y < 0) roi.y = 0;
-        if (roi.x + roi.width  >= paddedScene.cols) roi.width  = paddedScene.cols - roi.x;
-        if (roi.y + roi.height >= paddedScene.rows) roi.height = paddedScene.rows - roi.y;
+        roi &= sceneBounds;
 
         //cv::rectangle(paddedScene, roi, Scalar(255, 0, 0), 3, CV_AA);
         //saveImage(paddedScene, "ROIshifted.png");
         //std::cout << " ROI " << std::endl << roi << std::endl;
     } else {
-        roi = cv::Rect(0, 0, grayPadded.cols, grayPadded.rows); // If not set then use the whole image.
+        roi = sceneBounds; // If not set then use the whole image.
     }
-    Mat roiPointer = grayPadded(roi);
-
-    std::vector< KeyPoint > keypoints_object, keypoints_scene;
-    Mat descriptors_object, descriptors_scene;
-
-    switch( F_DETECTOR ) {
-        case ImageStitcher::SURF: {
-            // Detect the keypoints using SURF Detector
-            int minHessian = 400;
-            SurfFeatureDetector detector( minHessian );
-            detector.detect( grayObjImage, keypoints_object );
-            detector.detect( roiPointer,   keypoints_scene );
 
-            // Calculate descriptors (feature vectors)
-            SurfDescriptorExtractor extractor;
-            extractor.compute( grayObjImage, keypoints_object, descriptors_object );
-            extractor.compute( roiPointer,   keypoints_scene,  descriptors_scene );
-            break;
+    // Where telemetry (or else phase correlation) puts the object in the scene. The scene is the previous
+    // image for COMPOUND_HOMOGRAPHY, otherwise the previous image was placed with lastPlacement.
+    Mat predicted;
+    int margin = telemetryMargin(objImage.size());
+    Mat phasePlacement;     // where phase correlation puts the object in the scene
+    if (usesPhase() && correlator.registerPair(object.phase, lastPhase, phasePlacement)) {
+        if (useCanvas) {
+            phasePlacement = lastPlacement * phasePlacement;
         }
-        case ImageStitcher::ORB: {
-            cv::ORB orb(5000); // max features default is 500
-            orb( grayObjImage, Mat(), keypoints_object, descriptors_object );
-            orb( roiPointer,   Mat(), keypoints_scene,  descriptors_scene );
-            break;
+    }
+    lastPhase = object.phase;
+    if (prior.predictHomography(object.index, object.index - 1, objImage.size(), predicted)) {
+        if (useCanvas) {
+            predicted = lastPlacement * predicted;
+        }
+    } else if (!phasePlacement.empty()) {
+        predicted = phasePlacement;
+        margin = cvRound(PHASE_GUESS_TOLERANCE * sqrt((double)objImage.cols * objImage.cols + (double)objImage.rows * objImage.rows));
+    }
+    if (!predicted.empty()) {
+        Rect footprint;
+        if (TelemetryPrior::predictFootprint(predicted, objImage.size(), margin, footprint)
+                && (footprint & roi).area() > 0) {
+            roi &= footprint;
+        }
+    } else if (algorithm == ImageStitcher::FULL_MATCHES && !lastPlacement.empty()) {
+        // Nothing predicted, but the object overlaps the image before it. Only the part of the map
+        // around that is searched, so a step costs the same however big the mosaic has grown.
+        Rect footprint;
+        int reach = cvRound(FULL_MATCHES_REACH * std::max(objImage.cols, objImage.rows));
+        if (TelemetryPrior::predictFootprint(lastPlacement, objImage.size(), reach, footprint)
+                && (footprint & roi).area() > 0) {
+            roi &= footprint;
         }
     }
 
+    lock.lock();
+    bool reviewing = stepMode;
+    lock.unlock();
+
+    // Only the roi of the canvas is ever put together into one image, and only when something
+    // has to look at its pixels (the feature map already has the features of the mosaic).
+    Mat roiPointer;
+    if (!useFeatureMap || featureMap.empty() || reviewing) {
+        cvtColor( useCanvas ? canvas.render(roi) : lastImage(roi), roiPointer, CV_BGR2GRAY );
+    }
+
+    std::vector< KeyPoint > keypoints_scene;
+    Mat descriptors_scene;
+
     std::vector< DMatch > matches;
-    switch( F_MATCHER ) {
-        case ImageStitcher::FLANN: {
-            // Match descriptor vectors using FLANN matcher
-            FlannBasedMatcher matcher;
-            matcher.match( descriptors_object, descriptors_scene, matches );
-            break;
+    if (useFeatureMap) {
+        if (featureMap.empty()) {
+            // first iteration, the scene is just the first image so seed the map with it
+            detectFeatures( roiPointer, keypoints_scene, descriptors_scene );
+            Mat toScene = Mat::eye(3, 3, CV_64FC1);
+            toScene.at<double>(0,2) = roi.x;
+            toScene.at<double>(1,2) = roi.y;
+            addToFeatureMap( keypoints_scene, descriptors_scene, toScene, roi.size() );
         }
-        case ImageStitcher::BRUTE_FORCE: {
-            int normType = F_DETECTOR == ImageStitcher::ORB ? NORM_HAMMING : NORM_L2;
-            BFMatcher matcher(normType);
-            matcher.match( descriptors_object, descriptors_scene, matches );
-            break;
+        // the same object against the same map and roi matches the same way, even in another run
+        QByteArray key = FeatureStore::Key(featureMapState).add(descriptors_object)
+                         .add(roi.x).add(roi.y).add(roi.width).add(roi.height).result();
+        FeatureStore::Entry stored;
+        if (featureStore.find(key, stored)) {
+            keypoints_scene = stored.keypoints;
+            matches = stored.matches;
+        } else {
+            featureMap.match( descriptors_object, roi, keypoints_scene, matches );
+            stored.keypoints = keypoints_scene;
+            stored.matches = matches;
+            featureStore.store(key, stored);
         }
+        // the map works in mosaic coordinates, the rest of this expects them relative to the roi
+        for (unsigned i = 0; i < keypoints_scene.size(); i++) {
+            keypoints_scene[i].pt.x -= roi.x;
+            keypoints_scene[i].pt.y -= roi.y;
+        }
+    } else if (!useCanvas) {
+        // The scene is the last object, whose features were extracted when it was the object. They are
+        // reused as they are, whatever telemetry mask or footprint crop they were detected with.
+        for (unsigned i = 0; i < last.keypoints.size(); i++) {
+            KeyPoint point = last.keypoints[i];
+            if (!roi.contains(point.pt)) continue;
+            point.pt.x -= roi.x;
+            point.pt.y -= roi.y;
+            keypoints_scene.push_back(point);
+            descriptors_scene.push_back(last.descriptors.row(i));
+        }
+        matchDescriptors( descriptors_object, descriptors_scene, matches );
+    } else {
+        detectFeatures( roiPointer, keypoints_scene, descriptors_scene );
+        matchDescriptors( descriptors_object, descriptors_scene, matches );
     }
 
-    lock.lock();
-    if (stepMode) { // only emit if we are in step mode.
-        StitchingMatchesUpdateData matchesUpdate;   //copy everything (no pointers here)
-        grayObjImage.copyTo(matchesUpdate.object);
-        roiPointer.copyTo(matchesUpdate.scene);
-        matchesUpdate.matches = matches;
-        matchesUpdate.objFeatures = keypoints_object;
-        matchesUpdate.sceneFeatures = keypoints_scene;
-        emit stitchingUpdateMatches(matchesUpdate);
+    if (!predicted.empty()) {
+        // scene keypoints are relative to the roi
+        Mat toRoi = Mat::eye(3, 3, CV_64FC1);
+        toRoi.at<double>(0,2) = -roi.x;
+        toRoi.at<double>(1,2) = -roi.y;
+        TelemetryPrior::rejectMatches( matches, keypoints_object, keypoints_scene, toRoi * predicted, margin );
     }
-    lock.unlock();
 
-    //pause here if in step mode
-    pauseThreadUntilReady();
+    reviewMatches( grayObjImage, keypoints_object, roiPointer, keypoints_scene, matches );
+    if (isCancelled()) {
+        updateData->success = false;
+        return updateData;
+    }
 
     std::vector<DMatch> good_matches = pruneMatches(matches, keypoints_object, keypoints_scene,
                                        STD_ANGLE_DEVS_TO_KEEP, STD_LEN_DEVS_TO_KEEP, NUM_MIN_DIST_TO_KEEP);
@@ -434,13 +993,15 @@ StitchingUpdateData* ImageStitcher::stitchImages(Mat &objImage, Mat &sceneImage)
 
 
     // need at least 4 matches to do homography
-    if( good_matches.size() < 4 ) {
+    bool placedByPhase = good_matches.size() < 4 && !phasePlacement.empty();
+    if( good_matches.size() < 4 && !placedByPhase ) {
         updateData->success = false;
         std::cout << "Fatal error detector did not find 4 good matches I.S cannot proceed" << std::endl;
         return updateData;
     }
 
     std::cout << "Found " << good_matches.size() << " good matches" << std::endl;
+    std::stable_sort(good_matches.begin(), good_matches.end());     // best first for the estimator
 
     // Create a list of the good points in the object & scene
     std::vector< Point2f > obj;
@@ -451,22 +1012,42 @@ StitchingUpdateData* ImageStitcher::stitchImages(Mat &objImage, Mat &sceneImage)
         scene.push_back( keypoints_scene[ good_matches[i].trainIdx ].pt );
     }
 
-    Mat img_matches;
-    drawMatches( grayObjImage, keypoints_object, roiPointer, keypoints_scene,
-                 good_matches, img_matches, Scalar::all(-1), Scalar::all(-1),
-                 vector<char>(), DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS );
-    img_matches.copyTo(updateData->currentFeatureMatches);
-    //saveImage(img_matches, "matches.png");
+    // The matches are only drawn if somebody looks at them. Without the roi image only the part of
+    // the scene the matches are in is kept, as it is before the object lands on it.
+    if (!roiPointer.empty()) {
+        updateData->setMatches( grayObjImage, keypoints_object, roiPointer, keypoints_scene, good_matches );
+    } else {
+        Rect region = boundingRect(scene);
+        region = Rect(region.x - 32, region.y - 32, region.width + 64, region.height + 64) & Rect(0, 0, roi.width, roi.height);
+        updateData->setMatches( grayObjImage, keypoints_object, canvas.snapshot(region + roi.tl()), roi.tl(),
+                                keypoints_scene, good_matches );
+    }
+
+    Mat translate = Mat::eye(3,3, CV_64FC1);
+    translate.at<double>(0,2) = roi.x;
+    translate.at<double>(1,2) = roi.y;
 
     // Find the Homography Matrix
-    Mat H = findHomography( obj, scene, CV_RANSAC );
+    Mat H;
+    if (placedByPhase) {
+        std::cout << "Only " << good_matches.size() << " good matches, placing the image by phase correlation" << std::endl;
+        H = translate.inv() * phasePlacement;
+    } else {
+        H = estimateHomography( obj, scene );
+        if (H.empty() && !phasePlacement.empty()) {
+            std::cout << "No homography from " << good_matches.size() << " matches, placing the image by phase correlation" << std::endl;
+            H = translate.inv() * phasePlacement;
+        }
+    }
+    if (H.empty()) {
+        updateData->success = false;
+        std::cout << "Fatal error no homography fits the " << good_matches.size() << " good matches I.S cannot proceed" << std::endl;
+        return updateData;
+    }
 
     std::cout << "Homography Mat" << std::endl << H << std::endl;
 
     // Use the Homography Matrix to warp the images
-    Mat translate = Mat::eye(3,3, CV_64FC1);
-    translate.at<double>(0,2) = roi.x;
-    translate.at<double>(1,2) = roi.y;
     H = translate * H;
     //H.row(0).col(2) += roi.x;   // Add roi offset coordinates to translation component
     //H.row(1).col(2) += roi.y;
@@ -475,28 +1056,275 @@ StitchingUpdateData* ImageStitcher::stitchImages(Mat &objImage, Mat &sceneImage)
     if (algorithm == ImageStitcher::COMPOUND_HOMOGRAPHY) {
         return updateData;
     }
+    if (useFeatureMap) {
+        addToFeatureMap( keypoints_object, descriptors_object, H, objImage.size() );
+    }
 
-    Mat result;
-    warpPerspective(objImage,result,H,cv::Size(paddedScene.cols,paddedScene.rows));
-    // result now contains the rotated/skewed/translated object image
-    // this is our ROI on the next step
-    roi = SharedFunctions::findBoundingBox(result);
-
-    //cv::rectangle(result, roi, Scalar(255, 255, 255), 3, CV_AA);
-    //saveImage(result, "ROI.png");
-
-    // warpedObjDest is now a reference into the paddedScene where we are going to place the object
-    //cv::Mat warpedObjDest(paddedScene,cv::Rect(0,0,paddedScene.cols,paddedScene.rows));
-    // Find the non zero parts of the warped image
-    cv::Mat mask = result > 0;
-    result.copyTo(paddedScene,mask);
-    // copy that on top of the scene
-    result = paddedScene;
-    cv::Rect crop = SharedFunctions::findBoundingBox(result);
-    roi.x -= crop.x;
-    roi.y -= crop.y;
-    result = result(crop);
-    std::cout << "result total: " << result.total() << "\n";
-    result.copyTo(updateData->currentScene);
+    // only the tiles under the object are touched, the rest of the mosaic stays where it is.
+    // What was written is our ROI on the next step
+    roi = placeImage(objImage, object.index, H);
+    lastPlacement = H;
+
+    Rect bounds = canvas.bounds();
+    std::cout << "result total: " << bounds.area() << " tiles: " << canvas.numTiles()
+              << " resident: " << canvas.numResidentTiles() << "\n";
+    setResult(*updateData);
     return updateData;
 }
+
+// Every image registered against the one before it by phase correlation alone, the similarities
+// chained onto the canvas like the homographies of COMPOUND_HOMOGRAPHY
+bool ImageStitcher::runPhaseCorrelation() {
+    FramePipeline pipeline(this, &workers, 0, inputFiles.count(), maxFramesInFlight);
+    PreparedFrame last = pipeline.takeNext();
+    useROI = false;
+    Mat lastHomography = Mat::eye(3, 3, CV_64FC1);
+    clearCanvas();
+    placeImage(last.image, 0, lastHomography);
+
+    for (int i = 1; i < inputFiles.count(); i++) {
+        if (isCancelled()) return false;
+        PreparedFrame object = pipeline.takeNext();
+        int64 start = getTickCount();
+        Mat H;
+        double response = 0;
+        if (!correlator.registerPair(object.phase, last.phase, H, &response)) {
+            std::cout << "Fatal error phase correlation found no clear shift from image " << i << " to " << i - 1
+                      << " (response " << response << ") I.S cannot proceed" << std::endl;
+            return false;
+        }
+        std::cout << "Phase correlation response " << response << ", "
+                  << (getTickCount() - start) * 1000.0 / getTickFrequency() << " ms" << std::endl;
+        std::cout << "Homography Mat" << std::endl << H << std::endl;
+
+        Mat combinedHomography = lastHomography * H;
+        placeImage(object.image, object.index, combinedHomography);
+
+        QSharedPointer<StitchingUpdateData> update(new StitchingUpdateData());
+        update->success = true;
+        H.copyTo(update->homography);
+        setResult(*update);
+        update->curIndex = i + 1;
+        update->totalImages = inputFiles.size();
+        emit stitchingUpdate(update);
+
+        last = object;
+        lastHomography = combinedHomography;
+        printf("Finished I.S. iteration %d\n", i);
+    }
+    return true;
+}
+
+// Corners are followed from each image into the next and the tracks go straight to the estimator,
+// the homographies are chained onto the canvas like those of COMPOUND_HOMOGRAPHY. Nothing is matched
+// and corners are only detected where tracks got lost (or the estimator threw them out).
+bool ImageStitcher::runTracking() {
+    FramePipeline pipeline(this, &workers, 0, inputFiles.count(), maxFramesInFlight, false);
+    PreparedFrame first = pipeline.takeNext();
+    useROI = false;
+    Mat lastHomography = Mat::eye(3, 3, CV_64FC1);
+    clearCanvas();
+    placeImage(first.image, 0, lastHomography);
+    FeatureTracker tracker(TRACKING_MAX_CORNERS);
+    Mat gray;
+    cvtColor( first.image, gray, CV_BGR2GRAY );
+    tracker.start(gray);
+
+    for (int i = 1; i < inputFiles.count(); i++) {
+        if (isCancelled()) return false;
+        PreparedFrame object = pipeline.takeNext();
+        int64 start = getTickCount();
+        cvtColor( object.image, gray, CV_BGR2GRAY );
+        int carried = tracker.size();
+        std::vector<Point2f> from, to;
+        tracker.track(gray, from, to);
+
+        // the object is the new image, the scene the one before
+        std::vector<uchar> inliers;
+        Mat H = estimateHomography( to, from, &inliers );
+        int numInliers = H.empty() ? 0 : countNonZero(inliers);
+        if (numInliers < TRACKING_MIN_INLIERS) {
+            std::cout << "Only " << numInliers << " tracks held up, detecting corners again" << std::endl;
+            tracker.retrack(from, to);
+            H = estimateHomography( to, from, &inliers );
+            numInliers = H.empty() ? 0 : countNonZero(inliers);
+        }
+        if (numInliers < TRACKING_MIN_INLIERS) {
+            std::cout << "Fatal error only " << numInliers << " corners could be tracked from image " << i - 1
+                      << " to " << i << " I.S cannot proceed" << std::endl;
+            return false;
+        }
+        tracker.keepInliers(inliers);
+        std::cout << "Tracked " << to.size() << " of " << carried << " corners, " << numInliers << " inliers, "
+                  << (getTickCount() - start) * 1000.0 / getTickFrequency() << " ms" << std::endl;
+        std::cout << "Homography Mat" << std::endl << H << std::endl;
+
+        Mat combinedHomography = lastHomography * H;
+        placeImage(object.image, object.index, combinedHomography);
+
+        QSharedPointer<StitchingUpdateData> update(new StitchingUpdateData());
+        update->success = true;
+        H.copyTo(update->homography);
+        setResult(*update);
+        update->curIndex = i + 1;
+        update->totalImages = inputFiles.size();
+        emit stitchingUpdate(update);
+
+        lastHomography = combinedHomography;
+        printf("Finished I.S. iteration %d\n", i);
+    }
+    return true;
+}
+
+void ImageStitcher::decodeFrame(PreparedFrame &frame) const {
+    frame.image = ImageLoader::loadScaled( inputFiles.at(frame.index).toStdString(), SCALE_FACTOR );
+}
+
+void ImageStitcher::extractFeatures(PreparedFrame &frame) const {
+    // Convert imagages to gray scale to be used with openCV's detection features
+    cvtColor( frame.image, frame.gray, CV_BGR2GRAY );
+    if (usesPhase()) {
+        frame.phase = correlator.prepare(frame.gray);
+    }
+    if (algorithm == ImageStitcher::PHASE_CORRELATION) return;
+    detectFeatures( frame.gray, frame.keypoints, frame.descriptors, telemetryMask(frame.index, frame.gray.size()) );
+}
+
+int ImageStitcher::telemetryMargin(Size imageSize) const {
+    return cvRound(telemetryTolerance * sqrt((double)imageSize.width * imageSize.width + (double)imageSize.height * imageSize.height));
+}
+
+// The sequential modes only match an image against the images either side of it (or mosaics
+// containing them), so features are only needed where those are predicted to overlap.
+// GLOBAL also matches images further apart and across flight lines (see candidatePairs()), so
+// it detects everywhere. An empty mask (detect everywhere) when a neighbour can't be predicted.
+Mat ImageStitcher::telemetryMask(int index, Size imageSize) const {
+    if (algorithm == ImageStitcher::GLOBAL || !prior.hasPose(index)) return Mat();
+    Mat mask = Mat::zeros(imageSize, CV_8UC1);
+    int margin = telemetryMargin(imageSize);
+    for (int neighbour = index - 1; neighbour <= index + 1; neighbour += 2) {
+        if (neighbour < 0 || neighbour >= inputFiles.count()) continue;
+        Rect overlap;
+        if (!prior.predictOverlap(index, neighbour, imageSize, margin, overlap)) return Mat();
+        mask(overlap).setTo(Scalar(255));
+    }
+    return mask;
+}
+
+PreparedFrame ImageStitcher::prepareFrame(const Mat &image) const {
+    PreparedFrame frame;
+    frame.image = image;
+    extractFeatures(frame);
+    return frame;
+}
+
+// Looked up by the pixels and the mask first, an image that has been through the detector
+// before (in an earlier run) isn't again
+void ImageStitcher::detectFeatures(const Mat &grayImage, std::vector<KeyPoint> &keypoints, Mat &descriptors,
+                                   const Mat &mask) const {
+    QByteArray key = FeatureStore::Key(detectorSettings()).add(grayImage).add(mask).result();
+    FeatureStore::Entry stored;
+    if (featureStore.find(key, stored)) {
+        keypoints = stored.keypoints;
+        descriptors = stored.descriptors;
+        return;
+    }
+
+    if (gridDetector.getBudget() > 0) {
+        gridDetector.detect( grayImage, keypoints, descriptors, mask );
+    } else switch( F_DETECTOR ) {
+        case ImageStitcher::SURF: {
+            // Detect the keypoints using SURF Detector
+            SurfFeatureDetector detector( SURF_MIN_HESSIAN );
+            detector.detect( grayImage, keypoints, mask );
+
+            // Calculate descriptors (feature vectors)
+            SurfDescriptorExtractor extractor;
+            extractor.compute( grayImage, keypoints, descriptors );
+            break;
+        }
+        case ImageStitcher::ORB: {
+            cv::ORB orb(ORB_MAX_FEATURES);
+            orb( grayImage, mask, keypoints, descriptors );
+            break;
+        }
+    }
+    stored.keypoints = keypoints;
+    stored.descriptors = descriptors;
+    featureStore.store(key, stored);
+}
+
+// Everything detectFeatures() depends on besides its input, the OpenCV version included
+QByteArray ImageStitcher::detectorSettings() const {
+    QString settings = F_DETECTOR == ImageStitcher::SURF ? QString("SURF %1").arg(SURF_MIN_HESSIAN)
+                                                         : QString("ORB %1").arg(ORB_MAX_FEATURES);
+    if (gridDetector.getBudget() > 0) {
+        settings += QString(" grid %1").arg(gridDetector.getBudget());
+    }
+    return (settings + " " + CV_VERSION).toLatin1();
+}
+
+// Everything createMatcher() and the ratio test depend on
+QByteArray ImageStitcher::matcherSettings() const {
+    QString settings = QString("match %1 %2 %3 %4 %5 %6 %7 ").arg(F_DETECTOR).arg(F_MATCHER).arg(matchRatio)
+                       .arg(crossCheck ? 1 : 0).arg(lshTables).arg(lshKeyBits).arg(lshProbeLevel);
+    return (settings + CV_VERSION).toLatin1();
+}
+
+Ptr<DescriptorMatcher> ImageStitcher::createMatcher() const {
+    if (F_MATCHER == ImageStitcher::FLANN) {
+        if (F_DETECTOR == ImageStitcher::ORB) {
+            // the default kd-tree is meant for float vectors, binary descriptors need hashing on Hamming distance
+            return new FlannBasedMatcher(new flann::LshIndexParams(lshTables, lshKeyBits, lshProbeLevel),
+                                         new flann::SearchParams());
+        }
+        // Match descriptor vectors using FLANN matcher
+        return new FlannBasedMatcher();
+    }
+    if (F_MATCHER == ImageStitcher::SIMD_HAMMING && F_DETECTOR == ImageStitcher::ORB) {
+        return new HammingMatcher(crossCheck);
+    }
+    int normType = F_DETECTOR == ImageStitcher::ORB ? NORM_HAMMING : NORM_L2;
+    return new BFMatcher(normType);
+}
+
+// from and to are best match first, which PROSAC tries first
+Mat ImageStitcher::estimateHomography(const std::vector<Point2f> &from, const std::vector<Point2f> &to,
+                                      std::vector<uchar> *inliers) const {
+    static const char* MODEL_NAMES[] = { "similarity", "affine", "homography" };
+    HomographyEstimator::Report report;
+    Mat H = estimator.estimate( from, to, inliers, &report );
+    // one write, GLOBAL estimates on several threads at once
+    std::ostringstream line;
+    line << "Homography from " << from.size() << " matches: " << report.inliers << " inliers, "
+         << report.iterations << " iterations, " << report.milliseconds << " ms";
+    if (estimator.getModelSelection()) {
+        line << ", " << MODEL_NAMES[report.model];
+    }
+    line << "\n";
+    std::cout << line.str() << std::flush;
+    return H;
+}
+
+// Every call builds the index over train once and looks up all of query in it, unless the
+// same two sets of descriptors have been matched before
+void ImageStitcher::matchDescriptors(const Mat &query, const Mat &train, std::vector<DMatch> &matches) const {
+    QByteArray key = FeatureStore::Key(matcherSettings()).add(query).add(train).result();
+    FeatureStore::Entry stored;
+    if (featureStore.find(key, stored)) {
+        matches = stored.matches;
+        return;
+    }
+    SharedFunctions::matchWithRatio(createMatcher(), query, train, matchRatio, matches);
+    stored.matches = matches;
+    featureStore.store(key, stored);
+}
+
+// The map only ever grows by images, so the key of what is in it is the key of what was
+// in it before and of the image added
+void ImageStitcher::addToFeatureMap(const std::vector<KeyPoint> &keypoints, const Mat &descriptors,
+                                    const Mat &homography, Size imageSize) {
+    featureMap.addImage( keypoints, descriptors, homography, imageSize );
+    featureMapState = FeatureStore::Key(featureMapState).add(keypoints).add(descriptors).add(homography)
+                      .add(imageSize.width).add(imageSize.height).result();
+}
@@ -2,25 +2,73 @@
 #define IMAGESTITCHER_H
 
 #include <QMetaType>
+#include <QSharedPointer>
 #include <QThread>
 #include <QStringList>
 #include <QMutex>
+#include <QWaitCondition>
+#include <QThreadPool>
 
 #include <opencv2/opencv.hpp>
 
-// This has to be a QObject so it can be passed through signals/slots
-class StitchingUpdateData : public QObject {
-    Q_OBJECT
+#include "featurestore.h"
+#include "framepipeline.h"
+#include "globalaligner.h"
+#include "griddetector.h"
+#include "homographyestimator.h"
+#include "mosaicblender.h"
+#include "mosaiccanvas.h"
+#include "mosaicfeaturemap.h"
+#include "phasecorrelator.h"
+#include "telemetryprior.h"
+
+// What one step of stitching hands out. It is shared read-only between the stitcher and
+// whoever is listening (see StitchingUpdate) and holds snapshots instead of images, the
+// mosaic and the matches are only rendered when somebody asks for them.
+class StitchingUpdateData {
 public:
     StitchingUpdateData();
-    cv::Mat currentScene;
-    cv::Mat currentFeatureMatches;
+    // false for the progress only updates of REDUCE and GLOBAL
+    bool hasScene() const;
+    // the mosaic after this step
+    cv::Mat currentScene() const;
+    // the good matches between the new image and the scene that placed it, empty if it wasn't placed
+    cv::Mat currentFeatureMatches() const;
+
+    void setScene(const MosaicSnapshot &snapshot, double scale);
+    // scene is the image sceneFeatures were detected in
+    void setMatches(const cv::Mat &object, const std::vector<cv::KeyPoint> &objFeatures,
+                    const cv::Mat &scene, const std::vector<cv::KeyPoint> &sceneFeatures,
+                    const std::vector<cv::DMatch> &matches);
+    // sceneFeatures are relative to sceneOrigin on the canvas
+    void setMatches(const cv::Mat &object, const std::vector<cv::KeyPoint> &objFeatures,
+                    const MosaicSnapshot &scene, cv::Point sceneOrigin, const std::vector<cv::KeyPoint> &sceneFeatures,
+                    const std::vector<cv::DMatch> &matches);
+
     cv::Mat homography;
     int curIndex;
     int totalImages;
     bool success;
+
+private:
+    void keepMatched(const std::vector<cv::KeyPoint> &objFeatures, const std::vector<cv::KeyPoint> &sceneFeatures,
+                     const std::vector<cv::DMatch> &matches, cv::Point2f sceneShift);
+
+    MosaicSnapshot scene;
+    double sceneScale;
+    // what drawMatches needs, only the matched keypoints are kept (renumbered in match order)
+    cv::Mat matchObject;
+    cv::Mat matchSceneImage;    // gray, empty when the scene is matchScene
+    MosaicSnapshot matchScene;
+    std::vector<cv::KeyPoint> matchedObject;
+    std::vector<cv::KeyPoint> matchedScene;
+    std::vector<cv::DMatch> matchPairs;
 };
 
+typedef QSharedPointer<const StitchingUpdateData> StitchingUpdate;
+
+// The matches awaiting review in step mode. The images are shared with the stitcher, which
+// never writes them once they are made.
 class StitchingMatchesUpdateData {
 public:
     StitchingMatchesUpdateData() {}
@@ -31,6 +79,18 @@ public:
     std::vector<cv::DMatch> matches;
 };
 
+typedef QSharedPointer<const StitchingMatchesUpdateData> StitchingMatchesUpdate;
+
+// A partial mosaic in REDUCE mode. Only the features and the placement of each
+// input image are kept while the tree is merged, the pixels are composited once
+// at the root.
+struct ReduceNode {
+    std::vector<int> images;                // input image indices, drawn in this order
+    std::vector<cv::Mat> transforms;        // image -> node coordinates, one per image
+    std::vector<cv::KeyPoint> keypoints;    // node coordinates
+    cv::Mat descriptors;
+};
+
 class ImageStitcher : public QThread
 {
     Q_OBJECT
@@ -43,28 +103,91 @@ public:
 
     enum FeatcherMatcher{
         FLANN,
-        BRUTE_FORCE
+        BRUTE_FORCE,
+        SIMD_HAMMING    // exact like BRUTE_FORCE, ORB only (SURF falls back to BRUTE_FORCE), see HammingMatcher
     };
 
     enum AlgorithmType {
         CUMULATIVE,
         COMPOUND_HOMOGRAPHY,
         REDUCE,
-        FULL_MATCHES
+        FULL_MATCHES,
+        GLOBAL,     // all overlapping pairs matched, then every placement solved for at once (no step mode)
+        PHASE_CORRELATION,  // each image placed against the one before by phase correlation alone, no features (no step mode)
+        TRACKING    // each image placed against the one before from corners tracked into it, see FeatureTracker (no step mode)
+    };
+
+    enum Blending {
+        OVERWRITE,  // each image covers whatever is under it
+        MULTI_BAND  // once every image is placed the seams are blended band by band, see MosaicBlender
     };
 
     ImageStitcher(QStringList inputFiles,
                   double scaleFactor, double roiSize, double angleStdDevs, double lenStdDevs, double distMins,
                   ImageStitcher::FeatureDetector featureDetector, ImageStitcher::FeatcherMatcher featureMatcher,
                   bool stepModeState, AlgorithmType type, QObject *parent = 0);
+    // Both take effect at once, a paused step mode stitcher carries on right away.
     void nextStep(double angle, double length, double heuristic);
     void setStepMode(bool inputStepMode);
+    // Stops stitching at the next check, which is between images and pairs of images (the blend and
+    // the export are not interrupted once they have started). The mosaic is freed and the thread ends
+    // with stitchingFinished(false) soon after, wait() for it before deleting the stitcher.
+    void cancel();
+    bool isCancelled() const;
+    // how many upcoming images may be decoded and detected ahead of the one being stitched, 0 is fully serial
+    void setMaxFramesInFlight(int frames);
+    // Decoding, detection and the REDUCE and GLOBAL matching get at most threads worker threads
+    // (QThread::idealThreadCount() by default), and no more frames are in flight than that
+    void setWorkerThreads(int threads);
+    // Keep no more than megabytes of the mosaic in memory, tiles that haven't been drawn on for a
+    // while are compressed into spillDirectory (the temp dir if empty). 0, the default, keeps it all.
+    // The results handed out with the updates are shrunk to fit as well.
+    void setMemoryBudget(int megabytes, const QString &spillDirectory = QString());
+    // OVERWRITE by default. The multi-band blend is one more update at the end, bands is passed to
+    // MosaicBlender::setNumBands.
+    void setBlending(Blending mode, int bands = 5);
+    // Predict where each image lands from the telemetry in metaDataFile (see MetaDataParser) and only
+    // detect and match inside the predicted overlap. Matches further than tolerance (a fraction of the
+    // image diagonal) from the predicted position are dropped. An empty file name turns this off.
+    void setTelemetryFile(const QString &metaDataFile, double tolerance = 0.1);
+    // Once stitching has finished write the mosaic as a Cloud Optimized GeoTIFF to cogFile (georeferenced
+    // when there is telemetry) and/or as z/x/y tiles of tileFormat ("png" or "jpg") under tileDirectory.
+    // Either can be left empty. Both are written straight from the canvas, a strip at a time.
+    void setExport(const QString &cogPath, const QString &tilePath, const QString &tileExtension = "png");
+    // ORB with FLANN matches through a multi-probe LSH index built once per scene. More tables and a
+    // higher probe level find more of the true nearest neighbours, longer keys make each lookup cheaper.
+    void setLshParameters(int tables, int keyBits, int multiProbeLevel);
+    // Keep a match only if it is closer than ratio times the second best (0 keeps every best match).
+    // Defaults to 0.8 for ORB with FLANN, where the index is approximate, and 0 otherwise.
+    void setMatchRatio(double ratio);
+    // SIMD_HAMMING only: a match is kept only if the query is also the best one for its train descriptor
+    void setCrossCheck(bool enabled);
+    // Keypoints, descriptors and raw matches are kept in a FeatureStore, up to megabytes of them in
+    // memory. With a directory they are written there too and the next run over the same images
+    // (whatever the algorithm or thresholds) reads them back instead of detecting and matching again.
+    void setFeatureCache(const QString &directory, int megabytes = 128);
+    // How every homography between matched images is found, PROSAC by default. Each estimate is logged
+    // with its inliers, iterations and time.
+    void setEstimator(HomographyEstimator::Method method);
+    // Similarity first and affine or homography only where the matches call for it (PROSAC only).
+    // For nadir frames, and it keeps COMPOUND_HOMOGRAPHY's chain of products from drifting into
+    // perspective.
+    void setModelSelection(bool enabled);
+    // CUMULATIVE, COMPOUND_HOMOGRAPHY and FULL_MATCHES: phase correlate each image with the one before
+    // to narrow the search like telemetry does (which goes first where there is some), and place the
+    // image where it puts it if the features don't give 4 good matches.
+    void setPhaseGuess(bool enabled);
+    // Detect at most keypoints per image, evenly spread over a grid of cells that are detected in
+    // parallel (see GridDetector). 0, the default, runs the detector over the whole image at once.
+    void setFeatureBudget(int keypoints);
     static std::vector<cv::DMatch> pruneMatches(const std::vector<cv::DMatch>& allMatches,
                 const std::vector<cv::KeyPoint> &keypoints_object, const std::vector<cv::KeyPoint> &keypoints_scene,
                 double angleThreshold, double distanceThreshold, double heuristicThreshold);
 signals:
-    void stitchingUpdate(StitchingUpdateData* data);
-    void stitchingUpdateMatches(StitchingMatchesUpdateData data);
+    void stitchingUpdate(StitchingUpdate data);
+    void stitchingUpdateMatches(StitchingMatchesUpdate data);
+    // the last thing the thread does, success is false if it failed or was cancelled
+    void stitchingFinished(bool success);
 public slots:
 
 protected:
@@ -80,19 +203,92 @@ private:
     double NUM_MIN_DIST_TO_KEEP;   //   = 3;
     const ImageStitcher::FeatureDetector F_DETECTOR;
     const ImageStitcher::FeatcherMatcher F_MATCHER;
-    QMutex lock;
+    GridDetector gridDetector;
+    mutable QMutex lock;
+    QWaitCondition resumed;     // the pause is over, see pauseThreadUntilReady()
     bool currentlyPaused;   // protected by lock
     bool stepMode;  // protected by lock
+    bool cancelled; // protected by lock
     bool useROI;
     cv::Rect roi;
     AlgorithmType algorithm;
+    MosaicCanvas canvas;
+    Blending blending;
+    MosaicBlender blender;  // the images on the canvas, only kept for MULTI_BAND
+    MosaicFeatureMap featureMap;    // features already in the mosaic for CUMULATIVE and FULL_MATCHES
+    QByteArray featureMapState;     // a key for everything added to featureMap, see addToFeatureMap()
+    mutable FeatureStore featureStore;
+    HomographyEstimator estimator;
+    PhaseCorrelator correlator;
+    bool phaseGuess;
+    PhaseCorrelator::Frame lastPhase;   // of the image before the one being stitched
+    QThreadPool workers;
+    int maxFramesInFlight;
+    int requestedFramesInFlight;    // by setMaxFramesInFlight(), maxFramesInFlight is also held to the workers
+    QString telemetryFile;
+    double telemetryTolerance;
+    TelemetryPrior prior;
+    cv::Mat lastPlacement;  // homography of the last stitched image onto the canvas
+    std::vector<cv::Point2f> geoPixels;     // canvas points with a known position on the ground...
+    std::vector<cv::Point2d> geoLonLat;     // ...and that position
+    QString cogFile;
+    QString tileDirectory;
+    QString tileFormat;
+    int lshTables;
+    int lshKeyBits;
+    int lshProbeLevel;
+    double matchRatio;
+    bool crossCheck;
 
-    StitchingUpdateData* stitchImages(cv::Mat &objImage, cv::Mat &sceneImage);
+    friend class FramePipeline;
+    class MergeTask;
+    friend class MergeTask;
+    class PairTask;
+    friend class PairTask;
+    bool stitchAll();   // false if it failed or was cancelled
+    QSharedPointer<StitchingUpdateData> stitchImages(const PreparedFrame &object, const PreparedFrame &last);
+    bool runReduce();   // false if a pair could not be registered
+    void matchNodes(const ReduceNode &object, const ReduceNode &scene, cv::Size imageSize, std::vector<cv::DMatch> &matches) const;
+    bool mergeNodes(const ReduceNode &object, const ReduceNode &scene, const std::vector<cv::DMatch> &matches,
+                    double angle, double length, double heuristic, ReduceNode &merged, cv::Mat &homography) const;
+    cv::Mat compositeNode(const ReduceNode &node, const std::vector<cv::Mat> &images, cv::Point2f &origin) const;
+    bool runGlobal();   // false if the images don't all connect
+    bool runPhaseCorrelation();     // false if a pair didn't correlate
+    bool runTracking();     // false if too few corners could be tracked from one image to the next
+    bool usesPhase() const;
+    std::vector< std::pair<int, int> > candidatePairs(int numImages, cv::Size imageSize) const;
+    bool matchPair(const PreparedFrame &from, const PreparedFrame &to, cv::Size imageSize,
+                   double angle, double length, double heuristic, ImagePairMatches &pair) const;
+    void reviewMatches(const cv::Mat &object, const std::vector<cv::KeyPoint> &objFeatures,
+                       const cv::Mat &scene, const std::vector<cv::KeyPoint> &sceneFeatures,
+                       const std::vector<cv::DMatch> &matches);
+    void decodeFrame(PreparedFrame &frame) const;
+    void extractFeatures(PreparedFrame &frame) const;
+    PreparedFrame prepareFrame(const cv::Mat &image) const;
+    void detectFeatures(const cv::Mat &grayImage, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors,
+                        const cv::Mat &mask = cv::Mat()) const;
+    void setResult(StitchingUpdateData &update) const;
+    void clearCanvas();
+    cv::Rect placeImage(const cv::Mat &image, int index, const cv::Mat &homography);
+    void blendResult();
+    bool exportResult();
+    void loadTelemetry();
+    int telemetryMargin(cv::Size imageSize) const;
+    cv::Mat telemetryMask(int index, cv::Size imageSize) const;
+    bool predictNodePlacement(const ReduceNode &object, const ReduceNode &scene, cv::Size imageSize, cv::Mat &homography) const;
+    QByteArray detectorSettings() const;
+    QByteArray matcherSettings() const;
+    void addToFeatureMap(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors,
+                         const cv::Mat &homography, cv::Size imageSize);
+    cv::Ptr<cv::DescriptorMatcher> createMatcher() const;
+    cv::Mat estimateHomography(const std::vector<cv::Point2f> &from, const std::vector<cv::Point2f> &to,
+                               std::vector<uchar> *inliers = NULL) const;
+    void matchDescriptors(const cv::Mat &query, const cv::Mat &train, std::vector<cv::DMatch> &matches) const;
     void pauseThreadUntilReady();
 };
 
-Q_DECLARE_METATYPE(StitchingUpdateData*)
-Q_DECLARE_METATYPE(StitchingMatchesUpdateData)
+Q_DECLARE_METATYPE(StitchingUpdate)
+Q_DECLARE_METATYPE(StitchingMatchesUpdate)
 
 
 #endif // IMAGESTITCHER_H
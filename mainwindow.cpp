@@ -3,6 +3,7 @@
 #include "sharedfunctions.h"
 #include <fstream>
 #include <cmath>
+#include <algorithm>
 #include <QFileDialog>
 
 #include <opencv2/opencv.hpp>
@@ -19,14 +20,14 @@ using namespace cv;
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::MainWindow), stitcher(NULL), saveImageCounter(0), lastData(NULL), lastResult(NULL)
+    ui(new Ui::MainWindow), stitcher(NULL), saveImageCounter(0), lastResult(NULL)
 {
     ui->setupUi(this);
     ui->groupBox->hide();
     ui->groupBox_IS->hide();
 
-    qRegisterMetaType<StitchingUpdateData*>();   // Allows us to use the custom class in signals/slots
-    qRegisterMetaType<StitchingMatchesUpdateData>();
+    qRegisterMetaType<StitchingUpdate>("StitchingUpdate");   // Allows us to use the custom class in signals/slots
+    qRegisterMetaType<StitchingMatchesUpdate>("StitchingMatchesUpdate");
 
     parser.setFileName(QString("metaData.txt"));
 
@@ -85,8 +86,10 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
-    if (lastData) {
-        delete lastData;
+    if (stitcher) {
+        stitcher->cancel();
+        stitcher->wait();
+        delete stitcher;
     }
     if (lastResult) {
         delete lastResult;
@@ -102,11 +105,12 @@ void MainWindow::saveCurrentImage() {
     std::cout << "saved image " << fileName.toStdString() << std::endl;
 }
 
-void MainWindow::displayImage(cv::Mat& image) {
-    cvtColor(image, image,CV_BGR2RGB);
-    QImage qimgOrig((uchar*)image.data, image.cols, image.rows, image.step, QImage::Format_RGB888);
+void MainWindow::displayImage(const cv::Mat& image) {
+    if (image.empty()) return;
+    Mat rgb;    // the image may be shared with the stitcher, leave it alone
+    cvtColor(image, rgb, CV_BGR2RGB);
+    QImage qimgOrig((uchar*)rgb.data, rgb.cols, rgb.rows, rgb.step, QImage::Format_RGB888);
     ui->display->setImage(qimgOrig);
-    cvtColor(image, image, CV_RGB2BGR);
 }
 
 void MainWindow::IS_scaleChanged(int value) {
@@ -116,10 +120,11 @@ void MainWindow::IS_scaleChanged(int value) {
 
 void MainWindow::IS_radioButtonChanged() {
     if (lastData) {
+        // both are rendered from the snapshots in the update, the matches only ever here
         if (ui->radioButtonMatches->isChecked()) {
-            displayImage(lastData->currentFeatureMatches);
+            displayImage(lastData->currentFeatureMatches());
         } else {
-            displayImage(lastData->currentScene);
+            displayImage(lastData->currentScene());
         }
     }
 }
@@ -178,45 +183,79 @@ void MainWindow::stitchingStepClicked()
     }
 }
 
-void MainWindow::stitchingMatchesUpdate(StitchingMatchesUpdateData data) {
+void MainWindow::stitchingMatchesUpdate(StitchingMatchesUpdate data) {
     ui->frame_IS_step_controls->setEnabled(true);
     ui->frame_IS_showResults->setEnabled(false);
     ui->progressBar->setEnabled(false);
     currentMatches = data;
+    proposedMatches.setMatches(data->matches, data->objFeatures, data->sceneFeatures);
+    if (!data->object.empty() && !data->scene.empty()) {
+        matchPreview.setImages(data->object, data->objFeatures, data->scene, data->sceneFeatures);
+    } else {
+        matchPreview.clear();
+    }
     displayProposedMatches();
 }
 
+// Called on every slider move, the matches were sorted and the images drawn when they came in
+// so this only looks at the matches that cross a threshold
 void MainWindow::displayProposedMatches() {
-    if (!currentMatches.object.empty() && !currentMatches.scene.empty()) {
-        std::vector<cv::DMatch> goodMatches = ImageStitcher::pruneMatches(currentMatches.matches,
-             currentMatches.objFeatures, currentMatches.sceneFeatures,
-             ui->slider_IS_angle->getCurrentCustomValue(),
-             ui->slider_IS_length->getCurrentCustomValue(),
-             ui->slider_IS_heuristic->getCurrentCustomValue());
-        Mat imgMatches;
-        drawMatches( currentMatches.object, currentMatches.objFeatures,
-                     currentMatches.scene, currentMatches.sceneFeatures,
-                     goodMatches, imgMatches, Scalar(0, 255, 0), Scalar(255, 0, 0),
-                     vector<char>(), DrawMatchesFlags::DEFAULT );
-        cv::Rect crop = SharedFunctions::findBoundingBox(imgMatches);
-        imgMatches = imgMatches(crop);
-        displayImage(imgMatches);
-        ui->label_IS_numMatches->setText(QString("Good Matches: ") + QString::number(goodMatches.size()) + "/" + QString::number(currentMatches.matches.size()));
+    if (currentMatches && !currentMatches->object.empty() && !currentMatches->scene.empty()) {
+        double angle = ui->slider_IS_angle->getCurrentCustomValue();
+        double length = ui->slider_IS_length->getCurrentCustomValue();
+        double heuristic = ui->slider_IS_heuristic->getCurrentCustomValue();
+        std::vector<int> changed;
+        proposedMatches.setThresholds(angle, length, heuristic, changed);
+        matchPreview.update(proposedMatches, changed);
+        displayImage(matchPreview.image());
+        ui->label_IS_numMatches->setText(QString("Good Matches: ") + QString::number(proposedMatches.numKept()) + "/" + QString::number(currentMatches->matches.size()));
+
+        int bins = ui->label_IS_angleHistogram->width() / 2;
+        double maxAngle = ui->slider_IS_angle->getCustomMax();
+        double maxLength = ui->slider_IS_length->getCustomMax();
+        double minHeuristic = ui->slider_IS_heuristic->getCustomMin();
+        double maxHeuristic = ui->slider_IS_heuristic->getCustomMax();
+        showHistogram(ui->label_IS_angleHistogram,
+                      proposedMatches.histogram(MatchExplorer::ANGLE, bins, 0.0, maxAngle), angle / maxAngle);
+        showHistogram(ui->label_IS_lengthHistogram,
+                      proposedMatches.histogram(MatchExplorer::LENGTH, bins, 0.0, maxLength), length / maxLength);
+        showHistogram(ui->label_IS_heuristicHistogram,
+                      proposedMatches.histogram(MatchExplorer::DISTANCE, bins, minHeuristic, maxHeuristic),
+                      (heuristic - minHeuristic) / (maxHeuristic - minHeuristic));
+    }
+}
+
+// Bars for counts across label, the ones left of keptFraction of the width are what is kept
+void MainWindow::showHistogram(QLabel* label, const std::vector<int> &counts, double keptFraction) {
+    Mat plot(std::max(1, label->height() - 2), std::max(1, label->width() - 2), CV_8UC3, Scalar(255, 255, 255));
+    int highest = counts.empty() ? 0 : *std::max_element(counts.begin(), counts.end());
+    int cut = cvRound(keptFraction * plot.cols);
+    for (unsigned i = 0; i < counts.size() && highest > 0; i++) {
+        int x0 = i * plot.cols / counts.size();
+        int x1 = (i + 1) * plot.cols / counts.size();
+        int height = cvCeil((double)counts[i] / highest * plot.rows);
+        if (height == 0 || x1 <= x0) continue;
+        Scalar colour = x0 < cut ? Scalar(0, 160, 0) : Scalar(170, 170, 170);
+        rectangle(plot, Rect(x0, plot.rows - height, x1 - x0, height), colour, CV_FILLED);
     }
+    line(plot, Point(cut, 0), Point(cut, plot.rows - 1), Scalar(0, 0, 255));
+    cvtColor(plot, plot, CV_BGR2RGB);
+    QImage image((uchar*)plot.data, plot.cols, plot.rows, plot.step, QImage::Format_RGB888);
+    label->setPixmap(QPixmap::fromImage(image));    // a deep copy, plot can go
 }
 
-void MainWindow::stitchingUpdate(StitchingUpdateData* data) {
+void MainWindow::stitchingUpdate(StitchingUpdate data) {
 
-    displayImage(data->currentScene);
     if (data->totalImages > 0) {
         ui->progressBar->setValue(((double)data->curIndex)/ data->totalImages * 100);
     }
     ui->label_IS_progress->setText(QString::number(data->curIndex) + "/" + QString::number(data->totalImages));
-    //saveImage(data->currentScene, "resultAfter.png");
-    if (lastData) {
-        delete lastData;
+    if (!data->hasScene()) {
+        // progress only (REDUCE and GLOBAL draw the mosaic once at the end), keep showing the last result
+        return;
     }
     lastData = data;
+    IS_radioButtonChanged();
 }
 
 void MainWindow::startImageStitchingClicked() {
@@ -224,7 +263,10 @@ void MainWindow::startImageStitchingClicked() {
     if (inputFiles.size() < 2) return;    // don't crash on one input image
 
     if (stitcher) {
-        stitcher->terminate();    //possibly risky way to terminate an already running stitcher
+        // the old job stops at its next check (a paused one at once) and frees its mosaic
+        disconnect(stitcher, 0, this, 0);
+        stitcher->cancel();
+        stitcher->wait();
         delete stitcher;
         ui->progressBar->setEnabled(true);
         ui->frame_IS_showResults->setEnabled(true);
@@ -240,12 +282,24 @@ void MainWindow::startImageStitchingClicked() {
         algorithm = ImageStitcher::FULL_MATCHES;
     } else if (ui->radio_IS_reduce->isChecked()) {
         algorithm = ImageStitcher::REDUCE;
+    } else if (ui->radio_IS_global->isChecked()) {
+        algorithm = ImageStitcher::GLOBAL;
+    } else if (ui->radio_IS_phase->isChecked()) {
+        algorithm = ImageStitcher::PHASE_CORRELATION;
+    } else if (ui->radio_IS_tracking->isChecked()) {
+        algorithm = ImageStitcher::TRACKING;
     } else if (ui->radio_IS_ROI->isChecked()) {
         algorithm = ImageStitcher::CUMULATIVE;
     }
     stitcher = new ImageStitcher(inputFiles, ui->slider_IS_resize->value() / 100.0, 1.25, angleParam, lengthParam, heuristicParam, ImageStitcher::SURF, ImageStitcher::BRUTE_FORCE, stepMode, algorithm);
-    connect(stitcher, SIGNAL(stitchingUpdate(StitchingUpdateData*)), this, SLOT(stitchingUpdate(StitchingUpdateData*)), Qt::QueuedConnection);
-    connect(stitcher, SIGNAL(stitchingUpdateMatches(StitchingMatchesUpdateData)), this, SLOT(stitchingMatchesUpdate(StitchingMatchesUpdateData)));
+    if (ui->checkBox_IS_telemetry->isChecked()) {
+        stitcher->setTelemetryFile(QString("metaData.txt"));
+    }
+    if (ui->checkBox_IS_blend->isChecked()) {
+        stitcher->setBlending(ImageStitcher::MULTI_BAND);
+    }
+    connect(stitcher, SIGNAL(stitchingUpdate(StitchingUpdate)), this, SLOT(stitchingUpdate(StitchingUpdate)), Qt::QueuedConnection);
+    connect(stitcher, SIGNAL(stitchingUpdateMatches(StitchingMatchesUpdate)), this, SLOT(stitchingMatchesUpdate(StitchingMatchesUpdate)));
     stitcher->start();
 }
 
@@ -273,7 +327,7 @@ void MainWindow::detectObjects() {
 void MainWindow::detectButtonClicked(){
     QString name = QFileDialog::getOpenFileName();
     currentORData = parser.searchForImage(name);
-    objectRecognizer.fullSizeInputImage = imread( name.toStdString() );
+    objectRecognizer.loadInputImage( name.toStdString() );
     detectObjects();
 }
 
@@ -1,12 +1,15 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <QLabel>
 #include <QMainWindow>
 #include <QTimer>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include "imagestitcher.h"
+#include "matchexplorer.h"
+#include "matchpreview.h"
 #include "metadataparser.h"
 #include "objectrecognizer.h"
 
@@ -23,7 +26,7 @@ public:
     ~MainWindow();
 
 private slots:
-    void displayImage(cv::Mat& image);
+    void displayImage(const cv::Mat& image);
     void saveCurrentImage();
     void stitchImagesClicked();
     void startImageStitchingClicked();
@@ -38,14 +41,14 @@ private slots:
     void polyErrorChangedOR(int value);
     void IS_scaleChanged(int value);
     void IS_radioButtonChanged();
-    void stitchingUpdate(StitchingUpdateData *data);
+    void stitchingUpdate(StitchingUpdate data);
     int getGaussianBlurValue();
     void displayRecognitionResult();
     void stitchingAngleChanged(double value);
     void stitchingDistanceChanged(double value);
     void stitchingHeuristicChanged(double value);
     void stitchingStepClicked();
-    void stitchingMatchesUpdate(StitchingMatchesUpdateData data);
+    void stitchingMatchesUpdate(StitchingMatchesUpdate data);
     void displayProposedMatches();
     void stitchStepRunClicked();
     void mouseMovedOnDisplay(int x, int y);
@@ -53,6 +56,7 @@ private slots:
     
 private:
     void detectObjects();
+    void showHistogram(QLabel* label, const std::vector<int> &counts, double keptFraction);
     //For getting frames from camera/video/picture
     cv::VideoCapture capWebcam;
     int curIndex;
@@ -61,9 +65,11 @@ private:
     ObjectRecognizer objectRecognizer;
     ImageStitcher* stitcher;
     int saveImageCounter;
-    StitchingUpdateData* lastData;
+    StitchingUpdate lastData;
     RecognizerResults* lastResult;
-    StitchingMatchesUpdateData currentMatches;
+    StitchingMatchesUpdate currentMatches;
+    MatchExplorer proposedMatches;  // currentMatches ready to refilter on every slider move
+    MatchPreview matchPreview;      // and drawn, only the lines that change are drawn again
     MetaDataParser parser;
     MetaData currentORData;
 
@@ -0,0 +1,225 @@
+#include "matchexplorer.h"
+
+#include <algorithm>
+
+using namespace cv;
+
+namespace {
+
+// orders match indices by a value kept alongside
+class ByValue {
+public:
+    explicit ByValue(const std::vector<double> &values) : values(values) {}
+    bool operator()(int a, int b) const { return values[a] < values[b]; }
+private:
+    const std::vector<double> &values;
+};
+
+class ByScore {
+public:
+    explicit ByScore(const MatchFilter &geometry) : geometry(geometry) {}
+    bool operator()(int a, int b) const { return geometry.match(a).distance < geometry.match(b).distance; }
+private:
+    const MatchFilter &geometry;
+};
+
+// population standard deviation of the first count values from their prefix sums
+double deviationOf(const std::vector<double> &sums, const std::vector<double> &squares, int count, double &mean) {
+    mean = sums[count] / count;
+    double variance = squares[count] / count - mean * mean;
+    return variance > 0 ? std::sqrt(variance) : 0.0;
+}
+
+// the indices of the first count of order sorted by how far values are from centre, and those distances
+void sortByDeviation(const std::vector<int> &order, int count, const std::vector<double> &values, double centre,
+                     std::vector<int> &sorted, std::vector<double> &deviations) {
+    std::vector<double> deviation(values.size());
+    for (int i = 0; i < count; i++) {
+        deviation[order[i]] = std::abs(values[order[i]] - centre);
+    }
+    sorted.assign(order.begin(), order.begin() + count);
+    std::sort(sorted.begin(), sorted.end(), ByValue(deviation));
+    deviations.resize(count);
+    for (int i = 0; i < count; i++) {
+        deviations[i] = deviation[sorted[i]];
+    }
+}
+
+void addToHistogram(std::vector<int> &counts, double value, double minValue, double maxValue) {
+    int bins = counts.size();
+    int bin = maxValue > minValue ? (int)((value - minValue) / (maxValue - minValue) * bins) : 0;
+    counts[std::max(0, std::min(bins - 1, bin))]++;
+}
+
+}
+
+MatchExplorer::MatchExplorer()
+{
+    clear();
+}
+
+void MatchExplorer::clear() {
+    geometry.clear();
+    setMatches(std::vector<DMatch>(), std::vector<KeyPoint>(), std::vector<KeyPoint>());
+}
+
+void MatchExplorer::setMatches(const std::vector<DMatch> &matches,
+                               const std::vector<KeyPoint> &keypoints_object, const std::vector<KeyPoint> &keypoints_scene) {
+    geometry.setMatches(matches, keypoints_object, keypoints_scene);
+    int count = geometry.size();
+
+    byDistance.resize(count);
+    for (int i = 0; i < count; i++) {
+        byDistance[i] = i;
+    }
+    std::stable_sort(byDistance.begin(), byDistance.end(), ByScore(geometry));
+    sortedDistances.resize(count);
+    angleSums.assign(count + 1, 0.0);
+    angleSquares.assign(count + 1, 0.0);
+    lengthSums.assign(count + 1, 0.0);
+    lengthSquares.assign(count + 1, 0.0);
+    for (int i = 0; i < count; i++) {
+        int m = byDistance[i];
+        sortedDistances[i] = geometry.match(m).distance;
+        double angle = geometry.angle(m);
+        double length = geometry.length(m);
+        angleSums[i + 1] = angleSums[i] + angle;
+        angleSquares[i + 1] = angleSquares[i] + angle * angle;
+        lengthSums[i + 1] = lengthSums[i] + length;
+        lengthSquares[i + 1] = lengthSquares[i] + length * length;
+    }
+
+    heuristicCount = -1;
+    angleStdDev = 0.0;
+    lengthStdDev = 0.0;
+    byAngle.clear();
+    angleDeviations.clear();
+    byLength.clear();
+    lengthDeviations.clear();
+    anglePassing = 0;
+    lengthPassing = 0;
+    inHeuristic.assign(count, 0);
+    inAngle.assign(count, 0);
+    inLength.assign(count, 0);
+    kept.assign(count, 0);
+    keptCount = 0;
+}
+
+int MatchExplorer::size() const {
+    return geometry.size();
+}
+
+const DMatch& MatchExplorer::match(int i) const {
+    return geometry.match(i);
+}
+
+void MatchExplorer::setThresholds(double angleThreshold, double distanceThreshold, double heuristicThreshold,
+                                  std::vector<int> &changed) {
+    changed.clear();
+    double maxDistance = heuristicThreshold * geometry.minDistance();
+    int count = std::upper_bound(sortedDistances.begin(), sortedDistances.end(), maxDistance) - sortedDistances.begin();
+    if (count == heuristicCount) {
+        moveThreshold(byAngle, angleDeviations, angleStdDev * angleThreshold, anglePassing, inAngle, changed);
+        moveThreshold(byLength, lengthDeviations, lengthStdDev * distanceThreshold, lengthPassing, inLength, changed);
+        return;
+    }
+
+    // the statistics moved, every match is looked at again (still no sums over the matches)
+    setHeuristicCount(count);
+    inAngle.assign(inAngle.size(), 0);
+    inLength.assign(inLength.size(), 0);
+    anglePassing = std::upper_bound(angleDeviations.begin(), angleDeviations.end(), angleStdDev * angleThreshold)
+                   - angleDeviations.begin();
+    for (int i = 0; i < anglePassing; i++) {
+        inAngle[byAngle[i]] = 1;
+    }
+    lengthPassing = std::upper_bound(lengthDeviations.begin(), lengthDeviations.end(), lengthStdDev * distanceThreshold)
+                    - lengthDeviations.begin();
+    for (int i = 0; i < lengthPassing; i++) {
+        inLength[byLength[i]] = 1;
+    }
+    for (int i = 0; i < size(); i++) {
+        updateKept(i, changed);
+    }
+}
+
+void MatchExplorer::setHeuristicCount(int count) {
+    heuristicCount = count;
+    inHeuristic.assign(inHeuristic.size(), 0);
+    for (int i = 0; i < count; i++) {
+        inHeuristic[byDistance[i]] = 1;
+    }
+    byAngle.clear();
+    angleDeviations.clear();
+    byLength.clear();
+    lengthDeviations.clear();
+    angleStdDev = 0.0;
+    lengthStdDev = 0.0;
+    if (count == 0) return;
+
+    std::vector<double> angles(size()), lengths(size());
+    for (int i = 0; i < count; i++) {
+        angles[byDistance[i]] = geometry.angle(byDistance[i]);
+        lengths[byDistance[i]] = geometry.length(byDistance[i]);
+    }
+    double angleMean, lengthMean;
+    angleStdDev = deviationOf(angleSums, angleSquares, count, angleMean);
+    lengthStdDev = deviationOf(lengthSums, lengthSquares, count, lengthMean);
+    sortByDeviation(byDistance, count, angles, angleMean, byAngle, angleDeviations);
+    sortByDeviation(byDistance, count, lengths, lengthMean, byLength, lengthDeviations);
+}
+
+// Only the matches between the old and the new limit in order change sides
+void MatchExplorer::moveThreshold(const std::vector<int> &order, const std::vector<double> &deviations,
+                                  double limit, int &passing, std::vector<uchar> &passes, std::vector<int> &changed) {
+    int now = std::upper_bound(deviations.begin(), deviations.end(), limit) - deviations.begin();
+    for (int i = std::min(passing, now); i < std::max(passing, now); i++) {
+        passes[order[i]] = now > passing;
+        updateKept(order[i], changed);
+    }
+    passing = now;
+}
+
+void MatchExplorer::updateKept(int i, std::vector<int> &changed) {
+    uchar keep = inHeuristic[i] && inAngle[i] && inLength[i];
+    if (keep == kept[i]) return;
+    kept[i] = keep;
+    keptCount += keep ? 1 : -1;
+    changed.push_back(i);
+}
+
+bool MatchExplorer::isKept(int i) const {
+    return kept[i] != 0;
+}
+
+int MatchExplorer::numKept() const {
+    return keptCount;
+}
+
+std::vector<DMatch> MatchExplorer::keptMatches() const {
+    std::vector<DMatch> matches;
+    matches.reserve(keptCount);
+    for (int i = 0; i < size(); i++) {
+        if (kept[i]) matches.push_back(geometry.match(i));
+    }
+    return matches;
+}
+
+std::vector<int> MatchExplorer::histogram(Measure measure, int bins, double minValue, double maxValue) const {
+    std::vector<int> counts(std::max(1, bins), 0);
+    if (measure == DISTANCE) {
+        double best = geometry.minDistance();
+        for (int i = 0; i < size(); i++) {
+            double distance = geometry.match(i).distance;
+            addToHistogram(counts, best > 0 ? distance / best : (distance > 0 ? maxValue : minValue), minValue, maxValue);
+        }
+        return counts;
+    }
+    const std::vector<double> &deviations = measure == ANGLE ? angleDeviations : lengthDeviations;
+    double stdDev = measure == ANGLE ? angleStdDev : lengthStdDev;
+    for (unsigned i = 0; i < deviations.size(); i++) {
+        addToHistogram(counts, stdDev > 0 ? deviations[i] / stdDev : (deviations[i] > 0 ? maxValue : minValue),
+                       minValue, maxValue);
+    }
+    return counts;
+}
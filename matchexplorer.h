@@ -0,0 +1,76 @@
+#ifndef MATCHEXPLORER_H
+#define MATCHEXPLORER_H
+
+#include <opencv2/opencv.hpp>
+
+#include "matchfilter.h"
+
+// MatchFilter::filter (MEAN_STDDEV) for thresholds that keep moving, as the step mode
+// sliders move them. The matches are sorted by descriptor distance once, with prefix
+// sums of their angles and lengths, so the statistics for any heuristic threshold are a
+// binary search away. The matches a heuristic threshold lets through are then sorted by
+// how far their angle and their length are from the centre, moving the angle or the
+// length threshold only visits the matches that cross it.
+class MatchExplorer
+{
+public:
+    enum Measure {
+        ANGLE,      // deviations from the mean angle
+        LENGTH,     // deviations from the mean length
+        DISTANCE    // descriptor distance as a multiple of the best
+    };
+
+    MatchExplorer();
+    void setMatches(const std::vector<cv::DMatch> &matches,
+                    const std::vector<cv::KeyPoint> &keypoints_object, const std::vector<cv::KeyPoint> &keypoints_scene);
+    void clear();
+    int size() const;
+    const cv::DMatch& match(int i) const;
+
+    // Moves to the thresholds of MatchFilter::filter. changed receives the matches (indices into the
+    // ones set) that went in or out since the last call, all of the kept ones after setMatches().
+    void setThresholds(double angleThreshold, double distanceThreshold, double heuristicThreshold,
+                       std::vector<int> &changed);
+    bool isKept(int i) const;
+    int numKept() const;
+    std::vector<cv::DMatch> keptMatches() const;
+
+    // How many matches fall in each of bins equal steps from minValue to maxValue, the first and last
+    // bins also take everything outside. ANGLE and LENGTH count the matches the heuristic threshold
+    // lets through.
+    std::vector<int> histogram(Measure measure, int bins, double minValue, double maxValue) const;
+
+private:
+    void setHeuristicCount(int count);
+    void moveThreshold(const std::vector<int> &order, const std::vector<double> &deviations,
+                       double limit, int &passing, std::vector<uchar> &passes, std::vector<int> &changed);
+    void updateKept(int i, std::vector<int> &changed);
+
+    MatchFilter geometry;
+    std::vector<int> byDistance;        // match indices, best score first
+    std::vector<float> sortedDistances; // their scores
+    std::vector<double> angleSums;      // prefix sums in byDistance order, one longer than the matches
+    std::vector<double> angleSquares;
+    std::vector<double> lengthSums;
+    std::vector<double> lengthSquares;
+
+    // for the current heuristic threshold, which lets through the first heuristicCount of byDistance
+    int heuristicCount;
+    double angleStdDev;
+    double lengthStdDev;
+    std::vector<int> byAngle;           // those matches, closest to the mean angle first
+    std::vector<double> angleDeviations;    // how close, ascending
+    std::vector<int> byLength;
+    std::vector<double> lengthDeviations;
+    int anglePassing;       // how many of byAngle the angle threshold lets through
+    int lengthPassing;
+
+    std::vector<uchar> inHeuristic;     // one per match
+    std::vector<uchar> inAngle;
+    std::vector<uchar> inLength;
+    std::vector<uchar> kept;
+    int keptCount;
+    bool thresholdsSet;
+};
+
+#endif // MATCHEXPLORER_H
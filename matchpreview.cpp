@@ -0,0 +1,86 @@
+#include "matchpreview.h"
+#include "sharedfunctions.h"
+
+using namespace cv;
+
+namespace {
+
+const Vec3b LINE_COLOUR(0, 255, 0);     // what the step mode has always drawn matches in
+const Scalar KEYPOINT_COLOUR(255, 0, 0);
+const int RING_RADIUS = 3;              // drawMatches circles both ends this big
+
+}
+
+MatchPreview::MatchPreview() : sceneOffset(0)
+{
+    Mat circleMask = Mat::zeros(2 * RING_RADIUS + 1, 2 * RING_RADIUS + 1, CV_8UC1);
+    circle(circleMask, Point(RING_RADIUS, RING_RADIUS), RING_RADIUS, Scalar(255), 1, 8);
+    for (int y = 0; y < circleMask.rows; y++) {
+        for (int x = 0; x < circleMask.cols; x++) {
+            if (circleMask.at<uchar>(y, x)) ring.push_back(Point(x - RING_RADIUS, y - RING_RADIUS));
+        }
+    }
+}
+
+void MatchPreview::clear() {
+    base = Mat();
+    drawn = Mat();
+    coverage = Mat();
+    crop = Rect();
+    objectKeypoints.clear();
+    sceneKeypoints.clear();
+    sceneOffset = 0;
+}
+
+void MatchPreview::setImages(const Mat &object, const std::vector<KeyPoint> &objFeatures,
+                             const Mat &scene, const std::vector<KeyPoint> &sceneFeatures) {
+    objectKeypoints = objFeatures;
+    sceneKeypoints = sceneFeatures;
+    sceneOffset = object.cols;
+    drawMatches( object, objFeatures, scene, sceneFeatures, std::vector<DMatch>(), base,
+                 Scalar(LINE_COLOUR), KEYPOINT_COLOUR, std::vector<char>(), DrawMatchesFlags::DEFAULT );
+    drawn = base.clone();
+    coverage = Mat::zeros(base.size(), CV_16UC1);
+    // the lines only ever join keypoints, they never reach out of the content
+    crop = SharedFunctions::findBoundingBox(base);
+    if (crop.area() == 0) {
+        crop = Rect(0, 0, base.cols, base.rows);
+    }
+}
+
+void MatchPreview::update(const MatchExplorer &explorer, const std::vector<int> &changed) {
+    if (drawn.empty()) return;
+    for (unsigned i = 0; i < changed.size(); i++) {
+        trace(explorer.match(changed[i]), explorer.isKept(changed[i]));
+    }
+}
+
+Mat MatchPreview::image() const {
+    if (drawn.empty()) return Mat();
+    return drawn(crop);
+}
+
+// Adds or takes away one line with a ring at both ends, pixel by pixel
+void MatchPreview::trace(const DMatch &match, bool add) {
+    Point from(cvRound(objectKeypoints[match.queryIdx].pt.x), cvRound(objectKeypoints[match.queryIdx].pt.y));
+    Point to(cvRound(sceneKeypoints[match.trainIdx].pt.x) + sceneOffset, cvRound(sceneKeypoints[match.trainIdx].pt.y));
+    LineIterator line(drawn, from, to, 8);
+    for (int i = 0; i < line.count; i++, ++line) {
+        paint(line.pos(), add);
+    }
+    for (unsigned i = 0; i < ring.size(); i++) {
+        paint(from + ring[i], add);
+        paint(to + ring[i], add);
+    }
+}
+
+void MatchPreview::paint(Point p, bool add) {
+    if (p.x < 0 || p.y < 0 || p.x >= drawn.cols || p.y >= drawn.rows) return;
+    ushort &lines = coverage.at<ushort>(p);
+    if (add) {
+        lines++;
+    } else if (lines > 0) {
+        lines--;
+    }
+    drawn.at<Vec3b>(p) = lines > 0 ? LINE_COLOUR : base.at<Vec3b>(p);
+}
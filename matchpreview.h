@@ -0,0 +1,41 @@
+#ifndef MATCHPREVIEW_H
+#define MATCHPREVIEW_H
+
+#include <opencv2/opencv.hpp>
+
+#include "matchexplorer.h"
+
+// The step mode picture of the proposed matches, as drawMatches draws it: the object and
+// the scene side by side with their keypoints and a line for every kept match. The images
+// and keypoints are drawn (and cropped to their content) once, after that only the lines
+// that come and go are. Every line is the same colour, so a count of the lines over each
+// pixel is all it takes to rub one out again.
+class MatchPreview
+{
+public:
+    MatchPreview();
+    void clear();
+    // the images and keypoints without any lines
+    void setImages(const cv::Mat &object, const std::vector<cv::KeyPoint> &objFeatures,
+                   const cv::Mat &scene, const std::vector<cv::KeyPoint> &sceneFeatures);
+    // Draws the lines of the matches in changed that explorer now keeps and rubs out the ones it
+    // no longer does, changed being what MatchExplorer::setThresholds handed out
+    void update(const MatchExplorer &explorer, const std::vector<int> &changed);
+    // cropped to the content, shared with the preview until the next update
+    cv::Mat image() const;
+
+private:
+    void trace(const cv::DMatch &match, bool add);
+    void paint(cv::Point p, bool add);
+
+    cv::Mat base;       // images and keypoints
+    cv::Mat drawn;      // base with the lines
+    cv::Mat coverage;   // CV_16UC1, how many lines go over each pixel
+    cv::Rect crop;
+    std::vector<cv::KeyPoint> objectKeypoints;
+    std::vector<cv::KeyPoint> sceneKeypoints;
+    int sceneOffset;    // the scene is drawn right of the object
+    std::vector<cv::Point> ring;    // the end point circle, relative to its centre
+};
+
+#endif // MATCHPREVIEW_H
@@ -0,0 +1,339 @@
+#include "mosaicblender.h"
+#include "warpcomposite.h"
+
+#include <QDir>
+
+#include <algorithm>
+
+using namespace cv;
+
+namespace {
+
+const int MAX_BANDS = 7;    // the halo is then half a block
+
+int blockIndexOf(int coordinate) {
+    // rounds towards -infinity like the canvas tiles
+    int size = MosaicBlender::BLOCK_SIZE;
+    return coordinate >= 0 ? coordinate / size : -((-coordinate + size - 1) / size);
+}
+
+// How far inside the frame every pixel of area is, in frame pixels. Pixels it is further
+// inside of than any frame before it become its own. Pixels within half a pixel of the
+// frame edge are left to the others, bilinear sampling could still have missed them.
+void claimPixels(const Matx33d &toFrame, Size frameSize, const Rect &area, const Rect &footprint, int id,
+                 Mat &best, Mat &owner) {
+    Rect covered = footprint & area;
+    double right = frameSize.width - 1.0;
+    double bottom = frameSize.height - 1.0;
+    for (int y = covered.y; y < covered.y + covered.height; y++) {
+        float* bestRow = best.ptr<float>(y - area.y);
+        int* ownerRow = owner.ptr<int>(y - area.y);
+        for (int x = covered.x; x < covered.x + covered.width; x++) {
+            double w = toFrame(2,0) * x + toFrame(2,1) * y + toFrame(2,2);
+            if (w <= 0) continue;
+            double sx = (toFrame(0,0) * x + toFrame(0,1) * y + toFrame(0,2)) / w;
+            double sy = (toFrame(1,0) * x + toFrame(1,1) * y + toFrame(1,2)) / w;
+            double inside = std::min(std::min(sx, sy), std::min(right - sx, bottom - sy));
+            if (inside < 0.5) continue;
+            int i = x - area.x;
+            if (inside > bestRow[i]) {
+                bestRow[i] = (float)inside;
+                ownerRow[i] = id;
+            }
+        }
+    }
+}
+
+// sum *= weight, or sum /= weight where that isn't ~0 (and 0 elsewhere), weight has one channel
+void scaleByWeight(Mat &sum, const Mat &weight, bool divide) {
+    int cn = sum.channels();
+    for (int y = 0; y < sum.rows; y++) {
+        float* s = sum.ptr<float>(y);
+        const float* w = weight.ptr<float>(y);
+        for (int x = 0; x < sum.cols; x++) {
+            float scale = !divide ? w[x] : w[x] > 1e-5f ? 1.0f / w[x] : 0.0f;
+            for (int c = 0; c < cn; c++) {
+                s[x * cn + c] *= scale;
+            }
+        }
+    }
+}
+
+void gaussianPyramid(const Mat &base, int levels, std::vector<Mat> &pyramid) {
+    pyramid.resize(levels + 1);
+    pyramid[0] = base;
+    for (int k = 0; k < levels; k++) {
+        pyrDown(pyramid[k], pyramid[k + 1]);
+    }
+}
+
+// levels band pass images, finest first, and what is left below them last. Only the pixels
+// coverage (8 bit) has are used: every level is blurred along with the coverage and divided
+// by it, so the black around a frame doesn't darken its edges in the coarser bands.
+void laplacianPyramid(const Mat &image, const Mat &coverage, int levels, std::vector<Mat> &pyramid) {
+    pyramid.resize(levels + 1);
+    Mat current, weight;
+    image.convertTo(current, CV_32F);
+    coverage.convertTo(weight, CV_32F, 1.0 / 255.0);
+    scaleByWeight(current, weight, false);
+    for (int k = 0; k < levels; k++) {
+        Mat down, downWeight, up, upWeight;
+        pyrDown(current, down);
+        pyrDown(weight, downWeight);
+        pyrUp(down, up, current.size());
+        pyrUp(downWeight, upWeight, weight.size());
+        scaleByWeight(current, weight, true);
+        scaleByWeight(up, upWeight, true);
+        pyramid[k] = current - up;
+        current = down;
+        weight = downWeight;
+    }
+    scaleByWeight(current, weight, true);
+    pyramid[levels] = current;
+}
+
+// sum += band * weight and weightSum += weight, weight has one channel
+void accumulate(const Mat &band, const Mat &weight, Mat &sum, Mat &weightSum) {
+    int cn = band.channels();
+    for (int y = 0; y < band.rows; y++) {
+        const float* b = band.ptr<float>(y);
+        const float* w = weight.ptr<float>(y);
+        float* s = sum.ptr<float>(y);
+        float* ws = weightSum.ptr<float>(y);
+        for (int x = 0; x < band.cols; x++) {
+            if (w[x] == 0) continue;
+            for (int c = 0; c < cn; c++) {
+                s[x * cn + c] += b[x * cn + c] * w[x];
+            }
+            ws[x] += w[x];
+        }
+    }
+}
+
+}
+
+// Decodes the compressed frames a batch of blocks needs, each into its own slot
+class MosaicBlender::DecodeFrames : public ParallelLoopBody {
+public:
+    DecodeFrames(const std::vector<Frame> &frames, const std::vector<int> &ids, std::vector<Mat> &images)
+        : frames(frames), ids(ids), images(images) {}
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; i++) {
+            images[ids[i]] = frames[ids[i]].compressed->decode();
+        }
+    }
+
+private:
+    const std::vector<Frame> &frames;
+    const std::vector<int> &ids;
+    std::vector<Mat> &images;
+};
+
+class MosaicBlender::BlendBlocks : public ParallelLoopBody {
+public:
+    BlendBlocks(const MosaicBlender &blender, const std::vector<Rect> &blocks, const std::vector< std::vector<int> > &covering,
+                const std::vector<Mat> &images, int first, std::vector<Mat> &results)
+        : blender(blender), blocks(blocks), covering(covering), images(images), first(first), results(results) {}
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; i++) {
+            blender.blendBlock(blocks[first + i], covering[first + i], images, results[i]);
+        }
+    }
+
+private:
+    const MosaicBlender &blender;
+    const std::vector<Rect> &blocks;
+    const std::vector< std::vector<int> > &covering;
+    const std::vector<Mat> &images;
+    int first;
+    std::vector<Mat> &results;
+};
+
+MosaicBlender::MosaicBlender() : bands(5), budget(0), spillDirectory(QDir::tempPath())
+{
+}
+
+void MosaicBlender::clear() {
+    frames.clear();
+}
+
+int MosaicBlender::size() const {
+    return frames.size();
+}
+
+void MosaicBlender::setNumBands(int numBands) {
+    bands = std::max(1, std::min(MAX_BANDS, numBands));
+}
+
+int MosaicBlender::numBands() const {
+    return bands;
+}
+
+void MosaicBlender::setMemoryBudget(size_t bytes, const QString &directory) {
+    budget = bytes;
+    spillDirectory = directory.isEmpty() ? QDir::tempPath() : directory;
+}
+
+// Far enough that nothing outside it reaches the block through the coarsest band: going
+// down and coming back up again each spread a pixel over at most 2^(bands+1)
+int MosaicBlender::halo() const {
+    return 4 << bands;
+}
+
+// what blending one block holds at once: the accumulated and the current pyramids of
+// both the frame and its weights, the current coverage pyramid, the ownership maps and
+// the warped frame and its coverage
+size_t MosaicBlender::blockBytes(int channels) const {
+    size_t side = BLOCK_SIZE + 2 * halo();
+    size_t pyramids = sizeof(float) * (2 * channels + 3) * 4 / 3;
+    return side * side * (pyramids + sizeof(float) + sizeof(int) + channels + 1);
+}
+
+void MosaicBlender::add(const Mat &image, const Mat &homography) {
+    if (image.empty()) return;
+    Frame frame;
+    frame.size = image.size();
+    frame.type = image.type();
+    frame.homography = Matx33d(homography);
+    frame.footprint = WarpComposite::footprint(image.size(), homography);
+    // only the blocks being blended need frames decoded, memory budget or not
+    frame.compressed = MappedTile::create(image, spillDirectory);
+    if (frame.compressed.isNull()) {
+        frame.image = image;
+    }
+    frames.push_back(frame);
+}
+
+void MosaicBlender::blend(MosaicCanvas &canvas) const {
+    if (frames.empty() || canvas.empty()) return;
+    int h = halo();
+
+    // the blocks some frame lands on, and every frame that reaches each through its halo
+    Rect bounds = canvas.bounds();
+    std::vector< Rect > blocks;
+    std::vector< std::vector<int> > covering;
+    for (int row = blockIndexOf(bounds.y); row <= blockIndexOf(bounds.y + bounds.height - 1); row++) {
+        for (int col = blockIndexOf(bounds.x); col <= blockIndexOf(bounds.x + bounds.width - 1); col++) {
+            Rect block(col * BLOCK_SIZE, row * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+            Rect area(block.x - h, block.y - h, block.width + 2 * h, block.height + 2 * h);
+            std::vector< int > ids;
+            bool onBlock = false;
+            for (unsigned f = 0; f < frames.size(); f++) {
+                if ((frames[f].footprint & area).area() == 0) continue;
+                ids.push_back(f);
+                if ((frames[f].footprint & block).area() > 0) onBlock = true;
+            }
+            if (!onBlock) continue;
+            blocks.push_back(block);
+            covering.push_back(ids);
+        }
+    }
+
+    int inFlight = std::max(1, getNumThreads());
+    if (budget > 0) {
+        // half the budget for the blocks, the rest is the canvas tiles and the frames
+        inFlight = (int)std::max((size_t)1, std::min((size_t)inFlight, budget / 2 / blockBytes(CV_MAT_CN(frames[0].type))));
+    }
+
+    // neighbouring blocks share most of their frames, a frame stays decoded while the batches need it
+    std::vector< Mat > images(frames.size());
+    for (unsigned first = 0; first < blocks.size(); first += inFlight) {
+        unsigned last = std::min((unsigned)blocks.size(), first + inFlight);
+        std::vector< char > needed(frames.size(), 0);
+        for (unsigned b = first; b < last; b++) {
+            for (unsigned i = 0; i < covering[b].size(); i++) {
+                needed[covering[b][i]] = 1;
+            }
+        }
+        std::vector< int > toDecode;
+        for (unsigned f = 0; f < frames.size(); f++) {
+            if (!needed[f]) {
+                images[f].release();
+            } else if (images[f].empty()) {
+                if (frames[f].compressed.isNull()) {
+                    images[f] = frames[f].image;
+                } else {
+                    toDecode.push_back(f);
+                }
+            }
+        }
+        if (!toDecode.empty()) {
+            parallel_for_(Range(0, toDecode.size()), DecodeFrames(frames, toDecode, images));
+        }
+
+        std::vector< Mat > results(last - first);
+        parallel_for_(Range(0, last - first), BlendBlocks(*this, blocks, covering, images, first, results));
+        for (unsigned b = first; b < last; b++) {
+            canvas.write(results[b - first], blocks[b].tl());
+        }
+    }
+}
+
+void MosaicBlender::blendBlock(const Rect &block, const std::vector<int> &frameIds, const std::vector<Mat> &images,
+                               Mat &result) const {
+    int h = halo();
+    Rect area(block.x - h, block.y - h, block.width + 2 * h, block.height + 2 * h);
+
+    Mat best = Mat::zeros(area.size(), CV_32FC1);
+    Mat owner(area.size(), CV_32SC1, Scalar(-1));
+    for (unsigned i = 0; i < frameIds.size(); i++) {
+        const Frame &frame = frames[frameIds[i]];
+        claimPixels(frame.homography.inv(), frame.size, area, frame.footprint, frameIds[i], best, owner);
+    }
+
+    Matx33d shift(1, 0, -area.x,
+                  0, 1, -area.y,
+                  0, 0, 1);
+    std::vector< Mat > sum, weightSum;
+    std::vector< Mat > band, weights;
+    Mat warped, coverage, mask, maskWeight;
+    for (unsigned i = 0; i < frameIds.size(); i++) {
+        int id = frameIds[i];
+        mask = owner == id;
+        if (countNonZero(mask) == 0) continue;
+        mask.convertTo(maskWeight, CV_32F, 1.0 / 255.0);
+
+        const Mat &image = images[id];
+        warped.create(area.size(), frames[id].type);
+        warped.setTo(Scalar::all(0));
+        WarpComposite::draw(image, Mat(shift * frames[id].homography), warped);
+        // the same warp of a blank frame, exactly the pixels warped got
+        coverage.create(area.size(), CV_8UC1);
+        coverage.setTo(Scalar::all(0));
+        WarpComposite::draw(Mat(frames[id].size, CV_8UC1, Scalar(255)), Mat(shift * frames[id].homography), coverage);
+
+        laplacianPyramid(warped, coverage, bands, band);
+        gaussianPyramid(maskWeight, bands, weights);
+        if (sum.empty()) {
+            sum.resize(bands + 1);
+            weightSum.resize(bands + 1);
+            for (int k = 0; k <= bands; k++) {
+                sum[k] = Mat::zeros(band[k].size(), band[k].type());
+                weightSum[k] = Mat::zeros(band[k].size(), CV_32FC1);
+            }
+        }
+        for (int k = 0; k <= bands; k++) {
+            accumulate(band[k], weights[k], sum[k], weightSum[k]);
+        }
+    }
+    if (sum.empty()) {
+        result = Mat::zeros(block.size(), frames[frameIds[0]].type);
+        return;
+    }
+
+    for (int k = 0; k <= bands; k++) {
+        scaleByWeight(sum[k], weightSum[k], true);
+    }
+    Mat collapsed = sum[bands];
+    for (int k = bands - 1; k >= 0; k--) {
+        Mat up;
+        pyrUp(collapsed, up, sum[k].size());
+        collapsed = up + sum[k];
+    }
+    Rect inner(h, h, block.width, block.height);
+    collapsed(inner).convertTo(result, CV_8U);
+    // what no frame covers stays black, the blend bleeds a little past the frame edges
+    result.setTo(Scalar::all(0), best(inner) == 0);
+}
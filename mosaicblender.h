@@ -0,0 +1,63 @@
+#ifndef MOSAICBLENDER_H
+#define MOSAICBLENDER_H
+
+#include <QSharedPointer>
+#include <QString>
+
+#include <opencv2/opencv.hpp>
+
+#include "mosaiccanvas.h"
+
+// Laplacian multi-band blending of the frames of a mosaic, a block at a time. Every canvas
+// pixel goes to the frame it is furthest inside of, and the frames are blended across
+// those seams band by band: fine detail over a few pixels, the overall brightness over a
+// few hundred. Each block is blended on its own with a halo around it wide enough for
+// the coarsest band, so the result is the same as blending the whole canvas at once
+// while only the buffers of the blocks in flight are ever in memory. Blocks are blended
+// in parallel. The frames wait compressed (see MappedTile), with a memory budget fewer
+// blocks are blended at once.
+class MosaicBlender
+{
+public:
+    enum { BLOCK_SIZE = 2 * MosaicCanvas::TILE_SIZE };
+
+    MosaicBlender();
+    void clear();
+    int size() const;
+    // 1 to 7, more bands spread the low frequencies over wider seams and need a wider halo
+    void setNumBands(int bands);
+    int numBands() const;
+    // Frames are compressed into directory (the temp dir if empty). 0 blends a block per thread,
+    // otherwise no more blocks are blended at once than fit in bytes.
+    void setMemoryBudget(size_t bytes, const QString &directory = QString());
+
+    // a frame as it was drawn on the canvas, homography is frame -> canvas coordinates
+    void add(const cv::Mat &image, const cv::Mat &homography);
+    // Blends every frame added so far and writes the result over the canvas
+    void blend(MosaicCanvas &canvas) const;
+
+private:
+    struct Frame {
+        cv::Mat image;                          // only if it couldn't be compressed
+        QSharedPointer<MappedTile> compressed;
+        cv::Size size;
+        int type;
+        cv::Matx33d homography;
+        cv::Rect footprint;                     // canvas pixels it covers
+    };
+    class BlendBlocks;
+    friend class BlendBlocks;
+    class DecodeFrames;
+
+    int halo() const;
+    size_t blockBytes(int channels) const;
+    void blendBlock(const cv::Rect &block, const std::vector<int> &frameIds, const std::vector<cv::Mat> &images,
+                    cv::Mat &result) const;
+
+    std::vector<Frame> frames;
+    int bands;
+    size_t budget;
+    QString spillDirectory;
+};
+
+#endif // MOSAICBLENDER_H
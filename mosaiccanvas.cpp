@@ -0,0 +1,214 @@
+#include "mosaiccanvas.h"
+#include "warpcomposite.h"
+
+using namespace cv;
+
+namespace {
+
+// Each tile gets its own warp, they are independent so they run in parallel
+class WarpTiles : public ParallelLoopBody {
+public:
+    WarpTiles(const Mat &image, const Mat &homography, std::vector<Mat> &tiles, const std::vector<Point> &origins)
+        : image(image), homography(homography), tiles(tiles), origins(origins) {}
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; i++) {
+            Mat toTile = Mat::eye(3, 3, CV_64FC1);
+            toTile.at<double>(0,2) = -origins[i].x;
+            toTile.at<double>(1,2) = -origins[i].y;
+            // only the part of the tile under the image is visited, the rest keeps what it had
+            WarpComposite::draw(image, toTile * homography, tiles[i]);
+        }
+    }
+
+private:
+    const Mat &image;
+    const Mat &homography;
+    std::vector<Mat> &tiles;
+    const std::vector<Point> &origins;
+};
+
+// Copies the part of tile (at tileRect on the canvas) inside region into result, the region
+// shrunk by scale when it is below 1
+void copyPiece(const Mat &tile, const Rect &tileRect, const Rect &region, double scale, Mat &result) {
+    Rect overlap = tileRect & region;
+    if (scale >= 1.0) {
+        tile(overlap - tileRect.tl()).copyTo(result(overlap - region.tl()));
+        return;
+    }
+    // where the piece lands in the result, rounded the same way for neighbouring tiles so they meet
+    int x0 = cvRound((overlap.x - region.x) * scale);
+    int y0 = cvRound((overlap.y - region.y) * scale);
+    int x1 = std::min(result.cols, cvRound((overlap.x + overlap.width - region.x) * scale));
+    int y1 = std::min(result.rows, cvRound((overlap.y + overlap.height - region.y) * scale));
+    if (x1 <= x0 || y1 <= y0) return;
+    resize(tile(overlap - tileRect.tl()), result(Rect(x0, y0, x1 - x0, y1 - y0)), Size(x1 - x0, y1 - y0), 0, 0, INTER_AREA);
+}
+
+Size scaledSize(const Rect &region, double scale) {
+    if (scale >= 1.0) return region.size();
+    return Size(std::max(1, cvRound(region.width * scale)), std::max(1, cvRound(region.height * scale)));
+}
+
+}
+
+MosaicSnapshot::MosaicSnapshot() : region(0, 0, 0, 0), type(CV_8UC3)
+{
+}
+
+bool MosaicSnapshot::empty() const {
+    return region.area() == 0;
+}
+
+Rect MosaicSnapshot::bounds() const {
+    return region;
+}
+
+Mat MosaicSnapshot::render(double scale) const {
+    Mat result = Mat::zeros(scaledSize(region, scale), type);
+    for (unsigned i = 0; i < tiles.size(); i++) {
+        // compressed tiles are decoded one at a time, only the result is ever whole
+        Mat pixels = tiles[i].pixels.empty() ? tiles[i].compressed->decode() : tiles[i].pixels;
+        if (pixels.empty()) continue;
+        copyPiece(pixels, tiles[i].rect, region, scale, result);
+    }
+    return result;
+}
+
+MosaicCanvas::MosaicCanvas(int type) : tiles(type, TILE_SIZE), contentBounds(0, 0, 0, 0), type(type)
+{
+}
+
+void MosaicCanvas::clear() {
+    tiles.clear();
+    contentBounds = Rect(0, 0, 0, 0);
+}
+
+bool MosaicCanvas::empty() const {
+    return tiles.numTiles() == 0;
+}
+
+int MosaicCanvas::numTiles() const {
+    return tiles.numTiles();
+}
+
+int MosaicCanvas::numResidentTiles() const {
+    return tiles.numResident();
+}
+
+void MosaicCanvas::setMemoryBudget(size_t bytes, const QString &directory) {
+    tiles.setMemoryBudget(bytes, directory);
+}
+
+size_t MosaicCanvas::memoryBudget() const {
+    return tiles.memoryBudget();
+}
+
+Rect MosaicCanvas::bounds() const {
+    return contentBounds;
+}
+
+int MosaicCanvas::tileIndexOf(int coordinate) {
+    // rounds towards -infinity so negative coordinates land in negative tiles
+    return coordinate >= 0 ? coordinate / TILE_SIZE : -((-coordinate + TILE_SIZE - 1) / TILE_SIZE);
+}
+
+Rect MosaicCanvas::draw(const Mat &image, const Mat &homography) {
+    if (image.empty()) return Rect();
+
+    std::vector< Point2f > corners(4);
+    corners[0] = Point2f(0, 0);
+    corners[1] = Point2f(image.cols, 0);
+    corners[2] = Point2f(image.cols, image.rows);
+    corners[3] = Point2f(0, image.rows);
+    perspectiveTransform(corners, corners, homography);
+    Rect footprint = WarpComposite::footprint(image.size(), homography);
+    if (footprint.area() == 0) return Rect();
+
+    std::vector< Mat > covered;
+    std::vector< Point > origins;
+    for (int row = tileIndexOf(footprint.y); row <= tileIndexOf(footprint.y + footprint.height - 1); row++) {
+        for (int col = tileIndexOf(footprint.x); col <= tileIndexOf(footprint.x + footprint.width - 1); col++) {
+            Point origin(col * TILE_SIZE, row * TILE_SIZE);
+            // the footprint can be rotated, skip the tiles only its bounding box reaches
+            std::vector< Point2f > tileCorners(4);
+            tileCorners[0] = Point2f(origin.x, origin.y);
+            tileCorners[1] = Point2f(origin.x + TILE_SIZE, origin.y);
+            tileCorners[2] = Point2f(origin.x + TILE_SIZE, origin.y + TILE_SIZE);
+            tileCorners[3] = Point2f(origin.x, origin.y + TILE_SIZE);
+            std::vector< Point2f > intersection;
+            if (intersectConvexConvex(corners, tileCorners, intersection) <= 0) continue;
+
+            covered.push_back(tiles.acquire(TileIndex(col, row), TileStore::WRITE));
+            origins.push_back(origin);
+        }
+    }
+    parallel_for_(Range(0, covered.size()), WarpTiles(image, homography, covered, origins));
+    covered.clear();
+    tiles.trim();
+
+    contentBounds = contentBounds.area() == 0 ? footprint : (contentBounds | footprint);
+    return footprint;
+}
+
+void MosaicCanvas::write(const Mat &pixels, Point origin) {
+    CV_Assert(pixels.type() == type);
+    Rect region(origin, pixels.size());
+    if (region.area() == 0) return;
+
+    for (int row = tileIndexOf(region.y); row <= tileIndexOf(region.y + region.height - 1); row++) {
+        for (int col = tileIndexOf(region.x); col <= tileIndexOf(region.x + region.width - 1); col++) {
+            if (!tiles.contains(TileIndex(col, row))) continue;
+            Mat tile = tiles.acquire(TileIndex(col, row), TileStore::WRITE);
+            Rect tileRect(col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+            Rect overlap = tileRect & region;
+            pixels(overlap - region.tl()).copyTo(tile(overlap - tileRect.tl()));
+        }
+        tiles.trim();
+    }
+}
+
+Mat MosaicCanvas::render(const Rect &region) {
+    return renderScaled(region, 1.0);
+}
+
+Mat MosaicCanvas::render() {
+    return render(contentBounds);
+}
+
+Mat MosaicCanvas::renderScaled(const Rect &region, double scale) {
+    Mat result = Mat::zeros(scaledSize(region, scale), type);
+    if (region.area() == 0) return result;
+
+    for (int row = tileIndexOf(region.y); row <= tileIndexOf(region.y + region.height - 1); row++) {
+        for (int col = tileIndexOf(region.x); col <= tileIndexOf(region.x + region.width - 1); col++) {
+            Mat tile = tiles.acquire(TileIndex(col, row), TileStore::READ);
+            if (tile.empty()) continue;
+            copyPiece(tile, Rect(col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE), region, scale, result);
+        }
+        tiles.trim();   // a row at a time keeps a tall render from pulling everything in
+    }
+    return result;
+}
+
+MosaicSnapshot MosaicCanvas::snapshot(const Rect &region) const {
+    MosaicSnapshot snapshot;
+    snapshot.region = region;
+    snapshot.type = type;
+    if (region.area() == 0) return snapshot;
+
+    for (int row = tileIndexOf(region.y); row <= tileIndexOf(region.y + region.height - 1); row++) {
+        for (int col = tileIndexOf(region.x); col <= tileIndexOf(region.x + region.width - 1); col++) {
+            MosaicSnapshot::Tile tile;
+            if (!tiles.share(TileIndex(col, row), tile.pixels, tile.compressed)) continue;
+            if (tile.pixels.empty() && tile.compressed.isNull()) continue;
+            tile.rect = Rect(col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+            snapshot.tiles.push_back(tile);
+        }
+    }
+    return snapshot;
+}
+
+MosaicSnapshot MosaicCanvas::snapshot() const {
+    return snapshot(contentBounds);
+}
@@ -0,0 +1,392 @@
+#include "mosaicexporter.h"
+
+#include <QDir>
+#include <QString>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <zlib.h>
+
+using namespace cv;
+
+namespace {
+
+const int COG_TILE_SIZE = 512;
+const int XYZ_TILE_SIZE = 256;
+// past this much raw pixel data the offsets might not fit 32 bits, write a BigTIFF instead
+const double BIGTIFF_THRESHOLD = 4.0e9;
+
+// TIFF field types
+enum { TIFF_ASCII = 2, TIFF_SHORT = 3, TIFF_LONG = 4, TIFF_DOUBLE = 12, TIFF_LONG8 = 16 };
+
+// little endian, whatever the host is
+void put(std::vector<uchar> &out, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out.push_back((uchar)(value >> (8 * i)));
+    }
+}
+
+void putDouble(std::vector<uchar> &out, double value) {
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put(out, bits, 8);
+}
+
+struct IfdEntry {
+    IfdEntry(int tag, int type, unsigned long long count) : tag(tag), type(type), count(count) {}
+    int tag;
+    int type;
+    unsigned long long count;
+    std::vector<uchar> data;
+};
+
+// One image directory, knows its size before the tile offsets are filled in so the
+// directories can be laid out first and written last
+class Ifd {
+public:
+    explicit Ifd(bool bigTiff) : bigTiff(bigTiff) {}
+
+    IfdEntry& add(int tag, int type, unsigned long long count) {
+        entries.push_back(IfdEntry(tag, type, count));
+        return entries.back();
+    }
+    void addShort(int tag, unsigned value) { put(add(tag, TIFF_SHORT, 1).data, value, 2); }
+    void addLong(int tag, unsigned value) { put(add(tag, TIFF_LONG, 1).data, value, 4); }
+    // replaces the value of an entry added earlier, same size
+    void set(int tag, const std::vector<uchar> &data) {
+        for (unsigned i = 0; i < entries.size(); i++) {
+            if (entries[i].tag == tag) entries[i].data = data;
+        }
+    }
+
+    size_t size() const {
+        size_t total = entryCountBytes() + entries.size() * entryBytes() + countBytes();
+        for (unsigned i = 0; i < entries.size(); i++) {
+            if (entries[i].data.size() > inlineBytes()) total += padded(entries[i].data.size());
+        }
+        return total;
+    }
+
+    // entries must have been added in tag order, the spec wants them sorted
+    void write(std::vector<uchar> &out, unsigned long long offset, unsigned long long next) const {
+        unsigned long long external = offset + entryCountBytes() + entries.size() * entryBytes() + countBytes();
+        std::vector<uchar> externalData;
+        put(out, entries.size(), entryCountBytes());
+        for (unsigned i = 0; i < entries.size(); i++) {
+            const IfdEntry &entry = entries[i];
+            put(out, entry.tag, 2);
+            put(out, entry.type, 2);
+            put(out, entry.count, countBytes());
+            if (entry.data.size() <= inlineBytes()) {
+                out.insert(out.end(), entry.data.begin(), entry.data.end());
+                put(out, 0, inlineBytes() - entry.data.size());
+            } else {
+                put(out, external + externalData.size(), inlineBytes());
+                externalData.insert(externalData.end(), entry.data.begin(), entry.data.end());
+                externalData.resize(padded(externalData.size()));   // values start on a word boundary
+            }
+        }
+        put(out, next, countBytes());
+        out.insert(out.end(), externalData.begin(), externalData.end());
+    }
+
+private:
+    size_t entryCountBytes() const { return bigTiff ? 8 : 2; }   // the number of entries at the top
+    size_t countBytes() const { return bigTiff ? 8 : 4; }  // an entry's value count, also the size of the next directory offset
+    size_t entryBytes() const { return bigTiff ? 20 : 12; }
+    size_t inlineBytes() const { return bigTiff ? 8 : 4; }
+    static size_t padded(size_t bytes) { return (bytes + 1) & ~(size_t)1; }
+
+    bool bigTiff;
+    std::vector<IfdEntry> entries;
+};
+
+// Deflates a strip's worth of COG tiles, each is independent so they run in parallel
+class CompressCogTiles : public ParallelLoopBody {
+public:
+    CompressCogTiles(const Mat &strip, std::vector< std::vector<uchar> > &results)
+        : strip(strip), results(results) {}
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; i++) {
+            Mat tile;
+            cvtColor(strip(Rect(i * COG_TILE_SIZE, 0, COG_TILE_SIZE, COG_TILE_SIZE)), tile, CV_BGR2RGB);
+            // horizontal differencing (predictor 2), deflate does a lot better on smooth imagery with it
+            for (int row = 0; row < tile.rows; row++) {
+                uchar* p = tile.ptr<uchar>(row);
+                for (int x = tile.cols * 3 - 1; x >= 3; x--) {
+                    p[x] -= p[x - 3];
+                }
+            }
+            uLongf length = compressBound(tile.total() * tile.elemSize());
+            results[i].resize(length);
+            if (compress2(&results[i][0], &length, tile.data, tile.total() * tile.elemSize(), 6) != Z_OK) {
+                results[i].clear();
+                continue;
+            }
+            results[i].resize(length);
+        }
+    }
+
+private:
+    const Mat &strip;
+    std::vector< std::vector<uchar> > &results;
+};
+
+// Writes a strip's worth of XYZ tiles, each is independent so they run in parallel
+class WriteXyzTiles : public ParallelLoopBody {
+public:
+    WriteXyzTiles(const Mat &strip, const std::string &directory, int zoom, int y, const std::string &extension,
+                  std::vector<uchar> &failed)
+        : strip(strip), directory(directory), zoom(zoom), y(y), extension(extension), failed(failed) {}
+
+    void operator()(const Range &range) const {
+        for (int x = range.start; x < range.end; x++) {
+            Mat tile = strip(Rect(x * XYZ_TILE_SIZE, 0, XYZ_TILE_SIZE, XYZ_TILE_SIZE));
+            // covered is any pixel that isn't black, a dark one can still be 0 in gray
+            std::vector< Mat > channels;
+            split(tile, channels);
+            Mat covered = (channels[0] | channels[1] | channels[2]) > 0;
+            if (countNonZero(covered) == 0) continue;   // nothing drawn here, leave it out
+
+            Mat output = tile;
+            if (extension == "png") {
+                // outside the mosaic is transparent rather than black
+                channels.push_back(covered);
+                merge(channels, output);
+            }
+            QString path = QString("%1/%2/%3/%4.%5").arg(QString::fromStdString(directory)).arg(zoom).arg(x).arg(y)
+                           .arg(QString::fromStdString(extension));
+            if (!imwrite(path.toStdString(), output)) {
+                failed[x] = 1;
+            }
+        }
+    }
+
+private:
+    const Mat &strip;
+    const std::string &directory;
+    int zoom;
+    int y;
+    const std::string &extension;
+    std::vector<uchar> &failed;     // one per column, each written by its own column only
+};
+
+// number of rows and columns of tiles covering size
+Size tileGrid(Size size, int tileSize) {
+    return Size((size.width + tileSize - 1) / tileSize, (size.height + tileSize - 1) / tileSize);
+}
+
+// Rows [y0, y1) of bounds shrunk by 2^level, padded with black to the full width
+// of the tile grid and the strip's height
+Mat renderStrip(MosaicCanvas &canvas, const Rect &bounds, int level, int y0, int y1, int tileSize) {
+    Size levelSize((bounds.width + (1 << level) - 1) >> level, (bounds.height + (1 << level) - 1) >> level);
+    Mat strip = Mat::zeros(y1 - y0, tileGrid(levelSize, tileSize).width * tileSize, CV_8UC3);
+
+    int top = y0 << level;
+    int bottom = std::min(std::min(y1, levelSize.height) << level, bounds.height);
+    if (bottom <= top) return strip;
+    Mat rendered = canvas.renderScaled(Rect(bounds.x, bounds.y + top, bounds.width, bottom - top), 1.0 / (1 << level));
+    if (rendered.type() != CV_8UC3) {
+        std::cout << "Can only export 8 bit colour mosaics" << std::endl;
+        return Mat();
+    }
+    Rect overlap = Rect(0, 0, rendered.cols, rendered.rows) & Rect(0, 0, strip.cols, strip.rows);
+    rendered(overlap).copyTo(strip(overlap));
+    return strip;
+}
+
+}
+
+MosaicExporter::MosaicExporter()
+{
+}
+
+bool MosaicExporter::writeCog(MosaicCanvas &canvas, const std::string &path, const Mat &geoTransform) {
+    Rect bounds = canvas.bounds();
+    if (bounds.area() == 0) {
+        std::cout << "Nothing to export" << std::endl;
+        return false;
+    }
+
+    // overviews halve until everything fits in one tile
+    std::vector< Size > levels;
+    levels.push_back(bounds.size());
+    while (levels.back().width > COG_TILE_SIZE || levels.back().height > COG_TILE_SIZE) {
+        int level = levels.size();
+        levels.push_back(Size((bounds.width + (1 << level) - 1) >> level, (bounds.height + (1 << level) - 1) >> level));
+    }
+    double rawBytes = 0;
+    for (unsigned level = 0; level < levels.size(); level++) {
+        rawBytes += (double)tileGrid(levels[level], COG_TILE_SIZE).area() * COG_TILE_SIZE * COG_TILE_SIZE * 3;
+    }
+    bool bigTiff = rawBytes > BIGTIFF_THRESHOLD;
+    int offsetType = bigTiff ? TIFF_LONG8 : TIFF_LONG;
+    int offsetBytes = bigTiff ? 8 : 4;
+
+    // lay out the directories with the tile offsets still unknown, only their count matters for the size
+    std::vector< Ifd > ifds;
+    size_t headerSize = bigTiff ? 16 : 8;
+    for (unsigned level = 0; level < levels.size(); level++) {
+        unsigned numTiles = tileGrid(levels[level], COG_TILE_SIZE).area();
+        ifds.push_back(Ifd(bigTiff));
+        Ifd &ifd = ifds.back();
+        ifd.addLong(254, level == 0 ? 0 : 1);           // NewSubfileType: overviews are reduced resolution
+        ifd.addLong(256, levels[level].width);          // ImageWidth
+        ifd.addLong(257, levels[level].height);         // ImageLength
+        IfdEntry &bits = ifd.add(258, TIFF_SHORT, 3);   // BitsPerSample
+        for (int i = 0; i < 3; i++) put(bits.data, 8, 2);
+        ifd.addShort(259, 8);                           // Compression: deflate
+        ifd.addShort(262, 2);                           // PhotometricInterpretation: RGB
+        ifd.addShort(277, 3);                           // SamplesPerPixel
+        ifd.addShort(284, 1);                           // PlanarConfiguration: contiguous
+        ifd.addShort(317, 2);                           // Predictor: horizontal differencing
+        ifd.addShort(322, COG_TILE_SIZE);               // TileWidth
+        ifd.addShort(323, COG_TILE_SIZE);               // TileLength
+        ifd.add(324, offsetType, numTiles).data.resize(numTiles * offsetBytes);    // TileOffsets
+        ifd.add(325, offsetType, numTiles).data.resize(numTiles * offsetBytes);    // TileByteCounts
+        if (level == 0 && !geoTransform.empty()) {
+            // ModelTransformationTag, raster (column, row) to (longitude, latitude)
+            const double* g = geoTransform.ptr<double>(0);
+            const double* h = geoTransform.ptr<double>(1);
+            double model[16] = { g[0], g[1], 0, g[2],
+                                 h[0], h[1], 0, h[2],
+                                 0,    0,    0, 0,
+                                 0,    0,    0, 1 };
+            IfdEntry &transform = ifd.add(34264, TIFF_DOUBLE, 16);
+            for (int i = 0; i < 16; i++) putDouble(transform.data, model[i]);
+            // GeoKeyDirectoryTag: geographic, pixel is area, WGS84
+            unsigned short keys[16] = { 1, 1, 0, 3,
+                                        1024, 0, 1, 2,
+                                        1025, 0, 1, 1,
+                                        2048, 0, 1, 4326 };
+            IfdEntry &geoKeys = ifd.add(34735, TIFF_SHORT, 16);
+            for (int i = 0; i < 16; i++) put(geoKeys.data, keys[i], 2);
+        }
+        if (level == 0) {
+            IfdEntry &noData = ifd.add(42113, TIFF_ASCII, 2);   // GDAL_NODATA: black is outside the mosaic
+            noData.data.push_back('0');
+            noData.data.push_back(0);
+        }
+        headerSize += ifd.size();
+    }
+
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cout << "Could not open " << path << " for writing" << std::endl;
+        return false;
+    }
+    std::vector< char > placeholder(headerSize, 0);
+    file.write(&placeholder[0], placeholder.size());
+
+    // tile data, smallest overview first so a reader gets a preview from the first few requests
+    unsigned long long position = headerSize;
+    for (int level = levels.size() - 1; level >= 0; level--) {
+        Size grid = tileGrid(levels[level], COG_TILE_SIZE);
+        std::vector< unsigned long long > offsets(grid.area());
+        std::vector< unsigned long long > byteCounts(grid.area());
+        for (int row = 0; row < grid.height; row++) {
+            Mat strip = renderStrip(canvas, bounds, level, row * COG_TILE_SIZE, (row + 1) * COG_TILE_SIZE, COG_TILE_SIZE);
+            if (strip.empty()) return false;
+            std::vector< std::vector<uchar> > compressed(grid.width);
+            parallel_for_(Range(0, grid.width), CompressCogTiles(strip, compressed));
+            for (int col = 0; col < grid.width; col++) {
+                if (compressed[col].empty()) {
+                    std::cout << "Could not compress tile " << col << "," << row << " of " << path << std::endl;
+                    return false;
+                }
+                offsets[row * grid.width + col] = position;
+                byteCounts[row * grid.width + col] = compressed[col].size();
+                file.write((const char*) &compressed[col][0], compressed[col].size());
+                position += compressed[col].size();
+            }
+        }
+
+        std::vector< uchar > offsetData, byteCountData;
+        for (int i = 0; i < grid.area(); i++) {
+            put(offsetData, offsets[i], offsetBytes);
+            put(byteCountData, byteCounts[i], offsetBytes);
+        }
+        ifds[level].set(324, offsetData);
+        ifds[level].set(325, byteCountData);
+    }
+
+    std::vector< uchar > header;
+    put(header, 'I', 1);
+    put(header, 'I', 1);
+    if (bigTiff) {
+        put(header, 43, 2);
+        put(header, 8, 2);      // offset size
+        put(header, 0, 2);
+        put(header, 16, 8);     // first directory straight after the header
+    } else {
+        put(header, 42, 2);
+        put(header, 8, 4);
+    }
+    for (unsigned level = 0; level < ifds.size(); level++) {
+        unsigned long long offset = header.size();
+        unsigned long long next = level + 1 < ifds.size() ? offset + ifds[level].size() : 0;
+        ifds[level].write(header, offset, next);
+    }
+    file.seekp(0);
+    file.write((const char*) &header[0], header.size());
+    file.close();
+    if (!file) {
+        std::cout << "Could not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool MosaicExporter::writeTiles(MosaicCanvas &canvas, const std::string &directory, const std::string &extension) {
+    Rect bounds = canvas.bounds();
+    if (bounds.area() == 0) {
+        std::cout << "Nothing to export" << std::endl;
+        return false;
+    }
+
+    // the highest zoom is the full resolution mosaic, each one below halves it down to a single tile
+    int maxZoom = 0;
+    while ((XYZ_TILE_SIZE << maxZoom) < std::max(bounds.width, bounds.height)) {
+        maxZoom++;
+    }
+    for (int zoom = maxZoom; zoom >= 0; zoom--) {
+        int level = maxZoom - zoom;
+        Size grid = tileGrid(Size((bounds.width + (1 << level) - 1) >> level, (bounds.height + (1 << level) - 1) >> level), XYZ_TILE_SIZE);
+        for (int x = 0; x < grid.width; x++) {
+            if (!QDir().mkpath(QString("%1/%2/%3").arg(QString::fromStdString(directory)).arg(zoom).arg(x))) {
+                std::cout << "Could not create " << directory << "/" << zoom << "/" << x << std::endl;
+                return false;
+            }
+        }
+        for (int y = 0; y < grid.height; y++) {
+            Mat strip = renderStrip(canvas, bounds, level, y * XYZ_TILE_SIZE, (y + 1) * XYZ_TILE_SIZE, XYZ_TILE_SIZE);
+            if (strip.empty()) return false;
+            std::vector<uchar> failed(grid.width, 0);
+            parallel_for_(Range(0, grid.width), WriteXyzTiles(strip, directory, zoom, y, extension, failed));
+            if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+                std::cout << "Could not write tiles to " << directory << "/" << zoom << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Mat MosaicExporter::fitGeoTransform(const std::vector<Point2f> &pixels, const std::vector<Point2d> &lonLat) {
+    if (pixels.size() < 3 || pixels.size() != lonLat.size()) return Mat();
+    Mat A(pixels.size(), 3, CV_64FC1);
+    Mat b(pixels.size(), 2, CV_64FC1);
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        A.at<double>(i, 0) = pixels[i].x;
+        A.at<double>(i, 1) = pixels[i].y;
+        A.at<double>(i, 2) = 1.0;
+        b.at<double>(i, 0) = lonLat[i].x;
+        b.at<double>(i, 1) = lonLat[i].y;
+    }
+    Mat x;
+    if (!solve(A, b, x, DECOMP_SVD)) return Mat();
+    return x.t();
+}
@@ -0,0 +1,100 @@
+#include "mosaicfeaturemap.h"
+#include "sharedfunctions.h"
+
+#include <limits>
+
+using namespace cv;
+
+MosaicFeatureMap::MosaicFeatureMap() : matchRatio(0), keypointCount(0)
+{
+}
+
+void MosaicFeatureMap::clear() {
+    blocks.clear();
+    keypointCount = 0;
+}
+
+bool MosaicFeatureMap::empty() const {
+    return blocks.empty();
+}
+
+int MosaicFeatureMap::numImages() const {
+    return blocks.size();
+}
+
+int MosaicFeatureMap::numKeypoints() const {
+    return keypointCount;
+}
+
+void MosaicFeatureMap::setMatcherPrototype(Ptr<DescriptorMatcher> matcherPrototype) {
+    prototype = matcherPrototype;
+}
+
+void MosaicFeatureMap::setMatchRatio(double ratio) {
+    matchRatio = ratio;
+}
+
+void MosaicFeatureMap::addImage(const std::vector<KeyPoint>& keypoints, const Mat& descriptors,
+                                const Mat& homography, Size imageSize) {
+    if (keypoints.empty() || descriptors.empty() || prototype.empty()) return;
+
+    std::vector< Point2f > points(keypoints.size());
+    for (unsigned i = 0; i < keypoints.size(); i++) {
+        points[i] = keypoints[i].pt;
+    }
+    perspectiveTransform(points, points, homography);
+
+    std::vector< Point2f > corners(4);
+    corners[0] = Point2f(0, 0);
+    corners[1] = Point2f(imageSize.width, 0);
+    corners[2] = Point2f(imageSize.width, imageSize.height);
+    corners[3] = Point2f(0, imageSize.height);
+    perspectiveTransform(corners, corners, homography);
+
+    Block block;
+    block.bounds = boundingRect(corners);
+    block.keypoints = keypoints;
+    for (unsigned i = 0; i < keypoints.size(); i++) {
+        block.keypoints[i].pt = points[i];
+    }
+    // only this block's index gets built, the rest of the map is untouched
+    block.matcher = prototype->clone(true);
+    block.matcher->add(std::vector< Mat >(1, descriptors));
+    block.matcher->train();
+
+    blocks.push_back(block);
+    keypointCount += keypoints.size();
+}
+
+void MosaicFeatureMap::match(const Mat& queryDescriptors, const Rect& region,
+                             std::vector<KeyPoint>& regionKeypoints, std::vector<DMatch>& matches) {
+    regionKeypoints.clear();
+    matches.clear();
+    if (queryDescriptors.empty()) return;
+
+    // best match over all blocks for every query descriptor
+    std::vector< DMatch > best(queryDescriptors.rows, DMatch(-1, -1, std::numeric_limits<float>::max()));
+
+    for (unsigned b = 0; b < blocks.size(); b++) {
+        Block& block = blocks[b];
+        if ((block.bounds & region).area() == 0) continue;
+
+        int firstIndex = regionKeypoints.size();
+        regionKeypoints.insert(regionKeypoints.end(), block.keypoints.begin(), block.keypoints.end());
+
+        std::vector< DMatch > blockMatches;
+        SharedFunctions::matchWithRatio(block.matcher, queryDescriptors, Mat(), matchRatio, blockMatches);
+        for (unsigned i = 0; i < blockMatches.size(); i++) {
+            const DMatch& m = blockMatches[i];
+            if (m.distance < best[m.queryIdx].distance) {
+                best[m.queryIdx] = DMatch(m.queryIdx, firstIndex + m.trainIdx, m.distance);
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < best.size(); i++) {
+        if (best[i].trainIdx >= 0) {
+            matches.push_back(best[i]);
+        }
+    }
+}
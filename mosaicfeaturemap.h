@@ -0,0 +1,49 @@
+#ifndef MOSAICFEATUREMAP_H
+#define MOSAICFEATUREMAP_H
+
+#include <opencv2/opencv.hpp>
+
+// Keeps the keypoints and descriptors of every image that has been placed in the
+// mosaic so that the mosaic itself never has to be run through the detector again.
+// Each image is stored as its own block with its own trained matcher, adding an
+// image only builds the index for that image and leaves the older ones alone.
+// Keypoints are stored in mosaic coordinates, the mosaic (canvas) origin never moves.
+class MosaicFeatureMap
+{
+public:
+    MosaicFeatureMap();
+    void clear();
+    bool empty() const;
+    int numImages() const;
+    int numKeypoints() const;
+
+    // the matcher is cloned (without train data) for every image added to the map
+    void setMatcherPrototype(cv::Ptr<cv::DescriptorMatcher> prototype);
+    // ratio test applied within each image (see SharedFunctions::matchWithRatio), not across them:
+    // overlapping images hold the same scene points so the second best is often the same point again
+    void setMatchRatio(double ratio);
+
+    // homography maps the image keypoints into current mosaic coordinates
+    void addImage(const std::vector<cv::KeyPoint>& keypoints, const cv::Mat& descriptors,
+                  const cv::Mat& homography, cv::Size imageSize);
+
+    // Matches the query descriptors against every image in the map that overlaps
+    // region (mosaic coordinates). regionKeypoints receives the keypoints of those
+    // images in mosaic coordinates and the trainIdx of each match indexes into it.
+    void match(const cv::Mat& queryDescriptors, const cv::Rect& region,
+               std::vector<cv::KeyPoint>& regionKeypoints, std::vector<cv::DMatch>& matches);
+
+private:
+    struct Block {
+        cv::Rect bounds;                        // mosaic coordinates
+        std::vector<cv::KeyPoint> keypoints;    // mosaic coordinates
+        cv::Ptr<cv::DescriptorMatcher> matcher; // trained on this block's descriptors only
+    };
+
+    std::vector<Block> blocks;
+    cv::Ptr<cv::DescriptorMatcher> prototype;
+    double matchRatio;
+    int keypointCount;
+};
+
+#endif // MOSAICFEATUREMAP_H
@@ -1,14 +1,21 @@
 #include "objectrecognizer.h"
 #include "sharedfunctions.h"
+#include "imageloader.h"
 
 #include <opencv2/core/core.hpp>
 
 using namespace cv;
 
-ObjectRecognizer::ObjectRecognizer()
+ObjectRecognizer::ObjectRecognizer() : loadedScale(0.0)
 {
 }
 
+void ObjectRecognizer::loadInputImage(const std::string &path) {
+    inputImagePath = path;
+    fullSizeInputImage.release();
+    inputImage.release();
+}
+
 /*
   TODO:
   - Input Image is not displayed properly in GUI. Currently same as Hough Image.. Can remove
@@ -16,9 +23,16 @@ ObjectRecognizer::ObjectRecognizer()
 
 RecognizerResults *ObjectRecognizer::recognizeObjects() {
     RecognizerResults *results = new RecognizerResults();
-    if (fullSizeInputImage.empty()) return results; // otherwise it will crash.
-
-    cv::resize(fullSizeInputImage, inputImage, Size(), imageScale, imageScale, INTER_AREA);
+    if (!inputImagePath.empty()) {
+        if (inputImage.empty() || loadedScale != imageScale) {
+            inputImage = ImageLoader::loadScaled(inputImagePath, imageScale);
+            loadedScale = imageScale;
+        }
+        if (inputImage.empty()) return results;
+    } else {
+        if (fullSizeInputImage.empty()) return results; // otherwise it will crash.
+        cv::resize(fullSizeInputImage, inputImage, Size(), imageScale, imageScale, INTER_AREA);
+    }
 
     inputImage.copyTo(results->input);
 
@@ -28,6 +28,13 @@ public:
     double imageScale;
     double polyDPError;
 
+    // Use an image file as the input. It is decoded directly at imageScale (and
+    // only again when imageScale changes) instead of scaling fullSizeInputImage.
+    void loadInputImage(const std::string &path);
+
+private:
+    std::string inputImagePath;
+    double loadedScale;
 };
 
 #endif // OBJECTRECOGNIZER_H
@@ -1,9 +1,105 @@
 #include "sharedfunctions.h"
+#include "warpcomposite.h"
 
 #include <QImage>
 
+#include <algorithm>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHAREDFUNCTIONS_AVX2 1
+#include <immintrin.h>
+#endif
+
 using namespace cv;
 
+namespace {
+
+const int STRIPES = 32;     // findBoundingBox work items, the rows are split this many ways
+
+// ORs bytes of row into columns, true if any of them is set
+bool orRowScalar(const uchar* row, uchar* columns, int bytes) {
+    uint64 any = 0;
+    int i = 0;
+    for (; i + 8 <= bytes; i += 8) {
+        uint64 word, column;
+        memcpy(&word, row + i, 8);
+        memcpy(&column, columns + i, 8);
+        column |= word;
+        memcpy(columns + i, &column, 8);
+        any |= word;
+    }
+    for (; i < bytes; i++) {
+        columns[i] |= row[i];
+        any |= row[i];
+    }
+    return any != 0;
+}
+
+#ifdef SHAREDFUNCTIONS_AVX2
+__attribute__((target("avx2")))
+bool orRowAvx2(const uchar* row, uchar* columns, int bytes) {
+    __m256i any = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        __m256i word = _mm256_loadu_si256((const __m256i*)(row + i));
+        __m256i* column = (__m256i*)(columns + i);
+        _mm256_storeu_si256(column, _mm256_or_si256(_mm256_loadu_si256(column), word));
+        any = _mm256_or_si256(any, word);
+    }
+    bool tail = orRowScalar(row + i, columns + i, bytes - i);
+    return tail || !_mm256_testz_si256(any, any);
+}
+#endif
+
+// Every stripe of rows finds its own extent: the rows with anything set, and the columns
+// from all of its rows ORed together
+class NonZeroStripes : public ParallelLoopBody {
+public:
+    NonZeroStripes(const Mat &image, int stripes, std::vector<Rect> &found)
+        : image(image), stripes(stripes), found(found) {}
+
+    void operator()(const Range &range) const {
+        int cn = image.channels();
+        int bytes = image.cols * cn;
+        std::vector< uchar > columns(bytes);
+#ifdef SHAREDFUNCTIONS_AVX2
+        bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+        for (int s = range.start; s < range.end; s++) {
+            std::fill(columns.begin(), columns.end(), 0);
+            int begin = (int)((long long)image.rows * s / stripes);
+            int end = (int)((long long)image.rows * (s + 1) / stripes);
+            int top = -1, bottom = -1;
+            for (int y = begin; y < end; y++) {
+#ifdef SHAREDFUNCTIONS_AVX2
+                bool any = avx2 ? orRowAvx2(image.ptr(y), &columns[0], bytes) : orRowScalar(image.ptr(y), &columns[0], bytes);
+#else
+                bool any = orRowScalar(image.ptr(y), &columns[0], bytes);
+#endif
+                if (any) {
+                    if (top < 0) top = y;
+                    bottom = y;
+                }
+            }
+            found[s] = Rect();
+            if (top < 0) continue;
+            int left = 0, right = bytes - 1;
+            while (columns[left] == 0) left++;
+            while (columns[right] == 0) right--;
+            // bytes to pixels
+            found[s] = Rect(left / cn, top, right / cn - left / cn + 1, bottom - top + 1);
+        }
+    }
+
+private:
+    const Mat &image;
+    int stripes;
+    std::vector<Rect> &found;
+};
+
+}
+
 SharedFunctions::SharedFunctions()
 {
 }
@@ -38,34 +134,50 @@ void SharedFunctions::drawPolygon(cv::Mat& image, std::vector<cv::Point> points)
 }
 
 // Used to crop and to find region of interest
-cv::Rect SharedFunctions::findBoundingBox(cv::Mat &inputImage, bool inputGrayScale) {
-
-    Mat imageToFindBoundingBoxOn;
-
-    if (!inputGrayScale) {
-        cvtColor( inputImage, imageToFindBoundingBoxOn, CV_BGR2GRAY );
-    } else {
-        imageToFindBoundingBoxOn = inputImage;
+cv::Rect SharedFunctions::findBoundingBox(const cv::Mat &inputImage) {
+    CV_Assert(inputImage.depth() == CV_8U);
+    if (inputImage.empty()) return Rect();
+
+    int stripes = std::min(inputImage.rows, STRIPES);
+    std::vector< Rect > found(stripes);
+    parallel_for_(Range(0, stripes), NonZeroStripes(inputImage, stripes, found));
+
+    Rect bounds;
+    for (int i = 0; i < stripes; i++) {
+        if (found[i].area() == 0) continue;
+        bounds = bounds.area() == 0 ? found[i] : (bounds | found[i]);
     }
+    return bounds;
+}
 
-    //crop the black part of the image
-    cv::Mat mask;
-    vector<vector<Point> > contours; //no c++ 11 rabble rabble
-
-    threshold(imageToFindBoundingBoxOn, mask, 1.0, 255.0, CHAIN_APPROX_SIMPLE);
-    findContours(mask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+cv::Rect SharedFunctions::findBoundingBox(cv::Size imageSize, const cv::Mat &homography) {
+    return WarpComposite::footprint(imageSize, homography);
+}
 
-    double maxContourArea = 0.0;
-    unsigned maxContourIndex, i;
-    for (i  = 0; i < contours.size(); ++i) {
-        double a = contourArea(contours[i]);
-        if (a > maxContourArea) {
-            maxContourArea  = a;
-            maxContourIndex = i;
+void SharedFunctions::matchWithRatio(Ptr<DescriptorMatcher> matcher, const Mat &query, const Mat &train,
+                                     double ratio, std::vector<DMatch> &matches) {
+    matches.clear();
+    if (ratio <= 0) {
+        if (train.empty()) {
+            matcher->match(query, matches);
+        } else {
+            matcher->match(query, train, matches);
         }
+        return;
     }
 
-    return boundingRect(contours[maxContourIndex]);
+    std::vector< std::vector<DMatch> > candidates;
+    if (train.empty()) {
+        matcher->knnMatch(query, candidates, 2);
+    } else {
+        matcher->knnMatch(query, train, candidates, 2);
+    }
+    for (unsigned i = 0; i < candidates.size(); i++) {
+        if (candidates[i].empty()) continue;
+        // an approximate matcher can come back with a single neighbour, nothing to compare it to
+        if (candidates[i].size() > 1 && candidates[i][0].distance >= ratio * candidates[i][1].distance) continue;
+        matches.push_back(candidates[i][0]);
+    }
 }
 
 void SharedFunctions::saveImage(Mat &image, QString name) {
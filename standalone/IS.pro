@@ -13,11 +13,47 @@ TEMPLATE = app
 SOURCES += mainIS.cpp\
     imagestitcher.cpp \
     sharedfunctions.cpp \ 
-    StitchingHandler.cpp
+    StitchingHandler.cpp \
+    mosaicfeaturemap.cpp \
+    framepipeline.cpp \
+    imageloader.cpp \
+    metadataparser.cpp \
+    telemetryprior.cpp \
+    mosaiccanvas.cpp \
+    tilestore.cpp \
+    mosaicexporter.cpp \
+    globalaligner.cpp \
+    matchfilter.cpp \
+    hammingmatcher.cpp \
+    warpcomposite.cpp \
+    mosaicblender.cpp \
+    featurestore.cpp \
+    homographyestimator.cpp \
+    phasecorrelator.cpp \
+    featuretracker.cpp \
+    griddetector.cpp
 
 HEADERS  += imagestitcher.h \
     sharedfunctions.h \
-	StitchingHandler.h
+	StitchingHandler.h \
+    mosaicfeaturemap.h \
+    framepipeline.h \
+    imageloader.h \
+    metadataparser.h \
+    telemetryprior.h \
+    mosaiccanvas.h \
+    tilestore.h \
+    mosaicexporter.h \
+    globalaligner.h \
+    matchfilter.h \
+    hammingmatcher.h \
+    warpcomposite.h \
+    mosaicblender.h \
+    featurestore.h \
+    homographyestimator.h \
+    phasecorrelator.h \
+    featuretracker.h \
+    griddetector.h
 
 INCLUDEPATH +=  `pkg-config --cflags opencv`
 
@@ -25,3 +61,5 @@ DESTDIR = bin
 
 LIBS += -L/usr/local/lib
 LIBS += `pkg-config --libs opencv`
+LIBS += -ljpeg
+LIBS += -lz
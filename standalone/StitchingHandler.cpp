@@ -1,19 +1,93 @@
 #include "StitchingHandler.h"
+#include "hammingmatcher.h"
 
 #include <QDir>
 #include <QString>
 #include <QStringList>
-#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 
-StitchingHandler::StitchingHandler(ImageStitcher::AlgorithmType algorithm, QString inputDir, QString outDir) 
-		: algorithm(algorithm), finishedAllImages(false), numIterations(0), inputDir(inputDir), outputDir(outDir) {
+bool parseStitchingOption(const char* arg, StitchingOptions* options) {
+	if (strncmp(arg, "--memory=", 9) == 0) {
+		options->memoryBudget = atoi(arg + 9);
+	} else if (strncmp(arg, "--cog=", 6) == 0) {
+		options->cogFile = QString(arg + 6);
+	} else if (strncmp(arg, "--tiles=", 8) == 0) {
+		options->tileDirectory = QString(arg + 8);
+	} else if (strncmp(arg, "--tile-format=", 14) == 0) {
+		if (strcmp(arg + 14, "png") != 0 && strcmp(arg + 14, "jpg") != 0) return false;
+		options->tileFormat = QString(arg + 14);
+	} else if (strcmp(arg, "--detector=SURF") == 0) {
+		options->featureDetector = ImageStitcher::SURF;
+	} else if (strcmp(arg, "--detector=ORB") == 0) {
+		options->featureDetector = ImageStitcher::ORB;
+	} else if (strcmp(arg, "--matcher=BRUTE_FORCE") == 0) {
+		options->featureMatcher = ImageStitcher::BRUTE_FORCE;
+	} else if (strcmp(arg, "--matcher=FLANN") == 0) {
+		options->featureMatcher = ImageStitcher::FLANN;
+	} else if (strcmp(arg, "--matcher=HAMMING") == 0) {
+		options->featureMatcher = ImageStitcher::SIMD_HAMMING;
+	} else if (strcmp(arg, "--cross-check") == 0) {
+		options->crossCheck = true;
+	} else if (strcmp(arg, "--blend=multiband") == 0) {
+		options->blending = ImageStitcher::MULTI_BAND;
+	} else if (strcmp(arg, "--blend=none") == 0) {
+		options->blending = ImageStitcher::OVERWRITE;
+	} else if (strncmp(arg, "--bands=", 8) == 0) {
+		options->blendBands = atoi(arg + 8);
+	} else if (strncmp(arg, "--ratio=", 8) == 0) {
+		options->matchRatio = atof(arg + 8);
+	} else if (strncmp(arg, "--feature-cache=", 16) == 0) {
+		options->featureCache = QString(arg + 16);
+	} else if (strcmp(arg, "--estimator=ransac") == 0) {
+		options->estimator = HomographyEstimator::RANSAC;
+	} else if (strcmp(arg, "--estimator=prosac") == 0) {
+		options->estimator = HomographyEstimator::PROSAC;
+	} else if (strcmp(arg, "--model=select") == 0) {
+		options->modelSelection = true;
+	} else if (strcmp(arg, "--model=homography") == 0) {
+		options->modelSelection = false;
+	} else if (strcmp(arg, "--phase-guess") == 0) {
+		options->phaseGuess = true;
+	} else if (strncmp(arg, "--features=", 11) == 0) {
+		options->featureBudget = atoi(arg + 11);
+		if (options->featureBudget <= 0) return false;
+	} else {
+		return false;
+	}
+	return true;
 }
 
-void StitchingHandler::run() {
+bool parseAlgorithm(const char* name, ImageStitcher::AlgorithmType* type) {
+	if (strncmp(name, "CUMULATIVE", 9) == 0) {
+		(*type) = ImageStitcher::CUMULATIVE;
+	} else if (strncmp(name, "COMPOUND", 7) == 0) {
+		(*type) = ImageStitcher::COMPOUND_HOMOGRAPHY;
+	} else if (strncmp(name, "REDUCE", 6) == 0) {
+		(*type) = ImageStitcher::REDUCE;
+	} else if (strncmp(name, "GLOBAL", 6) == 0) {
+		(*type) = ImageStitcher::GLOBAL;
+	} else if (strncmp(name, "PHASE", 5) == 0) {
+		(*type) = ImageStitcher::PHASE_CORRELATION;
+	} else if (strncmp(name, "TRACKING", 8) == 0) {
+		(*type) = ImageStitcher::TRACKING;
+	} else if (strncmp(name, "FULL", 4) == 0) {
+		(*type) = ImageStitcher::FULL_MATCHES;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+StitchingHandler::StitchingHandler(ImageStitcher::AlgorithmType algorithm, QString inputDir, QString outDir, const StitchingOptions &options) 
+		: algorithm(algorithm), finishedAllImages(false), numIterations(0), inputDir(inputDir), outputDir(outDir), options(options) {
+}
+
+ImageStitcher* StitchingHandler::createStitcher() const {
 
 		QDir directory(inputDir);
 	        QStringList inputFiles = directory.entryList(QDir::Files | QDir::NoSymLinks | QDir::Readable);
-                if (inputFiles.size() < 2) return;    // don't crash on one input image
+                if (inputFiles.size() < 2) return NULL;    // don't crash on one input image
 
                 double angleParam = 1.0;
                 double lengthParam = 1.0;
@@ -28,13 +102,34 @@ void StitchingHandler::run() {
 			//std::cout << fullPathNames.at(i).toStdString() << " " ;
 		}
 
-                ImageStitcher* stitcher = new ImageStitcher(fullPathNames, imageScale, 1.25, angleParam, lengthParam, heuristicParam, ImageStitcher::SURF, ImageStitcher::BRUTE_FORCE, stepMode, algorithm, outputDir);
-                //connect(stitcher, SIGNAL(stitchingUpdate(StitchingUpdateData*)), this, SLOT(stitchingUpdate(StitchingUpdateData*)));
+                ImageStitcher* stitcher = new ImageStitcher(fullPathNames, imageScale, 1.25, angleParam, lengthParam, heuristicParam, options.featureDetector, options.featureMatcher, stepMode, algorithm, outputDir);
+                stitcher->setTelemetryFile(options.metaDataFile);
+                stitcher->setMemoryBudget(options.memoryBudget);
+                stitcher->setExport(options.cogFile, options.tileDirectory, options.tileFormat);
+                if (options.matchRatio >= 0) {
+                        stitcher->setMatchRatio(options.matchRatio);
+                }
+                stitcher->setCrossCheck(options.crossCheck);
+                stitcher->setBlending(options.blending, options.blendBands);
+                stitcher->setFeatureCache(options.featureCache);
+                stitcher->setEstimator(options.estimator);
+                stitcher->setModelSelection(options.modelSelection);
+                stitcher->setPhaseGuess(options.phaseGuess);
+                stitcher->setFeatureBudget(options.featureBudget);
+                return stitcher;
+}
+
+void StitchingHandler::run() {
+                ImageStitcher* stitcher = createStitcher();
+                if (stitcher == NULL) return;
+                if (options.featureMatcher == ImageStitcher::SIMD_HAMMING) {
+                        std::cout << "Hamming matching with the " << HammingMatcher::kernelName() << " kernel\n";
+                }
+                //connect(stitcher, SIGNAL(stitchingUpdate(StitchingUpdate)), this, SLOT(stitchingUpdate(StitchingUpdate)));
                 //connect(stitcher, SIGNAL(stitchingFinished(bool)), this, SLOT(stitchingFinished(bool)));
                 stitcher->start();
-                while (stitcher->finishedStitching == false) {
-			usleep( 100000 );
-                }   
+                stitcher->wait();   // returns as soon as the thread is done, however it ended
+                delete stitcher;
 }  
 
 void StitchingHandler::stitchingFinished(bool success) {
@@ -42,7 +137,7 @@ void StitchingHandler::stitchingFinished(bool success) {
 	std::cout << "finished all images with success " << success << std::endl;
 } 
 
-void StitchingHandler::stitchingUpdate(StitchingUpdateData* updateData) {
+void StitchingHandler::stitchingUpdate(StitchingUpdate updateData) {
                 QString outputName = outputDir;
                 if (algorithm == ImageStitcher::CUMULATIVE) {
                         outputName += "CUMULATIVE";
@@ -50,11 +145,17 @@ void StitchingHandler::stitchingUpdate(StitchingUpdateData* updateData) {
                         outputName += "COMPOUND";
                 } else if (algorithm == ImageStitcher::REDUCE) {
                         outputName += "REDUCE";
+                } else if (algorithm == ImageStitcher::GLOBAL) {
+                        outputName += "GLOBAL";
+                } else if (algorithm == ImageStitcher::PHASE_CORRELATION) {
+                        outputName += "PHASE";
+                } else if (algorithm == ImageStitcher::TRACKING) {
+                        outputName += "TRACKING";
                 } else {
                         outputName += "FULL";
                 }
                 outputName = outputName + "_" + QString::number(numIterations);
-                cv::imwrite(outputName.toStdString().c_str(), updateData->currentScene);
+                cv::imwrite(outputName.toStdString().c_str(), updateData->currentScene());
                 numIterations++;
 		std::cout << "finished iteration " << numIterations << " output file: " << outputName.toStdString() << std::endl;
 }
@@ -1,18 +1,51 @@
 #include "imagestitcher.h"
 #include <QObject>
 
+// everything past the input directory and algorithm, the defaults are what IS always did
+struct StitchingOptions {
+	StitchingOptions() : memoryBudget(0), tileFormat("png"), featureDetector(ImageStitcher::SURF),
+	                     featureMatcher(ImageStitcher::BRUTE_FORCE), matchRatio(-1), crossCheck(false),
+	                     blending(ImageStitcher::OVERWRITE), blendBands(5), estimator(HomographyEstimator::PROSAC),
+	                     modelSelection(false), phaseGuess(false), featureBudget(0) {}
+	QString metaDataFile;
+	int memoryBudget;   // megabytes, 0 is unlimited
+	QString cogFile;    // empty for none
+	QString tileDirectory;
+	QString tileFormat;
+	ImageStitcher::FeatureDetector featureDetector;
+	ImageStitcher::FeatcherMatcher featureMatcher;
+	double matchRatio;  // negative leaves the stitcher's default
+	bool crossCheck;
+	ImageStitcher::Blending blending;
+	int blendBands;
+	QString featureCache;   // empty keeps features in memory only
+	HomographyEstimator::Method estimator;
+	bool modelSelection;
+	bool phaseGuess;
+	int featureBudget;  // keypoints per image over a grid, 0 detects over the whole image
+};
+
+// Reads one of the --name=value options listed in the IS usage into options. False if arg is
+// not one of them or its value isn't valid.
+bool parseStitchingOption(const char* arg, StitchingOptions* options);
+// CUMULATIVE, COMPOUND, REDUCE, GLOBAL, PHASE, TRACKING or FULL, false (and type left alone) for anything else
+bool parseAlgorithm(const char* name, ImageStitcher::AlgorithmType* type);
+
 class StitchingHandler : public QObject {
 Q_OBJECT
 public:
-        StitchingHandler(ImageStitcher::AlgorithmType algorithm, QString inputDir, QString outDir);
+        StitchingHandler(ImageStitcher::AlgorithmType algorithm, QString inputDir, QString outDir, const StitchingOptions &options = StitchingOptions());
         void run();  
+        // set up for inputDir and the options but not started, NULL if there are fewer than two images
+        ImageStitcher* createStitcher() const;
         ImageStitcher::AlgorithmType algorithm;
         bool finishedAllImages;
         int numIterations;
 	QString inputDir;
 	QString outputDir;
+	StitchingOptions options;
 public slots:
-        void stitchingUpdate(StitchingUpdateData* updateData);
+        void stitchingUpdate(StitchingUpdate updateData);
 	void stitchingFinished(bool success);
 };
 
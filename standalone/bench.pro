@@ -0,0 +1,38 @@
+#-------------------------------------------------
+#
+# Timings of the hot paths against what they replaced, see mainBench.cpp
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = bench
+TEMPLATE = app
+
+
+SOURCES += mainBench.cpp \
+    matchfilter.cpp \
+    hammingmatcher.cpp \
+    sharedfunctions.cpp \
+    warpcomposite.cpp \
+    mosaiccanvas.cpp \
+    tilestore.cpp \
+    mosaicexporter.cpp
+
+HEADERS  += matchfilter.h \
+    hammingmatcher.h \
+    sharedfunctions.h \
+    warpcomposite.h \
+    mosaiccanvas.h \
+    tilestore.h \
+    mosaicexporter.h
+
+INCLUDEPATH +=  `pkg-config --cflags opencv`
+
+DESTDIR = bin
+
+LIBS += -L/usr/local/lib
+LIBS += `pkg-config --libs opencv`
+LIBS += -ltiff
+LIBS += -lz
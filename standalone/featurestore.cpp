@@ -0,0 +1,259 @@
+#include "featurestore.h"
+
+#include <QDir>
+#include <QFile>
+#include <QMutexLocker>
+#include <QTemporaryFile>
+
+#include <iostream>
+#include <string.h>
+
+using namespace cv;
+
+namespace {
+
+const char FILE_MAGIC[4] = { 'V', 'F', 'S', '1' };  // bump the digit when the layout changes
+
+// The files are only ever read back on the machine that wrote them, so they are
+// laid out in native byte order
+struct FileHeader {
+    char magic[4];
+    qint32 numKeypoints;
+    qint32 descriptorRows;
+    qint32 descriptorCols;
+    qint32 descriptorType;
+    qint32 numMatches;
+};
+
+struct StoredKeypoint {
+    float x, y, size, angle, response;
+    qint32 octave, classId;
+};
+
+struct StoredMatch {
+    qint32 queryIdx, trainIdx, imgIdx;
+    float distance;
+};
+
+size_t descriptorBytes(const Mat &descriptors) {
+    return descriptors.total() * descriptors.elemSize();
+}
+
+int costOf(const FeatureStore::Entry &entry) {
+    size_t bytes = entry.keypoints.size() * sizeof(KeyPoint) + descriptorBytes(entry.descriptors)
+                   + entry.matches.size() * sizeof(DMatch);
+    return (int)(bytes / 1024) + 1;
+}
+
+FeatureStore::Entry copyOf(const FeatureStore::Entry &entry) {
+    FeatureStore::Entry copy;
+    copy.keypoints = entry.keypoints;
+    copy.descriptors = entry.descriptors.clone();
+    copy.matches = entry.matches;
+    return copy;
+}
+
+}
+
+FeatureStore::Key::Key(const QByteArray &settings) : hash(QCryptographicHash::Md5) {
+    add(settings);
+}
+
+FeatureStore::Key& FeatureStore::Key::add(const Mat &data) {
+    add(data.rows);
+    add(data.cols);
+    add(data.type());
+    // row by row, data may be a region of a bigger image
+    size_t rowBytes = data.cols * data.elemSize();
+    for (int y = 0; y < data.rows; y++) {
+        hash.addData(reinterpret_cast<const char*>(data.ptr(y)), rowBytes);
+    }
+    return *this;
+}
+
+FeatureStore::Key& FeatureStore::Key::add(const std::vector<KeyPoint> &keypoints) {
+    add((int)keypoints.size());
+    if (!keypoints.empty()) {
+        hash.addData(reinterpret_cast<const char*>(&keypoints[0]), keypoints.size() * sizeof(KeyPoint));
+    }
+    return *this;
+}
+
+FeatureStore::Key& FeatureStore::Key::add(int value) {
+    qint32 v = value;
+    hash.addData(reinterpret_cast<const char*>(&v), sizeof(v));
+    return *this;
+}
+
+FeatureStore::Key& FeatureStore::Key::add(const QByteArray &data) {
+    add(data.size());   // so that "ab" + "c" and "a" + "bc" differ
+    hash.addData(data);
+    return *this;
+}
+
+QByteArray FeatureStore::Key::result() const {
+    return hash.result();
+}
+
+FeatureStore::FeatureStore() : hitCount(0), missCount(0)
+{
+    setMemoryLimit(128 * 1024 * 1024);
+}
+
+void FeatureStore::clear() {
+    QMutexLocker locker(&lock);
+    cache.clear();
+}
+
+void FeatureStore::setMemoryLimit(size_t bytes) {
+    QMutexLocker locker(&lock);
+    cache.setMaxCost((int)(bytes / 1024));
+}
+
+bool FeatureStore::setDirectory(const QString &dir) {
+    directory = dir;
+    if (directory.isEmpty()) return true;
+    if (!QDir().mkpath(directory)) {
+        std::cout << "Could not create feature cache directory " << directory.toStdString() << std::endl;
+        directory = QString();
+        return false;
+    }
+    return true;
+}
+
+bool FeatureStore::find(const QByteArray &key, Entry &entry) {
+    {
+        QMutexLocker locker(&lock);
+        Entry* cached = cache.object(key);
+        if (cached) {
+            entry = copyOf(*cached);
+            hitCount++;
+            return true;
+        }
+    }
+    // the file is read outside the lock, other threads can carry on with the memory cache meanwhile
+    if (!directory.isEmpty() && read(fileName(key), entry)) {
+        remember(key, entry);
+        QMutexLocker locker(&lock);
+        hitCount++;
+        return true;
+    }
+    QMutexLocker locker(&lock);
+    missCount++;
+    return false;
+}
+
+void FeatureStore::store(const QByteArray &key, const Entry &entry) {
+    remember(key, entry);
+    if (!directory.isEmpty()) {
+        write(fileName(key), entry);
+    }
+}
+
+int FeatureStore::hits() const {
+    QMutexLocker locker(&lock);
+    return hitCount;
+}
+
+int FeatureStore::misses() const {
+    QMutexLocker locker(&lock);
+    return missCount;
+}
+
+QString FeatureStore::fileName(const QByteArray &key) const {
+    return QDir(directory).filePath(QString::fromLatin1(key.toHex()) + ".feat");
+}
+
+void FeatureStore::remember(const QByteArray &key, const Entry &entry) {
+    int cost = costOf(entry);
+    QMutexLocker locker(&lock);
+    if (cost > cache.maxCost()) return;
+    cache.insert(key, new Entry(copyOf(entry)), cost);
+}
+
+// Anything that doesn't add up (a file cut short by a crash, an older layout) is a miss
+bool FeatureStore::read(const QString &file, Entry &entry) const {
+    QFile input(file);
+    if (!input.open(QIODevice::ReadOnly)) return false;
+    qint64 size = input.size();
+    if (size < (qint64)sizeof(FileHeader)) return false;
+    uchar* data = input.map(0, size);
+    if (!data) return false;
+
+    FileHeader header;
+    memcpy(&header, data, sizeof(header));
+    bool valid = memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) == 0
+                 && header.numKeypoints >= 0 && header.numMatches >= 0
+                 && header.descriptorRows >= 0 && header.descriptorCols >= 0;
+    size_t elemSize = valid ? CV_ELEM_SIZE(header.descriptorType) : 0;
+    size_t descriptorSize = (size_t)header.descriptorRows * header.descriptorCols * elemSize;
+    if (valid && size != (qint64)(sizeof(FileHeader) + header.numKeypoints * sizeof(StoredKeypoint)
+                                  + descriptorSize + header.numMatches * sizeof(StoredMatch))) {
+        valid = false;
+    }
+    if (valid) {
+        const uchar* p = data + sizeof(FileHeader);
+        entry.keypoints.resize(header.numKeypoints);
+        for (int i = 0; i < header.numKeypoints; i++, p += sizeof(StoredKeypoint)) {
+            StoredKeypoint kp;
+            memcpy(&kp, p, sizeof(kp));
+            entry.keypoints[i] = KeyPoint(kp.x, kp.y, kp.size, kp.angle, kp.response, kp.octave, kp.classId);
+        }
+        entry.descriptors = Mat();
+        if (header.descriptorRows > 0 && header.descriptorCols > 0) {
+            entry.descriptors.create(header.descriptorRows, header.descriptorCols, header.descriptorType);
+            memcpy(entry.descriptors.data, p, descriptorSize);
+        }
+        p += descriptorSize;
+        entry.matches.resize(header.numMatches);
+        for (int i = 0; i < header.numMatches; i++, p += sizeof(StoredMatch)) {
+            StoredMatch m;
+            memcpy(&m, p, sizeof(m));
+            entry.matches[i] = DMatch(m.queryIdx, m.trainIdx, m.imgIdx, m.distance);
+        }
+    }
+    input.unmap(data);
+    return valid;
+}
+
+// Written to a temporary file that is renamed into place, a reader (maybe another process
+// stitching the same flight) never sees half an entry
+void FeatureStore::write(const QString &file, const Entry &entry) const {
+    FileHeader header;
+    memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header.numKeypoints = entry.keypoints.size();
+    Mat descriptors = entry.descriptors.isContinuous() ? entry.descriptors : entry.descriptors.clone();
+    header.descriptorRows = descriptors.rows;
+    header.descriptorCols = descriptors.cols;
+    header.descriptorType = descriptors.type();
+    header.numMatches = entry.matches.size();
+
+    QByteArray buffer;
+    buffer.reserve(sizeof(header) + entry.keypoints.size() * sizeof(StoredKeypoint)
+                   + descriptorBytes(descriptors) + entry.matches.size() * sizeof(StoredMatch));
+    buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (unsigned i = 0; i < entry.keypoints.size(); i++) {
+        const KeyPoint &k = entry.keypoints[i];
+        StoredKeypoint kp = { k.pt.x, k.pt.y, k.size, k.angle, k.response, k.octave, k.class_id };
+        buffer.append(reinterpret_cast<const char*>(&kp), sizeof(kp));
+    }
+    buffer.append(reinterpret_cast<const char*>(descriptors.data), descriptorBytes(descriptors));
+    for (unsigned i = 0; i < entry.matches.size(); i++) {
+        const DMatch &d = entry.matches[i];
+        StoredMatch m = { d.queryIdx, d.trainIdx, d.imgIdx, d.distance };
+        buffer.append(reinterpret_cast<const char*>(&m), sizeof(m));
+    }
+
+    QTemporaryFile output(file + ".XXXXXX");
+    output.setAutoRemove(false);
+    if (!output.open() || output.write(buffer) != buffer.size()) {
+        std::cout << "Could not write feature cache file " << file.toStdString() << std::endl;
+        output.remove();
+        return;
+    }
+    output.close();
+    // QFile::rename won't replace an existing file, one that is there already holds the same entry
+    if (!output.rename(file)) {
+        output.remove();
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef FEATURETRACKER_H
+#define FEATURETRACKER_H
+
+#include <opencv2/opencv.hpp>
+
+// Follows corners from one frame to the next with pyramidal Lucas-Kanade instead of detecting
+// and matching in every frame. Each frame's pyramid is built once, as the next frame of one
+// step and then the previous frame of the following one. The image is split into a grid of
+// cells and corners (goodFeaturesToTrack) are only detected again in the cells that lost
+// most of their tracks, so the tracks stay spread over the whole frame.
+class FeatureTracker
+{
+public:
+    explicit FeatureTracker(int maxCorners = 1000);
+    void clear();
+    // gray becomes the current frame, with corners detected all over it
+    void start(const cv::Mat &gray);
+    // Tracks the corners of the current frame into gray, which becomes the current frame. from and
+    // to are where each surviving track was and now is, smallest tracking error first.
+    void track(const cv::Mat &gray, std::vector<cv::Point2f> &from, std::vector<cv::Point2f> &to);
+    // Like track() but with corners detected all over the previous frame first, for when the tracks
+    // that were left weren't enough
+    void retrack(std::vector<cv::Point2f> &from, std::vector<cv::Point2f> &to);
+    // Drops the tracks that inliers (one flag per point of the last track(), in its order) doesn't
+    // keep, then tops up the cells of the current frame that were left with too few
+    void keepInliers(const std::vector<uchar> &inliers);
+    int size() const;
+
+private:
+    void seed();
+    void follow(const std::vector<cv::Point2f> &corners, std::vector<cv::Point2f> &from, std::vector<cv::Point2f> &to);
+
+    int maxCorners;
+    cv::Mat previous;
+    cv::Mat current;
+    std::vector<cv::Mat> previousPyramid;
+    std::vector<cv::Mat> currentPyramid;
+    std::vector<cv::Point2f> points;    // corners in current
+};
+
+#endif // FEATURETRACKER_H
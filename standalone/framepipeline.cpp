@@ -0,0 +1,110 @@
+#include "framepipeline.h"
+#include "imagestitcher.h"
+
+#include <QMutexLocker>
+
+FramePipeline::Task::Task(FramePipeline* pipeline, Stage stage, PreparedFrame* frame)
+    : pipeline(pipeline), stage(stage), frame(frame)
+{
+}
+
+void FramePipeline::Task::run() {
+    if (stage == DECODE) {
+        pipeline->decodeStage(frame);
+    } else {
+        pipeline->detectStage(frame);
+    }
+}
+
+FramePipeline::FramePipeline(const ImageStitcher* stitcher, QThreadPool* pool, int firstIndex, int endIndex, int maxInFlight,
+                             bool detect)
+    : stitcher(stitcher), pool(pool), endIndex(endIndex), maxInFlight(std::max(0, maxInFlight)), detect(detect),
+      nextToSubmit(firstIndex), nextToTake(firstIndex), running(0), abandoned(false)
+{
+    QMutexLocker locker(&mutex);
+    submitMore();
+}
+
+FramePipeline::~FramePipeline() {
+    QMutexLocker locker(&mutex);
+    abandoned = true;
+    while (running > 0) {
+        stateChanged.wait(&mutex);
+    }
+}
+
+bool FramePipeline::atEnd() const {
+    return nextToTake >= endIndex;
+}
+
+PreparedFrame FramePipeline::takeNext() {
+    if (maxInFlight == 0) {
+        // serial path, nothing runs ahead of the stitcher
+        PreparedFrame frame;
+        frame.index = nextToTake++;
+        stitcher->decodeFrame(frame);
+        if (detect) {
+            stitcher->extractFeatures(frame);
+        }
+        return frame;
+    }
+
+    QMutexLocker locker(&mutex);
+    while (!ready.contains(nextToTake)) {
+        stateChanged.wait(&mutex);
+    }
+    PreparedFrame frame = ready.take(nextToTake);
+    nextToTake++;
+    submitMore();   // a slot just opened up
+    return frame;
+}
+
+void FramePipeline::submitMore() {
+    if (maxInFlight == 0) return;
+    while (nextToSubmit < endIndex && nextToSubmit < nextToTake + maxInFlight) {
+        PreparedFrame* frame = new PreparedFrame();
+        frame->index = nextToSubmit++;
+        running++;
+        pool->start(new Task(this, DECODE, frame));
+    }
+}
+
+void FramePipeline::decodeStage(PreparedFrame* frame) {
+    mutex.lock();
+    bool skip = abandoned;
+    mutex.unlock();
+    if (skip) {
+        finish(NULL);
+        delete frame;
+        return;
+    }
+    stitcher->decodeFrame(*frame);
+    if (!detect) {
+        finish(frame);
+        delete frame;
+        return;
+    }
+    pool->start(new Task(this, DETECT, frame));
+}
+
+void FramePipeline::detectStage(PreparedFrame* frame) {
+    mutex.lock();
+    bool skip = abandoned;
+    mutex.unlock();
+    if (!skip) {
+        stitcher->extractFeatures(*frame);
+        finish(frame);
+    } else {
+        finish(NULL);
+    }
+    delete frame;
+}
+
+void FramePipeline::finish(PreparedFrame* frame) {
+    QMutexLocker locker(&mutex);
+    if (frame) {
+        ready.insert(frame->index, *frame);
+    }
+    running--;
+    stateChanged.wakeAll();
+}
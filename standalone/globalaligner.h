@@ -0,0 +1,73 @@
+#ifndef GLOBALALIGNER_H
+#define GLOBALALIGNER_H
+
+#include <opencv2/opencv.hpp>
+
+// Inlier correspondences between two input images, in the pixels of each
+struct ImagePairMatches {
+    ImagePairMatches() : from(-1), to(-1) {}
+    int from;
+    int to;
+    std::vector<cv::Point2f> fromPoints;
+    std::vector<cv::Point2f> toPoints;
+    cv::Mat homography;     // from -> to, the pairwise estimate
+};
+
+// Places every image of a match graph at once. The transforms start from a maximum
+// spanning tree of the pairwise homographies (most inliers first) and are then refined
+// together with Levenberg-Marquardt, minimising the distance between every pair of
+// matched points once both are on the mosaic. Each image only shares terms with the
+// images it was matched with, so the normal equations are block sparse (8x8 blocks, one
+// per image and one per matched pair) and are solved with conjugate gradients
+// preconditioned by the inverted diagonal blocks, nothing bigger than a block is ever
+// factorised.
+class GlobalAligner
+{
+public:
+    explicit GlobalAligner(cv::Size imageSize);
+
+    // image -> mosaic homographies with image root at the origin, false if some image
+    // is not connected to root through pairs
+    bool initialize(int numImages, const std::vector<ImagePairMatches> &pairs, int root, std::vector<cv::Mat> &transforms) const;
+    // refines transforms in place, the one of image fixed is left alone
+    void refine(const std::vector<ImagePairMatches> &pairs, int fixed, std::vector<cv::Mat> &transforms);
+    // root mean square distance in mosaic pixels between matched points, as of the last refine
+    double rmsError() const;
+
+    void setMaxIterations(int iterations);
+    // matched points further apart than this many pixels count linearly rather than squared
+    void setRobustThreshold(double pixels);
+
+private:
+    typedef cv::Matx<double, 8, 8> Block;
+    typedef cv::Vec<double, 8> BlockVector;
+
+    // the normal equations of one pair, pairs are assembled in parallel then summed
+    struct PairSystem {
+        Block fromFrom, toTo, fromTo;
+        BlockVector fromGradient, toGradient;
+        double cost;
+        int numPoints;
+    };
+    class AssemblePairs;
+    friend class AssemblePairs;
+
+    cv::Point2d normalized(const cv::Point2f &pixel) const;
+    // the homography in normalized coordinates, scaled so the last entry is 1 and left out
+    BlockVector toParameters(const cv::Mat &homography) const;
+    cv::Mat fromParameters(const BlockVector &parameters) const;
+    void assemble(const std::vector<ImagePairMatches> &pairs, const std::vector<BlockVector> &parameters,
+                  std::vector<PairSystem> &systems) const;
+    double totalCost(const std::vector<ImagePairMatches> &pairs, const std::vector<BlockVector> &parameters) const;
+    void solve(const std::vector<ImagePairMatches> &pairs, const std::vector<PairSystem> &systems, int numImages, int fixed,
+               double lambda, std::vector<BlockVector> &step) const;
+
+    cv::Mat normalize;      // pixels -> roughly [-1, 1] so every parameter has a similar scale
+    cv::Point2d center;
+    double pixelScale;      // normalized units -> pixels
+    int maxIterations;
+    double robustThreshold; // normalized units
+    double lastRms;
+};
+
+#endif // GLOBALALIGNER_H
@@ -0,0 +1,172 @@
+#include "griddetector.h"
+
+#include "opencv2/nonfree/nonfree.hpp"
+
+#include <QSemaphore>
+#include <QThread>
+
+#include <algorithm>
+#include <functional>
+
+using namespace cv;
+
+namespace {
+
+const int CELL_SIZE = 256;          // in pixels, about how big a cell is
+const int MAX_CELLS = 8;            // across or down
+const int MARGIN = 48;              // detected around each cell, about the border SURF's second octave needs
+const int MIN_THRESHOLD_DIVISOR = 8;
+
+// drops the keypoints outside area, coordinates relative to the padded cell
+void keepInside(std::vector<KeyPoint> &keypoints, const Rect &area) {
+    unsigned kept = 0;
+    for (unsigned i = 0; i < keypoints.size(); i++) {
+        Point p(cvFloor(keypoints[i].pt.x), cvFloor(keypoints[i].pt.y));
+        if (area.contains(p)) keypoints[kept++] = keypoints[i];
+    }
+    keypoints.resize(kept);
+}
+
+// Keeps the budget strongest of keypoints in the order they are in, the earlier of equally strong ones
+void keepStrongest(std::vector<KeyPoint> &keypoints, int budget) {
+    if ((int)keypoints.size() <= budget) return;
+    std::vector<float> responses(keypoints.size());
+    for (unsigned i = 0; i < keypoints.size(); i++) {
+        responses[i] = keypoints[i].response;
+    }
+    std::nth_element(responses.begin(), responses.begin() + (budget - 1), responses.end(), std::greater<float>());
+    float weakest = responses[budget - 1];
+    int stronger = 0;
+    for (unsigned i = 0; i < keypoints.size(); i++) {
+        if (keypoints[i].response > weakest) stronger++;
+    }
+    int ties = budget - stronger;
+    unsigned kept = 0;
+    for (unsigned i = 0; i < keypoints.size(); i++) {
+        bool keep = keypoints[i].response > weakest || (keypoints[i].response == weakest && ties-- > 0);
+        if (keep) keypoints[kept++] = keypoints[i];
+    }
+    keypoints.resize(kept);
+}
+
+}
+
+// Detects one cell and releases done once it has
+class GridDetector::CellTask : public QRunnable {
+public:
+    CellTask(const GridDetector* grid, const Mat* gray, const Mat* mask, Cell* cell, QSemaphore* done)
+        : grid(grid), gray(gray), mask(mask), cell(cell), done(done) {}
+    void run() {
+        grid->detectCell(*gray, *mask, *cell);
+        done->release();
+    }
+private:
+    const GridDetector* grid;
+    const Mat* gray;
+    const Mat* mask;
+    Cell* cell;
+    QSemaphore* done;
+};
+
+GridDetector::GridDetector(Detector detector, double hessianThreshold)
+    : detector(detector), hessianThreshold(hessianThreshold), budget(0)
+{
+    pool.setMaxThreadCount(QThread::idealThreadCount());
+}
+
+void GridDetector::setBudget(int keypoints) {
+    budget = std::max(0, keypoints);
+}
+
+int GridDetector::getBudget() const {
+    return budget;
+}
+
+void GridDetector::setThreads(int threads) {
+    pool.setMaxThreadCount(std::max(1, threads));
+}
+
+Size GridDetector::gridFor(Size imageSize) {
+    int across = std::max(1, std::min(MAX_CELLS, cvRound((double)imageSize.width / CELL_SIZE)));
+    int down = std::max(1, std::min(MAX_CELLS, cvRound((double)imageSize.height / CELL_SIZE)));
+    return Size(across, down);
+}
+
+void GridDetector::detect(const Mat &gray, std::vector<KeyPoint> &keypoints, Mat &descriptors, const Mat &mask) const {
+    keypoints.clear();
+    descriptors = Mat();
+    if (gray.empty() || budget == 0) return;
+
+    Size grid = gridFor(gray.size());
+    std::vector<Cell> cells;
+    for (int cy = 0; cy < grid.height; cy++) {
+        for (int cx = 0; cx < grid.width; cx++) {
+            Cell cell;
+            int x0 = gray.cols * cx / grid.width, x1 = gray.cols * (cx + 1) / grid.width;
+            int y0 = gray.rows * cy / grid.height, y1 = gray.rows * (cy + 1) / grid.height;
+            cell.area = Rect(x0, y0, x1 - x0, y1 - y0);
+            if (!mask.empty() && countNonZero(mask(cell.area)) == 0) continue;
+            cells.push_back(cell);
+        }
+    }
+    // with fewer keypoints than cells every cell puts up its best one and the strongest of those are kept
+    int count = cells.size();
+    if (count == 0) return;
+    for (int i = 0; i < count; i++) {
+        cells[i].quota = std::max(1, budget / count + (i < budget % count ? 1 : 0));
+    }
+
+    QSemaphore done;
+    for (int i = 0; i < count; i++) {
+        pool.start(new CellTask(this, &gray, &mask, &cells[i], &done));
+    }
+    done.acquire(count);
+
+    // in cell order, the same image always gives the same keypoints in the same order
+    for (int i = 0; i < count; i++) {
+        keypoints.insert(keypoints.end(), cells[i].keypoints.begin(), cells[i].keypoints.end());
+    }
+    keepStrongest(keypoints, budget);
+
+    // one pass over the whole image, the SURF integral image or ORB pyramid is only built once
+    if (detector == SURF) {
+        SurfDescriptorExtractor extractor;
+        extractor.compute(gray, keypoints, descriptors);
+    } else {
+        cv::ORB orb;
+        orb.compute(gray, keypoints, descriptors);
+    }
+}
+
+void GridDetector::detectCell(const Mat &gray, const Mat &mask, Cell &cell) const {
+    Rect padded = Rect(cell.area.x - MARGIN, cell.area.y - MARGIN, cell.area.width + 2 * MARGIN, cell.area.height + 2 * MARGIN)
+                  & Rect(0, 0, gray.cols, gray.rows);
+    Rect inside = cell.area - padded.tl();
+    Mat image = gray(padded);
+    Mat cellMask = mask.empty() ? Mat() : mask(padded);
+
+    std::vector<KeyPoint> found;
+    if (detector == SURF) {
+        double threshold = hessianThreshold;
+        while (true) {
+            found.clear();
+            SurfFeatureDetector surf(threshold);
+            surf.detect(image, found, cellMask);
+            keepInside(found, inside);
+            if ((int)found.size() >= cell.quota || threshold / 2 < hessianThreshold / MIN_THRESHOLD_DIVISOR) break;
+            threshold /= 2;
+        }
+    } else {
+        // ORB keeps its best nfeatures over the padded cell, asked for enough to leave the quota inside
+        double padding = (double)padded.area() / std::max(1, cell.area.area());
+        cv::ORB orb(std::max(1, cvCeil(cell.quota * padding)));
+        orb.detect(image, found, cellMask);
+        keepInside(found, inside);
+    }
+    keepStrongest(found, cell.quota);
+    for (unsigned i = 0; i < found.size(); i++) {
+        found[i].pt.x += padded.x;
+        found[i].pt.y += padded.y;
+    }
+    cell.keypoints = found;
+}
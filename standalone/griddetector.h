@@ -0,0 +1,54 @@
+#ifndef GRIDDETECTOR_H
+#define GRIDDETECTOR_H
+
+#include <QThreadPool>
+
+#include <opencv2/opencv.hpp>
+
+// Detects keypoints cell by cell over a grid laid on the image, every cell on a thread of its own
+// pool, so the keypoints are spread over the whole image instead of bunching up where the texture
+// is strongest and the detector runs on every core. The one knob is the budget: each cell keeps
+// its share of it (the strongest by response), and with SURF a cell that falls short comes down
+// from the Hessian threshold until it has its share or reaches an eighth of it. A budget smaller
+// than the grid goes to the strongest keypoints of all the cells. A cell detects over itself plus
+// a margin and keeps only what lies inside itself, so a keypoint on a border is found by both cells
+// but kept by one. Descriptors are computed once for all the cells over the whole image, no patch
+// is cut off at a cell border.
+class GridDetector
+{
+public:
+    enum Detector {
+        SURF,
+        ORB
+    };
+
+    GridDetector(Detector detector, double hessianThreshold);
+    // at most keypoints over a whole image, 0 (the default) turns the grid off
+    void setBudget(int keypoints);
+    int getBudget() const;
+    void setThreads(int threads);
+    // cells across and down for an image of imageSize
+    static cv::Size gridFor(cv::Size imageSize);
+    // Only in the cells mask leaves something of, the budget shared between those. Safe to call from
+    // several threads at once.
+    void detect(const cv::Mat &gray, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors,
+                const cv::Mat &mask = cv::Mat()) const;
+
+private:
+    struct Cell {
+        cv::Rect area;
+        int quota;
+        std::vector<cv::KeyPoint> keypoints;
+    };
+
+    class CellTask;
+    friend class CellTask;
+    void detectCell(const cv::Mat &gray, const cv::Mat &mask, Cell &cell) const;
+
+    const Detector detector;
+    const double hessianThreshold;
+    int budget;
+    mutable QThreadPool pool;
+};
+
+#endif // GRIDDETECTOR_H
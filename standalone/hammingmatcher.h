@@ -0,0 +1,46 @@
+#ifndef HAMMINGMATCHER_H
+#define HAMMINGMATCHER_H
+
+#include <opencv2/opencv.hpp>
+
+// Exact brute force matcher for binary descriptors (ORB), a drop in for
+// BFMatcher(NORM_HAMMING). Queries are split into blocks that run in parallel and each
+// block walks the train descriptors a tile at a time so the tile stays in L1 while every
+// query of the block is compared against it. Distances are popcounts of the XOR, with
+// AVX-512 VPOPCNTDQ or AVX2 where the CPU has them. The best two matches of every query
+// come out of the one pass (enough for a ratio test), and so does the best query of
+// every train descriptor, which is what cross checking needs.
+// Masks are not supported.
+class HammingMatcher : public cv::DescriptorMatcher
+{
+public:
+    // with crossCheck a query only keeps its matches if it is also the best query for its best match
+    explicit HammingMatcher(bool crossCheck = false);
+    virtual ~HammingMatcher();
+
+    virtual void add(const std::vector<cv::Mat> &descriptors);
+    virtual bool isMaskSupported() const;
+    virtual void train();
+    virtual void clear();
+    virtual cv::Ptr<cv::DescriptorMatcher> clone(bool emptyTrainData = false) const;
+
+    // the kernel in use, for logging
+    static const char* kernelName();
+
+protected:
+    virtual void knnMatchImpl(const cv::Mat &queryDescriptors, std::vector< std::vector<cv::DMatch> > &matches, int k,
+                              const std::vector<cv::Mat> &masks = std::vector<cv::Mat>(), bool compactResult = false);
+    virtual void radiusMatchImpl(const cv::Mat &queryDescriptors, std::vector< std::vector<cv::DMatch> > &matches, float maxDistance,
+                                 const std::vector<cv::Mat> &masks = std::vector<cv::Mat>(), bool compactResult = false);
+
+private:
+    class MatchBlocks;
+
+    bool crossCheck;
+    cv::Mat merged;                 // every train image's descriptors, one after the other
+    std::vector<int> imageOf;       // per merged row
+    std::vector<int> rowInImage;
+    bool trained;
+};
+
+#endif // HAMMINGMATCHER_H
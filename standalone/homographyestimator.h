@@ -0,0 +1,64 @@
+#ifndef HOMOGRAPHYESTIMATOR_H
+#define HOMOGRAPHYESTIMATOR_H
+
+#include <opencv2/opencv.hpp>
+
+// Robust homography between matched points, either OpenCV's RANSAC or PROSAC. PROSAC
+// expects the points best match first and draws its samples from a growing prefix of
+// them, so with good matches at the front it finds a model within a handful of draws.
+// It stops as soon as the best inlier ratio so far makes a better model unlikely (at
+// the given confidence), refits every new best model on its inliers (local optimisation)
+// and refits the final one too. The inliers of a model are counted eight points at a
+// time with AVX2 where the CPU has it.
+class HomographyEstimator
+{
+public:
+    enum Method {
+        RANSAC,     // findHomography(CV_RANSAC), what IS has always used
+        PROSAC
+    };
+
+    enum Model {
+        SIMILARITY,     // rotation, scale and shift
+        AFFINE,
+        HOMOGRAPHY
+    };
+
+    // what one estimate() call took
+    struct Report {
+        Report() : iterations(0), inliers(0), milliseconds(0), model(HOMOGRAPHY) {}
+        int iterations;     // models tried, 0 for RANSAC which doesn't say
+        int inliers;
+        double milliseconds;
+        Model model;        // what the result is, always a 3x3 Mat whatever it is
+    };
+
+    HomographyEstimator(Method method = PROSAC, double reprojectionThreshold = 3.0,
+                        double confidence = 0.995, int maxIterations = 2000);
+    void setMethod(Method method);
+    Method getMethod() const;
+    // off by default, PROSAC only (RANSAC always fits a homography)
+    void setModelSelection(bool enabled);
+    bool getModelSelection() const;
+
+    // An empty Mat if there are fewer than 4 points or no model was found. inliers (if given) gets
+    // one flag per point. Safe to call from several threads at once.
+    cv::Mat estimate(const std::vector<cv::Point2f> &from, const std::vector<cv::Point2f> &to,
+                     std::vector<uchar> *inliers = NULL, Report *report = NULL) const;
+
+    static bool usingAvx2();
+
+private:
+    cv::Mat prosac(const std::vector<cv::Point2f> &from, const std::vector<cv::Point2f> &to,
+                   Model model, int budget, std::vector<uchar> &mask, int &iterations) const;
+    cv::Mat selectModel(const std::vector<cv::Point2f> &from, const std::vector<cv::Point2f> &to,
+                        std::vector<uchar> &mask, int &iterations, Model &model) const;
+
+    Method method;
+    bool modelSelection;
+    double threshold;
+    double confidence;
+    int maxIterations;
+};
+
+#endif // HOMOGRAPHYESTIMATOR_H
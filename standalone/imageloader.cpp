@@ -0,0 +1,119 @@
+#include "imageloader.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+
+extern "C" {
+#include <jpeglib.h>
+}
+
+using namespace cv;
+
+namespace {
+
+// libjpeg calls exit() on errors by default, jump back out instead so the caller
+// can fall back to imread
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jumpBuffer;
+};
+
+void jpegErrorExit(j_common_ptr cinfo) {
+    JpegErrorManager* error = (JpegErrorManager*) cinfo->err;
+    longjmp(error->jumpBuffer, 1);
+}
+
+void jpegOutputMessage(j_common_ptr) {
+    // stay quiet about recoverable warnings, imread does too
+}
+
+}
+
+ImageLoader::ImageLoader()
+{
+}
+
+Mat ImageLoader::loadScaled(const std::string &path, double scale) {
+    Mat image;
+    if (scale > 0.0 && scale < 1.0 && decodeJpeg(path, scale, image)) {
+        return image;
+    }
+
+    // not a JPEG (or libjpeg could not handle it), do it the old way
+    image = imread(path);
+    if (image.empty() || scale == 1.0) {
+        return image;
+    }
+    Mat scaled;
+    cv::resize(image, scaled, Size(), scale, scale, INTER_AREA);
+    return scaled;
+}
+
+bool ImageLoader::decodeJpeg(const std::string &path, double scale, Mat &image) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+
+    unsigned char magic[2];
+    if (fread(magic, 1, 2, file) != 2 || magic[0] != 0xFF || magic[1] != 0xD8) {
+        fclose(file);
+        return false;
+    }
+    rewind(file);
+
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager error;
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = jpegErrorExit;
+    error.pub.output_message = jpegOutputMessage;
+    if (setjmp(error.jumpBuffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        image.release();
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, file);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // same rounding as cv::resize with fx/fy
+    int targetWidth  = std::max(1, cvRound(cinfo.image_width  * scale));
+    int targetHeight = std::max(1, cvRound(cinfo.image_height * scale));
+
+    // largest DCT reduction that does not go below the target size
+    unsigned int denom = 1;
+    for (unsigned int d = 8; d > 1; d /= 2) {
+        if ((int)((cinfo.image_width  + d - 1) / d) >= targetWidth &&
+            (int)((cinfo.image_height + d - 1) / d) >= targetHeight) {
+            denom = d;
+            break;
+        }
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+#ifdef JCS_EXTENSIONS
+    cinfo.out_color_space = JCS_EXT_BGR;
+#else
+    cinfo.out_color_space = JCS_RGB;
+#endif
+    jpeg_start_decompress(&cinfo);
+
+    image.create(cinfo.output_height, cinfo.output_width, CV_8UC3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = image.ptr(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+
+#ifndef JCS_EXTENSIONS
+    cvtColor(image, image, CV_RGB2BGR);
+#endif
+    if (image.cols != targetWidth || image.rows != targetHeight) {
+        Mat scaled;
+        cv::resize(image, scaled, Size(targetWidth, targetHeight), 0, 0, INTER_AREA);
+        image = scaled;
+    }
+    return true;
+}
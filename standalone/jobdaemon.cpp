@@ -0,0 +1,398 @@
+#include "jobdaemon.h"
+#include "StitchingHandler.h"
+#include "metadataparser.h"
+#include "objectrecognizer.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRegExp>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include <iostream>
+
+namespace {
+
+// a JSON string
+QString quoted(const QString &text) {
+    QString escaped = text;
+    escaped.replace("\\", "\\\\");
+    escaped.replace("\"", "\\\"");
+    return "\"" + escaped + "\"";
+}
+
+QString jobLine(int id, const QString &fields) {
+    return QString("{\"job\":%1,%2}").arg(id).arg(fields);
+}
+
+QString errorLine(const QString &message) {
+    return QString("{\"error\":%1}").arg(quoted(message));
+}
+
+}
+
+// One image of a recognition job on the job's pool
+class RecognitionJob::ImageTask : public QRunnable {
+public:
+    ImageTask(RecognitionJob* job, const QString &image) : job(job), image(image) {}
+    void run() {
+        job->recognize(image);
+    }
+private:
+    RecognitionJob* job;
+    QString image;
+};
+
+RecognitionJob::RecognitionJob(const QStringList &images, const QString &metaDataFile, const QString &outputDir, int threads,
+                               QObject *parent)
+    : QThread(parent), images(images), metaDataFile(metaDataFile), outputDir(outputDir), threads(std::max(1, threads)),
+      cancelled(false), failures(0)
+{
+}
+
+void RecognitionJob::cancel() {
+    QMutexLocker locker(&lock);
+    cancelled = true;
+}
+
+bool RecognitionJob::isCancelled() const {
+    QMutexLocker locker(&lock);
+    return cancelled;
+}
+
+void RecognitionJob::run() {
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    for (int i = 0; i < images.size(); i++) {
+        pool.start(new ImageTask(this, images.at(i)));
+    }
+    pool.waitForDone();
+
+    QMutexLocker locker(&lock);
+    emit recognitionFinished(!cancelled && failures == 0);
+}
+
+void RecognitionJob::recognize(const QString &image) {
+    if (isCancelled()) return;
+
+    MetaDataParser parser;
+    parser.setFileName(metaDataFile);
+    MetaData metaData = parser.searchForImage(image);
+    if (!metaData.dataIsValid) {
+        std::cout << "No telemetry for " << image.toStdString() << std::endl;
+        lock.lock();
+        failures++;
+        lock.unlock();
+        emit imageRecognized(image, false, QString());
+        return;
+    }
+    TelemetryInputs telemetry;
+    telemetry.latitude = metaData.data[LAT];
+    telemetry.longitude = metaData.data[LON];
+    telemetry.altitude = metaData.data[ALT];
+    telemetry.heading = metaData.data[YAW];
+
+    // the same parameters OR uses
+    ObjectRecognizer recognizer;
+    recognizer.gaussianSD = 21;
+    recognizer.cannyLow = 78;
+    recognizer.cannyHigh = 137;
+    recognizer.houghVote = 30;
+    recognizer.houghMinLength = 0;
+    recognizer.houghMinDistance = 40;
+    recognizer.imageScale = 1.0;
+    recognizer.polyDPError = 0.03;
+    recognizer.loadInputImage(image.toStdString());
+    RecognizerResults* results = recognizer.recognizeObjects(telemetry);
+
+    QStringList targets;
+    for (unsigned i = 0; i < results->targets.size(); i++) {
+        targets << QString::fromStdString(results->targets[i].json);
+    }
+    if (!results->output.empty()) {
+        cv::imwrite(QDir(outputDir).filePath(QFileInfo(image).fileName()).toStdString(), results->output);
+    }
+    delete results;
+    emit imageRecognized(image, true, "[" + targets.join(",") + "]");
+}
+
+JobDaemon::JobDaemon(int threadBudget, QObject *parent)
+    : QObject(parent), threadBudget(std::max(1, threadBudget)), threadsInUse(0), nextId(1)
+{
+    connect(&server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    shareParallelThreads();
+}
+
+JobDaemon::~JobDaemon() {
+    for (JobMap::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        Job* job = it->second;
+        if (ImageStitcher* stitcher = qobject_cast<ImageStitcher*>(job->worker)) {
+            stitcher->cancel();
+        } else {
+            qobject_cast<RecognitionJob*>(job->worker)->cancel();
+        }
+        job->worker->wait();
+        delete job->worker;
+        delete job;
+    }
+}
+
+bool JobDaemon::listen(const QString &socketName) {
+    QLocalServer::removeServer(socketName);     // left behind if the last daemon died
+    if (!server.listen(socketName)) {
+        std::cout << "Could not listen on " << socketName.toStdString() << ": " << server.errorString().toStdString() << std::endl;
+        return false;
+    }
+    std::cout << "Listening on " << socketName.toStdString() << " with " << threadBudget << " threads" << std::endl;
+    return true;
+}
+
+void JobDaemon::newConnection() {
+    while (QLocalSocket* client = server.nextPendingConnection()) {
+        connect(client, SIGNAL(readyRead()), this, SLOT(readCommands()));
+        connect(client, SIGNAL(disconnected()), client, SLOT(deleteLater()));
+    }
+}
+
+void JobDaemon::readCommands() {
+    QLocalSocket* client = qobject_cast<QLocalSocket*>(sender());
+    if (!client) return;
+    while (client->canReadLine()) {
+        QStringList words = QString::fromUtf8(client->readLine()).split(QRegExp("\\s+"), QString::SkipEmptyParts);
+        if (words.isEmpty()) continue;
+        client->write((runCommand(client, words) + "\n").toUtf8());
+    }
+    client->flush();
+}
+
+QString JobDaemon::runCommand(QLocalSocket* client, const QStringList &words) {
+    QString command = words.at(0);
+    QStringList args = words.mid(1);
+    if (command == "stitch") {
+        return submitStitch(client, args);
+    } else if (command == "recognize") {
+        return submitRecognition(client, args);
+    } else if (command == "status") {
+        return status();
+    } else if (command == "cancel" && args.size() == 1) {
+        return cancel(args.at(0).toInt());
+    }
+    return errorLine("unknown command " + command);
+}
+
+QString JobDaemon::submitStitch(QLocalSocket* client, const QStringList &args) {
+    Job* job = new Job();
+    job->id = nextId++;
+    job->type = "stitch";
+    job->threads = std::max(1, threadBudget / 2);
+    job->client = client;
+
+    QStringList positional;
+    StitchingOptions options;
+    QString outputPrefix = QString("imageOutputIS/job%1_").arg(job->id);
+    for (int i = 0; i < args.size(); i++) {
+        const QString &arg = args.at(i);
+        if (arg.startsWith("--priority=")) {
+            job->priority = arg.mid(11).toInt();
+        } else if (arg.startsWith("--threads=")) {
+            job->threads = std::max(1, arg.mid(10).toInt());
+        } else if (arg.startsWith("--out=")) {
+            outputPrefix = arg.mid(6);
+        } else if (arg.startsWith("--")) {
+            QByteArray option = arg.toLocal8Bit();
+            if (!parseStitchingOption(option.constData(), &options)) {
+                delete job;
+                return errorLine("unknown or invalid option " + arg);
+            }
+        } else {
+            positional << arg;
+        }
+    }
+    if (positional.size() < 1 || positional.size() > 3) {
+        delete job;
+        return errorLine("stitch takes a directory, an algorithm and a meta data file");
+    }
+
+    ImageStitcher::AlgorithmType algorithm = ImageStitcher::FULL_MATCHES;
+    if (positional.size() >= 2) {
+        QByteArray name = positional.at(1).toLocal8Bit();
+        parseAlgorithm(name.constData(), &algorithm);
+    }
+    if (positional.size() == 3) {
+        options.metaDataFile = positional.at(2);
+    }
+    StitchingHandler handler(algorithm, positional.at(0), outputPrefix, options);
+    ImageStitcher* stitcher = handler.createStitcher();
+    if (stitcher == NULL) {
+        delete job;
+        return errorLine("fewer than two images in " + positional.at(0));
+    }
+    // the stitching thread itself takes one of the threads
+    stitcher->setWorkerThreads(std::max(1, std::min(job->threads, threadBudget) - 1));
+    connect(stitcher, SIGNAL(stitchingUpdate(StitchingUpdate)), this, SLOT(stitchingUpdate(StitchingUpdate)));
+    connect(stitcher, SIGNAL(stitchingFinished(bool)), this, SLOT(stitchingFinished(bool)));
+    job->worker = stitcher;
+    return submit(job);
+}
+
+QString JobDaemon::submitRecognition(QLocalSocket* client, const QStringList &args) {
+    Job* job = new Job();
+    job->id = nextId++;
+    job->type = "recognize";
+    job->threads = std::max(1, threadBudget / 2);
+    job->client = client;
+
+    QStringList positional;
+    QString outputDir = QString("outputs/job%1").arg(job->id);
+    for (int i = 0; i < args.size(); i++) {
+        const QString &arg = args.at(i);
+        if (arg.startsWith("--priority=")) {
+            job->priority = arg.mid(11).toInt();
+        } else if (arg.startsWith("--threads=")) {
+            job->threads = std::max(1, arg.mid(10).toInt());
+        } else if (arg.startsWith("--out=")) {
+            outputDir = arg.mid(6);
+        } else if (arg.startsWith("--")) {
+            delete job;
+            return errorLine("unknown option " + arg);
+        } else {
+            positional << arg;
+        }
+    }
+    if (positional.size() < 2) {
+        delete job;
+        return errorLine("recognize takes a meta data file and at least one image");
+    }
+    QDir().mkpath(outputDir);
+
+    RecognitionJob* recognition = new RecognitionJob(positional.mid(1), positional.at(0), outputDir,
+                                                     std::min(job->threads, threadBudget));
+    connect(recognition, SIGNAL(imageRecognized(QString,bool,QString)), this, SLOT(imageRecognized(QString,bool,QString)));
+    connect(recognition, SIGNAL(recognitionFinished(bool)), this, SLOT(recognitionFinished(bool)));
+    job->worker = recognition;
+    return submit(job);
+}
+
+QString JobDaemon::submit(Job* job) {
+    job->threads = std::min(job->threads, threadBudget);
+    // queued after the job's own signals, so this is the last the daemon hears from it
+    connect(job->worker, SIGNAL(finished()), this, SLOT(jobFinished()));
+    jobs[job->id] = job;
+    QString reply = jobLine(job->id, "\"state\":\"queued\"");
+    schedule();
+    return reply;
+}
+
+// Starts the queued jobs in priority order for as long as the next one fits
+void JobDaemon::schedule() {
+    while (true) {
+        Job* next = NULL;
+        for (JobMap::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+            Job* job = it->second;
+            if (job->running) continue;
+            // the map is in id order, so ties go to whichever came first
+            if (next == NULL || job->priority > next->priority) next = job;
+        }
+        if (next == NULL || threadsInUse + next->threads > threadBudget) return;
+
+        next->running = true;
+        threadsInUse += next->threads;
+        shareParallelThreads();
+        next->worker->start();
+        send(next, jobLine(next->id, QString("\"state\":\"running\",\"threads\":%1").arg(next->threads)));
+    }
+}
+
+// OpenCV's parallel_for_ (blending, export, Hamming matching, the global solve, findBoundingBox)
+// runs on one pool for the whole process, not on the jobs' own threads. The thread that calls it
+// works as well and is already counted in its job, so the pool only gets what the running jobs
+// leave of the budget, and nothing at all when they hold all of it.
+void JobDaemon::shareParallelThreads() {
+    cv::setNumThreads(std::max(1, 1 + threadBudget - threadsInUse));
+}
+
+QString JobDaemon::status() const {
+    QStringList lines;
+    for (JobMap::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        const Job* job = it->second;
+        lines << jobLine(job->id, QString("\"type\":%1,\"state\":\"%2\",\"priority\":%3,\"threads\":%4")
+                         .arg(quoted(job->type)).arg(job->running ? "running" : "queued")
+                         .arg(job->priority).arg(job->threads));
+    }
+    lines << QString("{\"threads\":%1,\"budget\":%2}").arg(threadsInUse).arg(threadBudget);
+    return lines.join("\n");
+}
+
+QString JobDaemon::cancel(int id) {
+    JobMap::iterator it = jobs.find(id);
+    if (it == jobs.end()) return errorLine(QString("no job %1").arg(id));
+    Job* job = it->second;
+
+    if (!job->running) {
+        jobs.erase(it);
+        delete job->worker;
+        delete job;
+        return jobLine(id, "\"state\":\"cancelled\"");
+    }
+    // it stops at its next check, jobFinished() reports it and frees its threads
+    if (ImageStitcher* stitcher = qobject_cast<ImageStitcher*>(job->worker)) {
+        stitcher->cancel();
+    } else {
+        qobject_cast<RecognitionJob*>(job->worker)->cancel();
+    }
+    return jobLine(id, "\"state\":\"cancelling\"");
+}
+
+JobDaemon::Job* JobDaemon::jobOf(QObject* worker) const {
+    for (JobMap::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        if (it->second->worker == worker) return it->second;
+    }
+    return NULL;
+}
+
+void JobDaemon::send(const Job* job, const QString &line) const {
+    if (!job->client) return;
+    job->client->write((line + "\n").toUtf8());
+    job->client->flush();
+}
+
+void JobDaemon::stitchingUpdate(StitchingUpdate data) {
+    Job* job = jobOf(sender());
+    if (!job) return;
+    // only the progress, the images stay unrendered
+    send(job, jobLine(job->id, QString("\"progress\":%1,\"total\":%2").arg(data->curIndex).arg(data->totalImages)));
+}
+
+void JobDaemon::stitchingFinished(bool success) {
+    Job* job = jobOf(sender());
+    if (job) job->success = success;
+}
+
+void JobDaemon::imageRecognized(QString image, bool success, QString targets) {
+    Job* job = jobOf(sender());
+    if (!job) return;
+    QString fields = QString("\"image\":%1,\"success\":%2").arg(quoted(image), success ? "true" : "false");
+    if (success) {
+        fields += ",\"targets\":" + targets;
+    }
+    send(job, jobLine(job->id, fields));
+}
+
+void JobDaemon::recognitionFinished(bool success) {
+    Job* job = jobOf(sender());
+    if (job) job->success = success;
+}
+
+void JobDaemon::jobFinished() {
+    Job* job = jobOf(sender());
+    if (!job) return;
+    send(job, jobLine(job->id, QString("\"state\":\"finished\",\"success\":%1").arg(job->success ? "true" : "false")));
+    jobs.erase(job->id);
+    threadsInUse -= job->threads;
+    shareParallelThreads();
+    // the thread is done, this frees whatever the job still held
+    job->worker->deleteLater();
+    delete job;
+    schedule();
+}
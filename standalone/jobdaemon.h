@@ -0,0 +1,114 @@
+#ifndef JOBDAEMON_H
+#define JOBDAEMON_H
+
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutex>
+#include <QPointer>
+#include <QStringList>
+#include <QThread>
+
+#include <map>
+
+#include "imagestitcher.h"
+
+// Runs the object recognizer over a set of images, up to threads of them at once. The
+// telemetry of each image is looked up in metaDataFile and the annotated results are
+// written to outputDir under the image's name.
+class RecognitionJob : public QThread
+{
+    Q_OBJECT
+public:
+    RecognitionJob(const QStringList &images, const QString &metaDataFile, const QString &outputDir, int threads,
+                   QObject *parent = 0);
+    // the images not started yet are skipped
+    void cancel();
+    bool isCancelled() const;
+
+signals:
+    // targets is a JSON array of what was found, empty if the image could not be recognized
+    void imageRecognized(QString image, bool success, QString targets);
+    // the last thing the thread does, success is false if any image failed or it was cancelled
+    void recognitionFinished(bool success);
+
+protected:
+    void run();
+
+private:
+    class ImageTask;
+    friend class ImageTask;
+    void recognize(const QString &image);
+
+    const QStringList images;
+    const QString metaDataFile;
+    const QString outputDir;
+    const int threads;
+    mutable QMutex lock;
+    bool cancelled;     // protected by lock
+    int failures;       // protected by lock
+};
+
+// Takes stitching and recognition jobs over a local socket and runs as many of them at
+// once as its thread budget allows, so one box can work through several flights without
+// paying the start up of IS and OR for each. One command per line:
+//
+//   stitch <dir> [algorithm] [metaDataFile] [IS options] [--priority=N] [--threads=N] [--out=prefix]
+//   recognize <metaDataFile> <image>... [--priority=N] [--threads=N] [--out=dir]
+//   status
+//   cancel <job>
+//
+// The reply, and everything a job reports after it, comes back on the connection that sent
+// the command as one JSON object per line. Queued jobs start highest priority first (then
+// in the order they came) once their threads fit in what the running jobs leave of the
+// budget, a job asking for more than the whole budget gets all of it. Paths can't contain
+// spaces.
+class JobDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    explicit JobDaemon(int threadBudget, QObject *parent = 0);
+    ~JobDaemon();   // cancels every job and waits for the running ones
+    bool listen(const QString &socketName);
+
+private slots:
+    void newConnection();
+    void readCommands();
+    void stitchingUpdate(StitchingUpdate data);
+    void stitchingFinished(bool success);
+    void imageRecognized(QString image, bool success, QString targets);
+    void recognitionFinished(bool success);
+    void jobFinished();
+
+private:
+    struct Job {
+        Job() : id(0), priority(0), threads(1), worker(NULL), running(false), success(false) {}
+        int id;
+        QString type;           // "stitch" or "recognize"
+        int priority;
+        int threads;
+        QThread* worker;        // an ImageStitcher or a RecognitionJob, not started while queued
+        QPointer<QLocalSocket> client;  // null once it has gone, the job carries on
+        bool running;
+        bool success;
+    };
+    typedef std::map<int, Job*> JobMap;
+
+    QString runCommand(QLocalSocket* client, const QStringList &words);
+    QString submitStitch(QLocalSocket* client, const QStringList &args);
+    QString submitRecognition(QLocalSocket* client, const QStringList &args);
+    QString submit(Job* job);
+    QString status() const;
+    QString cancel(int id);
+    void schedule();
+    void shareParallelThreads();
+    Job* jobOf(QObject* worker) const;
+    void send(const Job* job, const QString &line) const;
+
+    QLocalServer server;
+    JobMap jobs;        // queued and running, by id
+    const int threadBudget;
+    int threadsInUse;
+    int nextId;
+};
+
+#endif // JOBDAEMON_H
@@ -0,0 +1,347 @@
+#include "matchfilter.h"
+#include "hammingmatcher.h"
+#include "sharedfunctions.h"
+#include "warpcomposite.h"
+#include "mosaiccanvas.h"
+#include "mosaicexporter.h"
+#include <iostream>
+
+#include <QDir>
+#include <QFile>
+
+#include <tiffio.h>
+
+using namespace cv;
+
+// Times the optimised paths against the code they replaced on synthetic data, and checks both
+// give the same answer. Also checks that the exported COG opens in libtiff. Exits with 1 if any
+// of them fails.
+
+const int MATCHES = 8000;       // ORB keeps up to a few thousand per image, FULL matches against more
+const int FILTER_RUNS = 200;
+const int DESCRIPTORS = 5000;   // ORB descriptors on each side
+const int MATCHER_RUNS = 5;
+const int CANVAS_SIZE = 10000;  // a mosaic of a few dozen frames
+const int BOUNDS_RUNS = 3;
+
+double msSince(int64 start) {
+	return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+// ImageStitcher::pruneMatches as it was before MatchFilter, without the logging
+std::vector<DMatch> referencePrune(const std::vector<DMatch>& allMatches,
+		const std::vector<KeyPoint>& keypoints_object, const std::vector<KeyPoint>& keypoints_scene,
+		double angleThreshold, double distanceThreshold, double heuristicThreshold) {
+	std::vector< DMatch > good_matches;
+	double distanceMin = 100.0;
+	for (unsigned i = 0; i < allMatches.size(); i++) {
+		if (allMatches[i].distance < distanceMin) distanceMin = allMatches[i].distance;
+	}
+	std::vector<DMatch> matches;
+	for (unsigned i = 0; i < allMatches.size(); i++) {
+		if (allMatches[i].distance <= heuristicThreshold * distanceMin) matches.push_back(allMatches[i]);
+	}
+
+	double angleMean = 0.0;
+	double lengthsMean = 0.0;
+	std::vector< double > angles;
+	std::vector< double > lengths;
+	for (unsigned i = 0; i < matches.size(); i++) {
+		double x1 = keypoints_object[matches[i].queryIdx].pt.x;
+		double y1 = keypoints_object[matches[i].queryIdx].pt.y;
+		double x2 = keypoints_scene [matches[i].trainIdx].pt.x;
+		double y2 = keypoints_scene [matches[i].trainIdx].pt.y;
+		double angle = atan2(y2 - y1, x2 - x1);
+		angles.push_back(angle);
+		angleMean += angle;
+		double euDistance = std::sqrt(std::pow(x1 - x2, 2) + std::pow(y1 - y2, 2));
+		lengths.push_back(euDistance);
+		lengthsMean += euDistance;
+	}
+	angleMean /= matches.size();
+	lengthsMean /= matches.size();
+
+	double angleStdDev = 0.0;
+	double lengthsStdDev = 0.0;
+	for (unsigned i = 0; i < matches.size(); i++) {
+		angleStdDev += (angles[i] - angleMean) * (angles[i] - angleMean);
+		lengthsStdDev += (lengths[i] - lengthsMean) * (lengths[i] - lengthsMean);
+	}
+	angleStdDev = sqrt(angleStdDev / matches.size());
+	lengthsStdDev = sqrt(lengthsStdDev / matches.size());
+
+	for (unsigned i = 0; i < matches.size(); i++) {
+		if (angles[i] > angleMean + angleStdDev * angleThreshold ||
+			angles[i] < angleMean - angleStdDev * angleThreshold) continue;
+		if (lengths[i] > lengthsMean + lengthsStdDev * distanceThreshold ||
+			lengths[i] < lengthsMean - lengthsStdDev * distanceThreshold) continue;
+		good_matches.push_back(matches[i]);
+	}
+	return good_matches;
+}
+
+bool sameMatches(const std::vector<DMatch> &a, const std::vector<DMatch> &b) {
+	if (a.size() != b.size()) return false;
+	for (unsigned i = 0; i < a.size(); i++) {
+		if (a[i].queryIdx != b[i].queryIdx || a[i].trainIdx != b[i].trainIdx || a[i].distance != b[i].distance) return false;
+	}
+	return true;
+}
+
+// Most matches move the keypoint by about the same shift, the rest are random pairs with worse
+// Hamming distances, as ORB matches between two overlapping frames look
+void syntheticMatches(int count, std::vector<KeyPoint> &object, std::vector<KeyPoint> &scene, std::vector<DMatch> &matches) {
+	RNG rng(1234);
+	object.clear();
+	scene.clear();
+	matches.clear();
+	for (int i = 0; i < count; i++) {
+		Point2f from(rng.uniform(0.f, 1280.f), rng.uniform(0.f, 960.f));
+		bool inlier = rng.uniform(0, 5) != 0;
+		Point2f to = inlier ? from + Point2f(120.f + (float)rng.gaussian(2.0), -40.f + (float)rng.gaussian(2.0))
+		                    : Point2f(rng.uniform(0.f, 1280.f), rng.uniform(0.f, 960.f));
+		object.push_back(KeyPoint(from, 31.f));
+		scene.push_back(KeyPoint(to, 31.f));
+		matches.push_back(DMatch(i, i, (float)(inlier ? rng.uniform(20, 60) : rng.uniform(40, 100))));
+	}
+}
+
+bool benchMatchFilter() {
+	std::vector<KeyPoint> object, scene;
+	std::vector<DMatch> matches;
+	syntheticMatches(MATCHES, object, scene, matches);
+	const double angle = 1.5, length = 3, heuristic = 3;
+
+	std::vector<DMatch> expected;
+	int64 start = getTickCount();
+	for (int run = 0; run < FILTER_RUNS; run++) {
+		expected = referencePrune(matches, object, scene, angle, length, heuristic);
+	}
+	double referenceMs = msSince(start) / FILTER_RUNS;
+
+	std::vector<DMatch> kept;
+	start = getTickCount();
+	for (int run = 0; run < FILTER_RUNS; run++) {
+		MatchFilter filter(matches, object, scene);
+		kept = filter.filter(angle, length, heuristic);
+	}
+	double filterMs = msSince(start) / FILTER_RUNS;
+
+	// the same matches filtered again, as step mode does every time the thresholds move
+	MatchFilter filter(matches, object, scene);
+	start = getTickCount();
+	for (int run = 0; run < FILTER_RUNS; run++) {
+		filter.filter(angle, length, heuristic);
+	}
+	double refilterMs = msSince(start) / FILTER_RUNS;
+
+	bool same = sameMatches(expected, kept);
+	std::cout << "MatchFilter, " << MATCHES << " ORB matches, " << (MatchFilter::usingAvx2() ? "AVX2" : "scalar") << "\n";
+	std::cout << "  pruneMatches before " << referenceMs << " ms, MatchFilter " << filterMs << " ms, "
+	          << "filter() again " << refilterMs << " ms, " << kept.size() << " kept"
+	          << (same ? "" : ", DIFFERENT from pruneMatches") << "\n";
+	return same;
+}
+
+bool sameNeighbours(const std::vector< std::vector<DMatch> > &a, const std::vector< std::vector<DMatch> > &b) {
+	if (a.size() != b.size()) return false;
+	for (unsigned i = 0; i < a.size(); i++) {
+		if (!sameMatches(a[i], b[i])) return false;
+	}
+	return true;
+}
+
+// Half of the train descriptors are a query with a few bits flipped, the rest are random
+void syntheticDescriptors(int count, Mat &query, Mat &train) {
+	RNG rng(4321);
+	query.create(count, 32, CV_8U);
+	train.create(count, 32, CV_8U);
+	rng.fill(query, RNG::UNIFORM, 0, 256);
+	rng.fill(train, RNG::UNIFORM, 0, 256);
+	for (int i = 0; i < count; i += 2) {
+		int q = rng.uniform(0, count);
+		query.row(q).copyTo(train.row(i));
+		for (int flip = rng.uniform(0, 24); flip > 0; flip--) {
+			train.at<uchar>(i, rng.uniform(0, 32)) ^= (uchar)(1 << rng.uniform(0, 8));
+		}
+	}
+}
+
+// knnMatch of matcher, the time of one call and the result of the last
+double timeKnnMatch(DescriptorMatcher &matcher, const Mat &query, const Mat &train, int k,
+                    std::vector< std::vector<DMatch> > &matches) {
+	int64 start = getTickCount();
+	for (int run = 0; run < MATCHER_RUNS; run++) {
+		matcher.knnMatch(query, train, matches, k);
+	}
+	return msSince(start) / MATCHER_RUNS;
+}
+
+// BFMatcher only cross checks with k = 1, so that is what the cross checked runs compare
+bool benchHammingMatcher() {
+	Mat query, train;
+	syntheticDescriptors(DESCRIPTORS, query, train);
+	std::cout << "HammingMatcher, " << DESCRIPTORS << " x " << DESCRIPTORS << " ORB descriptors, "
+	          << HammingMatcher::kernelName() << " kernel\n";
+
+	bool passed = true;
+	for (int check = 0; check < 2; check++) {
+		bool crossCheck = check == 1;
+		int k = crossCheck ? 1 : 2;
+		BFMatcher bf(NORM_HAMMING, crossCheck);
+		HammingMatcher hamming(crossCheck);
+		std::vector< std::vector<DMatch> > expected, found;
+		double bfMs = timeKnnMatch(bf, query, train, k, expected);
+		double hammingMs = timeKnnMatch(hamming, query, train, k, found);
+		bool same = sameNeighbours(expected, found);
+		passed = passed && same;
+		std::cout << "  knnMatch k=" << k << (crossCheck ? " cross checked" : "") << ": BFMatcher " << bfMs
+		          << " ms, HammingMatcher " << hammingMs << " ms" << (same ? "" : ", DIFFERENT from BFMatcher") << "\n";
+	}
+	return passed;
+}
+
+// SharedFunctions::findBoundingBox as it was before, the largest outer contour of the gray image.
+// Threshold type 2 is THRESH_TRUNC, so every pixel that isn't black in gray ends up in the mask.
+Rect referenceBoundingBox(const Mat &inputImage) {
+	Mat gray;
+	cvtColor(inputImage, gray, CV_BGR2GRAY);
+	Mat mask;
+	std::vector< std::vector<Point> > contours;
+	threshold(gray, mask, 1.0, 255.0, CHAIN_APPROX_SIMPLE);
+	findContours(mask, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE);
+	double maxContourArea = 0.0;
+	unsigned maxContourIndex = 0;
+	for (unsigned i = 0; i < contours.size(); ++i) {
+		double a = contourArea(contours[i]);
+		if (a > maxContourArea) {
+			maxContourArea = a;
+			maxContourIndex = i;
+		}
+	}
+	return contours.empty() ? Rect() : boundingRect(contours[maxContourIndex]);
+}
+
+// One frame drawn on a black canvas, turned and tilted the way a frame off the drone lands on the
+// mosaic. No pixel of the frame is dark, so the gray contour and any channel non zero agree.
+bool benchBoundingBox() {
+	Mat frame(3000, 4000, CV_8UC3);
+	RNG rng(5678);
+	rng.fill(frame, RNG::UNIFORM, 32, 256);
+	Mat homography = (Mat_<double>(3, 3) << 1.6, -0.9, 3500,
+	                                        0.8, 1.5, 1200,
+	                                        0.00002, 0.00001, 1);
+	Mat canvas = Mat::zeros(CANVAS_SIZE, CANVAS_SIZE, CV_8UC3);
+	WarpComposite::draw(frame, homography, canvas);
+
+	Rect expected;
+	int64 start = getTickCount();
+	for (int run = 0; run < BOUNDS_RUNS; run++) {
+		expected = referenceBoundingBox(canvas);
+	}
+	double referenceMs = msSince(start) / BOUNDS_RUNS;
+
+	Rect found;
+	start = getTickCount();
+	for (int run = 0; run < BOUNDS_RUNS; run++) {
+		found = SharedFunctions::findBoundingBox(canvas);
+	}
+	double stripesMs = msSince(start) / BOUNDS_RUNS;
+
+	const int FOOTPRINT_RUNS = 100000;
+	Rect footprint;
+	start = getTickCount();
+	for (int run = 0; run < FOOTPRINT_RUNS; run++) {
+		footprint = SharedFunctions::findBoundingBox(frame.size(), homography);
+	}
+	double footprintMs = msSince(start) / FOOTPRINT_RUNS;
+
+	// the footprint is every pixel the warp can reach, the drawn pixels have to be inside it
+	bool same = expected == found;
+	bool inside = (found & footprint) == found;
+	std::cout << "findBoundingBox, " << CANVAS_SIZE << " x " << CANVAS_SIZE << " BGR canvas\n";
+	std::cout << "  gray and contours before " << referenceMs << " ms, stripes " << stripesMs << " ms"
+	          << (same ? "" : ", DIFFERENT from the contours") << "\n";
+	std::cout << "  from the homography " << footprintMs << " ms, " << footprint.width - found.width << " x "
+	          << footprint.height - found.height << " pixels bigger than what was drawn"
+	          << (inside ? "" : ", MISSES drawn pixels") << "\n";
+	return same && inside;
+}
+
+// A small mosaic through MosaicExporter::writeCog, then every directory and tile of it read back
+// with libtiff. The full resolution tiles have to be the canvas pixels, deflate and the predictor
+// are lossless.
+bool checkCogReadable() {
+	Mat frame(1100, 1300, CV_8UC3);
+	RNG rng(8765);
+	rng.fill(frame, RNG::UNIFORM, 1, 256);
+	MosaicCanvas canvas;
+	canvas.draw(frame, Mat::eye(3, 3, CV_64FC1));
+	Rect bounds = canvas.bounds();
+	Mat expected = canvas.renderScaled(bounds, 1.0);
+	Mat geoTransform = (Mat_<double>(2, 3) << 1e-5, 0, 10, 0, -1e-5, 50);
+	std::string path = (QDir::tempPath() + "/bench_cog.tif").toStdString();
+
+	std::cout << "COG, " << bounds.width << " x " << bounds.height << " mosaic read back with libtiff\n";
+	if (!MosaicExporter::writeCog(canvas, path, geoTransform)) {
+		std::cout << "  could not write " << path << "\n";
+		return false;
+	}
+	TIFF* tiff = TIFFOpen(path.c_str(), "r");
+	if (tiff == NULL) {
+		std::cout << "  libtiff could not open " << path << "\n";
+		QFile::remove(QString::fromStdString(path));
+		return false;
+	}
+	bool passed = true;
+	int directories = 0;
+	do {
+		uint32 width = 0, height = 0, tileWidth = 0, tileHeight = 0;
+		TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+		TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tileWidth);
+		TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tileHeight);
+		int across = (bounds.width + (1 << directories) - 1) >> directories;
+		int down = (bounds.height + (1 << directories) - 1) >> directories;
+		if ((int)width != across || (int)height != down || !TIFFIsTiled(tiff) || tileWidth == 0 || tileHeight == 0) {
+			std::cout << "  directory " << directories << " is " << width << " x " << height << ", expected "
+			          << across << " x " << down << " in tiles\n";
+			passed = false;
+			break;
+		}
+		Mat tile(tileHeight, tileWidth, CV_8UC3);
+		int tilesAcross = (width + tileWidth - 1) / tileWidth;
+		for (int t = 0; t < (int)TIFFNumberOfTiles(tiff); t++) {
+			if (TIFFReadEncodedTile(tiff, t, tile.data, tile.total() * tile.elemSize()) < 0) {
+				std::cout << "  tile " << t << " of directory " << directories << " doesn't decode\n";
+				passed = false;
+				continue;
+			}
+			if (directories != 0) continue;
+			Rect area = Rect((t % tilesAcross) * tileWidth, (t / tilesAcross) * tileHeight, tileWidth, tileHeight)
+			            & Rect(0, 0, width, height);
+			Mat pixels;
+			cvtColor(tile(Rect(0, 0, area.width, area.height)), pixels, CV_RGB2BGR);
+			Mat different = pixels != expected(area);
+			if (countNonZero(different.reshape(1)) != 0) {
+				std::cout << "  tile " << t << " isn't what the canvas has there\n";
+				passed = false;
+			}
+		}
+		directories++;
+	} while (passed && TIFFReadDirectory(tiff));
+	TIFFClose(tiff);
+	QFile::remove(QString::fromStdString(path));
+
+	std::cout << "  " << directories << " directories" << (passed ? ", every tile decodes" : "") << "\n";
+	return passed;
+}
+
+int main() {
+	bool passed = true;
+	passed = benchMatchFilter() && passed;
+	passed = benchHammingMatcher() && passed;
+	passed = benchBoundingBox() && passed;
+	passed = checkCogReadable() && passed;
+	return passed ? 0 : 1;
+}
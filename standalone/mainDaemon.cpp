@@ -0,0 +1,46 @@
+#include "jobdaemon.h"
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QString>
+
+void failOnArguments(std::string description) {
+	std::cout << "Invalid arguments. " << description << "\n";
+	std::cout << "Usage: ./visord [--socket=name] [--threads=N]\n";
+	std::cout << "--socket=name is the local socket jobs are sent to (visord by default)\n";
+	std::cout << "--threads=N is how many threads all running jobs may use together (all cores by default)\n";
+	std::cout << "Send it one command per line, for example with socat - UNIX-CONNECT:/tmp/visord\n";
+	std::cout << "  stitch <dir> [algorithm] [metaDataFile] [IS options] [--priority=N] [--threads=N] [--out=prefix]\n";
+	std::cout << "  recognize <metaDataFile> <image>... [--priority=N] [--threads=N] [--out=dir]\n";
+	std::cout << "  status\n";
+	std::cout << "  cancel <job>\n";
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	QCoreApplication app(argc, argv);
+
+	QString socketName = "visord";
+	int threads = QThread::idealThreadCount();
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--socket=", 9) == 0) {
+			socketName = QString(argv[i] + 9);
+		} else if (strncmp(argv[i], "--threads=", 10) == 0) {
+			threads = atoi(argv[i] + 10);
+		} else {
+			failOnArguments(std::string("Unknown option ") + argv[i]);
+		}
+	}
+
+	// where IS and OR put their results
+	QDir().mkpath("imageOutputIS");
+	QDir().mkpath("outputs");
+
+	qRegisterMetaType<StitchingUpdate>("StitchingUpdate");
+	JobDaemon daemon(threads);
+	if (!daemon.listen(socketName)) return 1;
+	return app.exec();
+}
@@ -22,29 +22,55 @@ void createDirs() {
 
 void failOnArguments(std::string description) {
         std::cout << "Invalid arguments. " <<  description << "\n";
-        std::cout << "Usage: imageInputDirectory algorithmType\n";
+        std::cout << "Usage: imageInputDirectory algorithmType metaDataFile\n";
         std::cout << "For example ./IS inputImageDir\n";
-	std::cout << "algorithm types include: CUMULATIVE COMPOUND REDUCE FULL\n";
+	std::cout << "algorithm types include: CUMULATIVE COMPOUND REDUCE FULL GLOBAL PHASE TRACKING\n";
+	std::cout << "PHASE places each image against the one before by phase correlation, without features\n";
+	std::cout << "TRACKING places each image against the one before from corners tracked into it, without matching\n";
 	std::cout << "if the algorithm type is omitted it will default to FULL\n";
+	std::cout << "if a meta data file is given its telemetry is used to predict where images overlap\n";
+	std::cout << "--memory=MB keeps at most MB megabytes of the mosaic in memory, the rest is compressed to the temp dir\n";
+	std::cout << "--cog=file.tif writes the final mosaic as a Cloud Optimized GeoTIFF instead of a JPEG per iteration\n";
+	std::cout << "--tiles=dir writes the final mosaic as z/x/y tiles under dir, --tile-format=png|jpg (png by default)\n";
+	std::cout << "--detector=SURF|ORB and --matcher=BRUTE_FORCE|FLANN|HAMMING pick the features (SURF and BRUTE_FORCE by default),\n";
+	std::cout << "ORB with FLANN matches through an LSH index, HAMMING is the exact SIMD matcher for ORB\n";
+	std::cout << "--cross-check keeps only mutual best matches with HAMMING\n";
+	std::cout << "--blend=multiband blends the seams once every image is placed, --bands=N (5 by default, 1 to 7)\n";
+	std::cout << "--ratio=R keeps a match only if it is closer than R times the second best, 0 turns the test off\n";
+	std::cout << "--feature-cache=dir keeps the detected features and matches in dir, running the same images again reuses them\n";
+	std::cout << "--estimator=prosac|ransac picks how homographies are found (prosac by default, ransac is OpenCV's)\n";
+	std::cout << "--model=select tries a similarity first and an affine map or homography only if the matches need one,\n";
+	std::cout << "for nadir frames (prosac only, --model=homography is the default)\n";
+	std::cout << "--phase-guess phase correlates each image with the one before to narrow the feature search (CUMULATIVE,\n";
+	std::cout << "COMPOUND and FULL), and places the image there if there are too few matches\n";
+	std::cout << "--features=N detects at most N keypoints per image, spread over a grid of cells detected in parallel\n";
         exit(1);
 }
 
-void parseArguments(int argc, char* argv[], QString* folderPath, ImageStitcher::AlgorithmType* type) {
-        if (argc != 2 && argc != 3) {
+// pulls the --name=value options out of argv, leaving the positional arguments
+void parseOptions(int* argc, char* argv[], StitchingOptions* options) {
+	int positional = 1;
+	for (int i = 1; i < *argc; i++) {
+		if (strncmp(argv[i], "--", 2) != 0) {
+			argv[positional++] = argv[i];
+		} else if (!parseStitchingOption(argv[i], options)) {
+			failOnArguments(std::string("Unknown or invalid option ") + argv[i]);
+		}
+	}
+	(*argc) = positional;
+}
+
+void parseArguments(int argc, char* argv[], QString* folderPath, ImageStitcher::AlgorithmType* type, QString* metaDataFile) {
+        if (argc < 2 || argc > 4) {
                 failOnArguments("Incorrect number of arguments.");
         }
 	(*type) = ImageStitcher::FULL_MATCHES;
 	(*folderPath) = QString(argv[1]);
-	if (argc == 3) {
-		if (strncmp(argv[2], "CUMULATIVE", 9) == 0) {
-			(*type) = ImageStitcher::CUMULATIVE;
-		} else if (strncmp(argv[2], "COMPOUND", 7) == 0) {
-			(*type) = ImageStitcher::COMPOUND_HOMOGRAPHY;
-		} else if (strncmp(argv[2], "REDUCE", 6) == 0) {
-			(*type) = ImageStitcher::REDUCE;
-		} else if (strncmp(argv[2], "FULL", 4) == 0) {
-			(*type) = ImageStitcher::FULL_MATCHES;
-		}
+	if (argc >= 3) {
+		parseAlgorithm(argv[2], type);
+	}
+	if (argc == 4) {
+		(*metaDataFile) = QString(argv[3]);
 	}
 }
 
@@ -54,9 +80,11 @@ int main(int argc, char* argv[]) {
 	
 	ImageStitcher::AlgorithmType algorithm;
 	QString folderPath;
-	parseArguments(argc, argv, &folderPath, &algorithm);
+	StitchingOptions options;
+	parseOptions(&argc, argv, &options);
+	parseArguments(argc, argv, &folderPath, &algorithm, &options.metaDataFile);
 
-	StitchingHandler handler(algorithm, folderPath, OUT_IMG_IS_DIR);
+	StitchingHandler handler(algorithm, folderPath, OUT_IMG_IS_DIR, options);
 	handler.run();
 
 	return 0;
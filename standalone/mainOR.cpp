@@ -54,8 +54,7 @@ int main(int argc, char* argv[]) {
     	objRec.imageScale = 1.0;
     	objRec.polyDPError = 0.03;
 
-	cv::Mat image = cv::imread(imageName, CV_LOAD_IMAGE_COLOR);
-	objRec.fullSizeInputImage = image;
+	objRec.loadInputImage(imageName);
 
 	RecognizerResults* results = objRec.recognizeObjects(input);
 
@@ -0,0 +1,241 @@
+#include "matchfilter.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MATCHFILTER_AVX2 1
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+
+namespace {
+
+// scale that makes the median absolute deviation comparable to a standard deviation
+const double MAD_TO_STDDEV = 1.4826;
+
+void geometryScalar(const float* x1, const float* y1, const float* x2, const float* y2,
+                    double* angles, double* lengths, int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        double dx = (double)x2[i] - x1[i];
+        double dy = (double)y2[i] - y1[i];
+        angles[i] = atan2(dy, dx);
+        lengths[i] = std::sqrt(dx * dx + dy * dy);
+    }
+}
+
+#ifdef MATCHFILTER_AVX2
+
+// atan of a in [0, 1], the rational approximation from Cephes (full double precision)
+__attribute__((target("avx2")))
+inline __m256d atanUnit(__m256d a) {
+    const __m256d one = _mm256_set1_pd(1.0);
+    // above 0.66 use atan(a) = pi/4 + atan((a - 1) / (a + 1))
+    __m256d large = _mm256_cmp_pd(a, _mm256_set1_pd(0.66), _CMP_GT_OQ);
+    __m256d x = _mm256_blendv_pd(a, _mm256_div_pd(_mm256_sub_pd(a, one), _mm256_add_pd(a, one)), large);
+    __m256d offset = _mm256_and_pd(large, _mm256_set1_pd(0.78539816339744830962));
+    __m256d correction = _mm256_and_pd(large, _mm256_set1_pd(0.5 * 6.123233995736765886130e-17));
+
+    __m256d z = _mm256_mul_pd(x, x);
+    __m256d p = _mm256_set1_pd(-8.750608600031904122785e-1);
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(-1.615753718733365076637e1));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(-7.500855792314704667340e1));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(-1.228866684490136173410e2));
+    p = _mm256_add_pd(_mm256_mul_pd(p, z), _mm256_set1_pd(-6.485021904942025371773e1));
+    __m256d q = _mm256_add_pd(z, _mm256_set1_pd(2.485846490142306297962e1));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(1.650270098316988542046e2));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(4.328810604912902668951e2));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(4.853903996359136964868e2));
+    q = _mm256_add_pd(_mm256_mul_pd(q, z), _mm256_set1_pd(1.945506571482613964425e2));
+    __m256d r = _mm256_add_pd(_mm256_mul_pd(x, _mm256_div_pd(_mm256_mul_pd(z, p), q)), x);
+    return _mm256_add_pd(offset, _mm256_add_pd(r, correction));
+}
+
+// atan2 folded onto [0, 1] and unfolded again by octant
+__attribute__((target("avx2")))
+inline __m256d atan2Avx2(__m256d y, __m256d x) {
+    const __m256d signMask = _mm256_set1_pd(-0.0);
+    __m256d ax = _mm256_andnot_pd(signMask, x);
+    __m256d ay = _mm256_andnot_pd(signMask, y);
+    __m256d big = _mm256_max_pd(ax, ay);
+    __m256d small = _mm256_min_pd(ax, ay);
+    __m256d zero = _mm256_cmp_pd(big, _mm256_setzero_pd(), _CMP_EQ_OQ);
+    __m256d ratio = _mm256_andnot_pd(zero, _mm256_div_pd(small, _mm256_blendv_pd(big, _mm256_set1_pd(1.0), zero)));
+
+    __m256d r = atanUnit(ratio);
+    __m256d steep = _mm256_cmp_pd(ay, ax, _CMP_GT_OQ);
+    r = _mm256_blendv_pd(r, _mm256_sub_pd(_mm256_set1_pd(1.57079632679489661923), r), steep);
+    __m256d left = _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ);
+    r = _mm256_blendv_pd(r, _mm256_sub_pd(_mm256_set1_pd(3.14159265358979323846), r), left);
+    // the sign of y, which is also right for atan2(-0, x)
+    return _mm256_or_pd(r, _mm256_and_pd(y, signMask));
+}
+
+__attribute__((target("avx2")))
+void geometryAvx2(const float* x1, const float* y1, const float* x2, const float* y2,
+                  double* angles, double* lengths, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(x2 + i)), _mm256_cvtps_pd(_mm_loadu_ps(x1 + i)));
+        __m256d dy = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(y2 + i)), _mm256_cvtps_pd(_mm_loadu_ps(y1 + i)));
+        _mm256_storeu_pd(angles + i, atan2Avx2(dy, dx));
+        _mm256_storeu_pd(lengths + i, _mm256_sqrt_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy))));
+    }
+    geometryScalar(x1, y1, x2, y2, angles, lengths, i, count);
+}
+
+#endif
+
+// centre and spread of values, median and scaled MAD. values gets reordered.
+void medianDeviation(std::vector<double> &values, double &median, double &deviation) {
+    size_t middle = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    median = values[middle];
+    for (unsigned i = 0; i < values.size(); i++) {
+        values[i] = std::abs(values[i] - median);
+    }
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    deviation = values[middle] * MAD_TO_STDDEV;
+}
+
+}
+
+MatchFilter::MatchFilter() : distanceMin(100.0)
+{
+}
+
+MatchFilter::MatchFilter(const std::vector<DMatch> &matches,
+                         const std::vector<KeyPoint> &keypoints_object, const std::vector<KeyPoint> &keypoints_scene)
+    : distanceMin(100.0)
+{
+    setMatches(matches, keypoints_object, keypoints_scene);
+}
+
+void MatchFilter::clear() {
+    matches.clear();
+    objectX.clear();
+    objectY.clear();
+    sceneX.clear();
+    sceneY.clear();
+    angles.clear();
+    lengths.clear();
+    distanceMin = 100.0;
+}
+
+int MatchFilter::size() const {
+    return matches.size();
+}
+
+const DMatch& MatchFilter::match(int i) const {
+    return matches[i];
+}
+
+double MatchFilter::angle(int i) const {
+    return angles[i];
+}
+
+double MatchFilter::length(int i) const {
+    return lengths[i];
+}
+
+double MatchFilter::minDistance() const {
+    return distanceMin;
+}
+
+bool MatchFilter::usingAvx2() {
+#ifdef MATCHFILTER_AVX2
+    static bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void MatchFilter::setMatches(const std::vector<DMatch> &allMatches,
+                             const std::vector<KeyPoint> &keypoints_object, const std::vector<KeyPoint> &keypoints_scene) {
+    matches = allMatches;
+    int count = matches.size();
+    objectX.resize(count);
+    objectY.resize(count);
+    sceneX.resize(count);
+    sceneY.resize(count);
+    // distance is the opencv score so the best match is the minimum, never above 100 as it always was
+    distanceMin = 100.0;
+    for (int i = 0; i < count; i++) {
+        const Point2f &object = keypoints_object[matches[i].queryIdx].pt;
+        const Point2f &scene = keypoints_scene[matches[i].trainIdx].pt;
+        objectX[i] = object.x;
+        objectY[i] = object.y;
+        sceneX[i] = scene.x;
+        sceneY[i] = scene.y;
+        if (matches[i].distance < distanceMin) distanceMin = matches[i].distance;
+    }
+    computeGeometry();
+}
+
+void MatchFilter::computeGeometry() {
+    int count = matches.size();
+    angles.resize(count);
+    lengths.resize(count);
+    if (count == 0) return;
+#ifdef MATCHFILTER_AVX2
+    if (usingAvx2()) {
+        geometryAvx2(&objectX[0], &objectY[0], &sceneX[0], &sceneY[0], &angles[0], &lengths[0], count);
+        return;
+    }
+#endif
+    geometryScalar(&objectX[0], &objectY[0], &sceneX[0], &sceneY[0], &angles[0], &lengths[0], 0, count);
+}
+
+std::vector<DMatch> MatchFilter::filter(double angleThreshold, double distanceThreshold, double heuristicThreshold,
+                                        Statistics statistics) const {
+    std::vector< DMatch > good_matches;
+    double maxDistance = heuristicThreshold * distanceMin;
+
+    // one pass for the mean and variance of both (Welford), population variance as before
+    int n = 0;
+    double angleMean = 0.0, angleM2 = 0.0;
+    double lengthMean = 0.0, lengthM2 = 0.0;
+    for (unsigned i = 0; i < matches.size(); i++) {
+        if (matches[i].distance > maxDistance) continue;
+        n++;
+        double angleDelta = angles[i] - angleMean;
+        angleMean += angleDelta / n;
+        angleM2 += angleDelta * (angles[i] - angleMean);
+        double lengthDelta = lengths[i] - lengthMean;
+        lengthMean += lengthDelta / n;
+        lengthM2 += lengthDelta * (lengths[i] - lengthMean);
+    }
+    if (n == 0) return good_matches;
+
+    double angleCentre = angleMean;
+    double angleStdDev = sqrt(angleM2 / n);
+    double lengthCentre = lengthMean;
+    double lengthStdDev = sqrt(lengthM2 / n);
+    if (statistics == MEDIAN_MAD) {
+        std::vector< double > kept;
+        kept.reserve(n);
+        for (unsigned i = 0; i < matches.size(); i++) {
+            if (matches[i].distance <= maxDistance) kept.push_back(angles[i]);
+        }
+        medianDeviation(kept, angleCentre, angleStdDev);
+        kept.clear();
+        for (unsigned i = 0; i < matches.size(); i++) {
+            if (matches[i].distance <= maxDistance) kept.push_back(lengths[i]);
+        }
+        medianDeviation(kept, lengthCentre, lengthStdDev);
+    }
+
+    double angleLow = angleCentre - angleStdDev * angleThreshold;
+    double angleHigh = angleCentre + angleStdDev * angleThreshold;
+    double lengthLow = lengthCentre - lengthStdDev * distanceThreshold;
+    double lengthHigh = lengthCentre + lengthStdDev * distanceThreshold;
+    good_matches.reserve(n);
+    for (unsigned i = 0; i < matches.size(); i++) {
+        if (matches[i].distance > maxDistance) continue;
+        if (angles[i] > angleHigh || angles[i] < angleLow) continue;
+        if (lengths[i] > lengthHigh || lengths[i] < lengthLow) continue;
+        good_matches.push_back(matches[i]);
+    }
+    return good_matches;
+}
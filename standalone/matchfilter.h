@@ -0,0 +1,53 @@
+#ifndef MATCHFILTER_H
+#define MATCHFILTER_H
+
+#include <opencv2/opencv.hpp>
+
+// The match pruning of ImageStitcher::pruneMatches split in two: the geometry of every
+// match (the angle and length of the line from the object keypoint to the scene one) is
+// worked out once when the matches are set, then filtering with different thresholds
+// only has to redo the statistics. The keypoint coordinates are gathered into flat
+// arrays and the geometry is computed four matches at a time with AVX2 where the CPU
+// has it.
+class MatchFilter
+{
+public:
+    enum Statistics {
+        MEAN_STDDEV,    // what pruneMatches has always used
+        MEDIAN_MAD      // median and scaled median absolute deviation, not dragged around by outliers
+    };
+
+    MatchFilter();
+    MatchFilter(const std::vector<cv::DMatch> &matches,
+                const std::vector<cv::KeyPoint> &keypoints_object, const std::vector<cv::KeyPoint> &keypoints_scene);
+    void setMatches(const std::vector<cv::DMatch> &matches,
+                    const std::vector<cv::KeyPoint> &keypoints_object, const std::vector<cv::KeyPoint> &keypoints_scene);
+    void clear();
+    int size() const;
+    const cv::DMatch& match(int i) const;
+    // what filter() thresholds: the angle and length of the line of match i, and the best score
+    double angle(int i) const;
+    double length(int i) const;
+    double minDistance() const;
+
+    // Matches scoring within heuristicThreshold times the best score, then of those the ones whose
+    // angle and length are within angleThreshold and distanceThreshold deviations of the centre
+    std::vector<cv::DMatch> filter(double angleThreshold, double distanceThreshold, double heuristicThreshold,
+                                   Statistics statistics = MEAN_STDDEV) const;
+
+    static bool usingAvx2();
+
+private:
+    void computeGeometry();
+
+    std::vector<cv::DMatch> matches;
+    std::vector<float> objectX;     // one entry per match
+    std::vector<float> objectY;
+    std::vector<float> sceneX;
+    std::vector<float> sceneY;
+    std::vector<double> angles;
+    std::vector<double> lengths;
+    double distanceMin;
+};
+
+#endif // MATCHFILTER_H
@@ -0,0 +1,83 @@
+#ifndef MOSAICCANVAS_H
+#define MOSAICCANVAS_H
+
+#include <opencv2/opencv.hpp>
+
+#include "tilestore.h"
+
+// A read-only view of part of the canvas as it was when it was taken. Taking one copies no
+// pixels, it shares the tiles and the canvas copies a tile before drawing on it again while a
+// snapshot still holds it. Snapshots can be copied and rendered from any thread.
+class MosaicSnapshot
+{
+public:
+    MosaicSnapshot();
+    bool empty() const;
+    // canvas coordinates
+    cv::Rect bounds() const;
+    // copy of the snapshot, black where nothing had been drawn, shrunk by scale when it is below 1
+    cv::Mat render(double scale = 1.0) const;
+
+private:
+    friend class MosaicCanvas;
+    struct Tile {
+        cv::Rect rect;
+        cv::Mat pixels;                         // empty if only the compressed copy was around
+        QSharedPointer<MappedTile> compressed;
+    };
+
+    std::vector<Tile> tiles;
+    cv::Rect region;
+    int type;
+};
+
+// The mosaic as a sparse grid of fixed size tiles. Tiles are only allocated once
+// something is drawn on them and the grid extends in every direction (tile indices
+// can be negative) so the origin stays where it was, growing the mosaic never pads
+// or copies what is already there. Drawing an image only touches the tiles it covers.
+// With a memory budget the tiles that haven't been used for a while are compressed out
+// of memory (see TileStore), recently drawn regions stay resident.
+class MosaicCanvas
+{
+public:
+    enum { TILE_SIZE = 512 };
+
+    explicit MosaicCanvas(int type = CV_8UC3);
+    void clear();
+    bool empty() const;
+    int numTiles() const;
+    int numResidentTiles() const;
+    // 0 keeps every tile in memory, directory is where evicted tiles go (temp dir if empty)
+    void setMemoryBudget(size_t bytes, const QString &directory = QString());
+    size_t memoryBudget() const;
+    // everything drawn so far, canvas coordinates
+    cv::Rect bounds() const;
+
+    // Warps image onto the canvas with homography (image -> canvas coordinates), on top of
+    // what is there. Pixels outside the image are left alone. Returns the bounds written.
+    cv::Rect draw(const cv::Mat &image, const cv::Mat &homography);
+
+    // Copies pixels over the canvas with their top left at origin. Only tiles something has been
+    // drawn on are written, the rest of pixels is expected to be black.
+    void write(const cv::Mat &pixels, cv::Point origin);
+
+    // copy of region, black where nothing has been drawn
+    cv::Mat render(const cv::Rect &region);
+    cv::Mat render();
+    // region shrunk by scale, put together one tile at a time so only the result is ever whole
+    cv::Mat renderScaled(const cv::Rect &region, double scale);
+    // region as it is now, to render later (see MosaicSnapshot)
+    MosaicSnapshot snapshot(const cv::Rect &region) const;
+    MosaicSnapshot snapshot() const;
+
+private:
+    typedef TileStore::TileIndex TileIndex;
+
+    static int tileIndexOf(int coordinate);
+
+    TileStore tiles;
+    cv::Rect contentBounds;
+    int type;
+};
+
+#endif // MOSAICCANVAS_H
@@ -0,0 +1,33 @@
+#ifndef MOSAICEXPORTER_H
+#define MOSAICEXPORTER_H
+
+#include <string>
+#include <opencv2/opencv.hpp>
+
+#include "mosaiccanvas.h"
+
+// Writes a finished mosaic out as tiled multi-resolution pyramids. The canvas is read a
+// strip of output tiles at a time and each strip's tiles are encoded in parallel, the
+// whole mosaic is never put together in memory.
+class MosaicExporter
+{
+public:
+    // Cloud optimized GeoTIFF: 512x512 deflate compressed tiles with internal overviews down
+    // to a single tile, the image directories up front and the smallest overview's tiles first.
+    // geoTransform (2x3, CV_64F) takes (column, row) of the full resolution image to
+    // (longitude, latitude) in WGS84, leave it empty to write a plain tiled TIFF.
+    static bool writeCog(MosaicCanvas &canvas, const std::string &path, const cv::Mat &geoTransform);
+
+    // directory/z/x/y.extension tiles, 256x256, with the highest zoom at full resolution and
+    // every zoom below half the one above (a pixel pyramid, no reprojection). Tiles with
+    // nothing on them are skipped. extension is anything imwrite knows ("png", "jpg").
+    static bool writeTiles(MosaicCanvas &canvas, const std::string &directory, const std::string &extension);
+
+    // least squares affine taking pixels to lonLat, empty if there are fewer than 3 points
+    static cv::Mat fitGeoTransform(const std::vector<cv::Point2f> &pixels, const std::vector<cv::Point2d> &lonLat);
+
+private:
+    MosaicExporter();   // the methods are all static so there is no need to instantiate this class
+};
+
+#endif // MOSAICEXPORTER_H
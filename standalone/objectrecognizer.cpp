@@ -1,5 +1,6 @@
 #include "objectrecognizer.h"
 #include "sharedfunctions.h"
+#include "imageloader.h"
 
 //The following allows us to use M_PI in visual studio
 #define _USE_MATH_DEFINES
@@ -12,11 +13,17 @@
 
 using namespace cv;
 
-ObjectRecognizer::ObjectRecognizer()
+ObjectRecognizer::ObjectRecognizer() : loadedScale(0.0)
 {
 
 }
 
+void ObjectRecognizer::loadInputImage(const std::string &path) {
+    inputImagePath = path;
+    fullSizeInputImage.release();
+    inputImage.release();
+}
+
 std::vector<double> getSideLengths(const std::vector<cv::Point>& vertices) {
 	std::vector<double> lengths;
 	if (vertices.size() < 3) {
@@ -146,9 +153,16 @@ void overlayExtraData(double lat, double lon, double area, std::vector<std::vect
 
 RecognizerResults *ObjectRecognizer::recognizeObjects(TelemetryInputs ti) {
     RecognizerResults *results = new RecognizerResults();
-    if (fullSizeInputImage.empty()) return results; // otherwise it will crash.
-
-    cv::resize(fullSizeInputImage, inputImage, Size(), imageScale, imageScale, INTER_AREA);
+    if (!inputImagePath.empty()) {
+        if (inputImage.empty() || loadedScale != imageScale) {
+            inputImage = ImageLoader::loadScaled(inputImagePath, imageScale);
+            loadedScale = imageScale;
+        }
+        if (inputImage.empty()) return results;
+    } else {
+        if (fullSizeInputImage.empty()) return results; // otherwise it will crash.
+        cv::resize(fullSizeInputImage, inputImage, Size(), imageScale, imageScale, INTER_AREA);
+    }
 
     inputImage.copyTo(results->input);
 
@@ -0,0 +1,127 @@
+#include "phasecorrelator.h"
+
+using namespace cv;
+
+namespace {
+
+const int MIN_SIZE = 32;
+const double MIN_RESPONSE = 0.1;    // unrelated images peak well below this
+
+// puts the zero frequency in the middle, size is even
+void centreSpectrum(Mat &spectrum) {
+    int cx = spectrum.cols / 2;
+    int cy = spectrum.rows / 2;
+    Mat q0(spectrum, Rect(0, 0, cx, cy));
+    Mat q1(spectrum, Rect(cx, 0, cx, cy));
+    Mat q2(spectrum, Rect(0, cy, cx, cy));
+    Mat q3(spectrum, Rect(cx, cy, cx, cy));
+    Mat tmp;
+    q0.copyTo(tmp);
+    q3.copyTo(q0);
+    tmp.copyTo(q3);
+    q1.copyTo(tmp);
+    q2.copyTo(q1);
+    tmp.copyTo(q2);
+}
+
+}
+
+PhaseCorrelator::PhaseCorrelator(int size) : size(std::max(MIN_SIZE, size & ~1))
+{
+    createHanningWindow(window, Size(this->size, this->size), CV_32F);
+
+    // Reddy and Chatterji's high-pass, 0 at the centre of the spectrum and 1 towards its edges
+    highPass.create(this->size, this->size, CV_32FC1);
+    for (int y = 0; y < this->size; y++) {
+        double cy = std::cos(CV_PI * ((double)y / this->size - 0.5));
+        for (int x = 0; x < this->size; x++) {
+            double m = cy * std::cos(CV_PI * ((double)x / this->size - 0.5));
+            highPass.at<float>(y, x) = (float)((1.0 - m) * (2.0 - m));
+        }
+    }
+
+    // The spectrum of a real image is symmetric, the rows only need to go half way round
+    double centre = this->size / 2.0;
+    logBase = std::log(centre) / this->size;
+    mapX.create(this->size, this->size, CV_32FC1);
+    mapY.create(this->size, this->size, CV_32FC1);
+    for (int a = 0; a < this->size; a++) {
+        double angle = CV_PI * a / this->size;
+        for (int r = 0; r < this->size; r++) {
+            double radius = std::exp(r * logBase);
+            mapX.at<float>(a, r) = (float)(centre + radius * std::cos(angle));
+            mapY.at<float>(a, r) = (float)(centre + radius * std::sin(angle));
+        }
+    }
+}
+
+PhaseCorrelator::Frame PhaseCorrelator::prepare(const Mat &gray) const {
+    Frame frame;
+    if (gray.empty()) return frame;
+    frame.scale = (double)size / std::max(gray.cols, gray.rows);
+    Mat small;
+    resize(gray, small, Size(std::max(1, cvRound(gray.cols * frame.scale)), std::max(1, cvRound(gray.rows * frame.scale))),
+           0, 0, INTER_AREA);
+    small.convertTo(frame.small, CV_32F);
+    // no step between the image and the empty border warpAffine leaves around it later
+    frame.small -= mean(frame.small);
+
+    int side = std::min(frame.small.cols, frame.small.rows);
+    Mat square;
+    resize(frame.small(Rect((frame.small.cols - side) / 2, (frame.small.rows - side) / 2, side, side)), square,
+           Size(size, size), 0, 0, INTER_LINEAR);
+    frame.spectrumScale = (double)size / side;
+    multiply(square, window, square);
+
+    Mat spectrum;
+    dft(square, spectrum, DFT_COMPLEX_OUTPUT);
+    Mat planes[2];
+    split(spectrum, planes);
+    Mat magnitudes;
+    magnitude(planes[0], planes[1], magnitudes);
+    centreSpectrum(magnitudes);
+    multiply(magnitudes, highPass, magnitudes);
+    remap(magnitudes, frame.logPolar, mapX, mapY, INTER_LINEAR);
+    return frame;
+}
+
+bool PhaseCorrelator::registerPair(const Frame &object, const Frame &scene, Mat &homography, double *response) const {
+    if (object.empty() || scene.empty()) return false;
+
+    // a shift along the angle rows is the rotation, along the log radius columns the scale
+    Point2d spectrumShift = phaseCorrelate(scene.logPolar, object.logPolar);
+    double angle = spectrumShift.y * 180.0 / size;
+    double scale = std::exp(spectrumShift.x * logBase) * object.spectrumScale / scene.spectrumScale;
+
+    // the spectrum can't tell a half turn apart, the shift peak can
+    Mat shiftWindow;
+    createHanningWindow(shiftWindow, scene.small.size(), CV_32F);
+    Point2f centre(object.small.cols / 2.0f, object.small.rows / 2.0f);
+    double bestResponse = -1;
+    Mat best;
+    for (int halfTurn = 0; halfTurn < 2; halfTurn++) {
+        Mat rotation = getRotationMatrix2D(centre, angle + 180.0 * halfTurn, scale);
+        Mat turned;
+        warpAffine(object.small, turned, rotation, scene.small.size());
+        double peak = 0;
+        Point2d shift = phaseCorrelateRes(turned, scene.small, shiftWindow, &peak);
+        if (peak <= bestResponse) continue;
+        bestResponse = peak;
+        best = Mat::eye(3, 3, CV_64FC1);
+        rotation.copyTo(best(Rect(0, 0, 3, 2)));
+        best.at<double>(0, 2) += shift.x;
+        best.at<double>(1, 2) += shift.y;
+    }
+    if (response) {
+        *response = bestResponse;
+    }
+    if (bestResponse < MIN_RESPONSE) return false;
+
+    // from full size object pixels to small, across, and back up to full size scene pixels
+    Mat toSmall = Mat::eye(3, 3, CV_64FC1);
+    toSmall.at<double>(0, 0) = toSmall.at<double>(1, 1) = object.scale;
+    Mat fromSmall = Mat::eye(3, 3, CV_64FC1);
+    fromSmall.at<double>(0, 0) = fromSmall.at<double>(1, 1) = 1.0 / scene.scale;
+    homography = fromSmall * best * toSmall;
+    return true;
+}
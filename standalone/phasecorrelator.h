@@ -0,0 +1,42 @@
+#ifndef PHASECORRELATOR_H
+#define PHASECORRELATOR_H
+
+#include <opencv2/opencv.hpp>
+
+// Registers two images that differ by a rotation, a scale and a shift (Fourier-Mellin). The
+// magnitude of an image's spectrum doesn't change with a shift, and resampled to log-polar
+// coordinates a rotation or scale of the image only moves it along one axis, so phaseCorrelate
+// of the two log-polar spectra gives rotation and scale. With the object turned and scaled to
+// match, phaseCorrelate of the images gives the shift. Everything runs on gray images scaled
+// down to size pixels on their long side and takes a few milliseconds, however little texture
+// the images have (they only need some).
+class PhaseCorrelator
+{
+public:
+    // what prepare() keeps of an image for registerPair()
+    struct Frame {
+        Frame() : scale(0), spectrumScale(0) {}
+        bool empty() const { return small.empty(); }
+        cv::Mat small;          // CV_32FC1 with the mean taken off
+        cv::Mat logPolar;       // log-polar magnitude spectrum of the centred square of small
+        double scale;           // small over full size
+        double spectrumScale;   // the spectrum's square over the square of small it was taken from
+    };
+
+    explicit PhaseCorrelator(int size = 256);
+    // gray is CV_8UC1 at full size. Safe to call from several threads at once, as is registerPair().
+    Frame prepare(const cv::Mat &gray) const;
+    // The similarity taking object pixels onto scene pixels (full size). False if either frame is
+    // empty or the shift peak is too weak to trust, response (if given) is that peak.
+    bool registerPair(const Frame &object, const Frame &scene, cv::Mat &homography, double *response = NULL) const;
+
+private:
+    int size;
+    double logBase;     // log-polar columns are this far apart in log(radius)
+    cv::Mat window;     // Hanning window over the spectrum's square
+    cv::Mat highPass;   // takes the low frequencies off the spectrum, the window leaves them strongest
+    cv::Mat mapX;       // log-polar (angle rows, log radius columns) to spectrum coordinates
+    cv::Mat mapY;
+};
+
+#endif // PHASECORRELATOR_H
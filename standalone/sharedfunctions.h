@@ -8,7 +8,16 @@ class SharedFunctions
 public:
     static void setLabel(cv::Mat& im, const std::string label, std::vector<cv::Point>& contour);
     static void drawPolygon(cv::Mat& image, std::vector<cv::Point> points);
-    static cv::Rect findBoundingBox(cv::Mat &inputImage, bool inputGrayScale = false);
+    // The extent of the pixels that aren't black (any channel non zero) in an 8 bit image of any
+    // number of channels, empty if it is all black. One pass over the image, no copies.
+    static cv::Rect findBoundingBox(const cv::Mat &inputImage);
+    // The same for an image of imageSize once warped by homography, straight from its corners
+    static cv::Rect findBoundingBox(cv::Size imageSize, const cv::Mat &homography);
+    // Best match in train (or what matcher was trained on if train is empty) for every query descriptor.
+    // With a ratio the ones whose second best is not clearly further away are dropped (Lowe's ratio test),
+    // 0 keeps every best match.
+    static void matchWithRatio(cv::Ptr<cv::DescriptorMatcher> matcher, const cv::Mat &query, const cv::Mat &train,
+                               double ratio, std::vector<cv::DMatch> &matches);
     static void saveImage(cv::Mat &image, std::string name);
 private:
     SharedFunctions();  // the methods are all static so there is no need to instantiate this class
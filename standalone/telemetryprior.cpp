@@ -0,0 +1,164 @@
+#include "telemetryprior.h"
+
+#include <cmath>
+
+using namespace cv;
+
+namespace {
+
+const double FOCAL_LENGTH = 0.012;          // metres
+const double PIXEL_SIZE = 0.00000155;       // metres, full resolution
+const double EARTH_RADIUS = 6378137.0;      // metres
+const double DEG_TO_RAD = CV_PI / 180.0;
+
+Mat rotationX(double angle) {
+    double c = cos(angle), s = sin(angle);
+    return (Mat_<double>(3,3) << 1, 0, 0,
+                                 0, c, -s,
+                                 0, s, c);
+}
+
+Mat rotationY(double angle) {
+    double c = cos(angle), s = sin(angle);
+    return (Mat_<double>(3,3) << c, 0, s,
+                                 0, 1, 0,
+                                 -s, 0, c);
+}
+
+Mat rotationZ(double angle) {
+    double c = cos(angle), s = sin(angle);
+    return (Mat_<double>(3,3) << c, -s, 0,
+                                 s, c, 0,
+                                 0, 0, 1);
+}
+
+}
+
+TelemetryPrior::TelemetryPrior() : focalLength(0), originLat(0), originLon(0)
+{
+}
+
+void TelemetryPrior::clear() {
+    poses.clear();
+}
+
+void TelemetryPrior::setFrames(const std::vector<MetaData> &frames, double scale) {
+    poses.assign(frames.size(), Pose());
+    focalLength = FOCAL_LENGTH / PIXEL_SIZE * scale;
+
+    // camera axes in world coordinates (east, north, up) for a level camera looking
+    // down with the top of the image north: x is east, y (down the image) is south
+    Mat nadir = (Mat_<double>(3,3) << 1, 0, 0,
+                                      0, -1, 0,
+                                      0, 0, -1);
+
+    int origin = -1;
+    for (unsigned i = 0; i < frames.size(); i++) {
+        const MetaData &data = frames[i];
+        if (!data.dataIsValid || data.data[ALT] <= 0) continue;
+        if (origin < 0) {
+            origin = i;
+            originLat = data.data[LAT];
+            originLon = data.data[LON];
+        }
+        const MetaData &ref = frames[origin];
+
+        // equirectangular is plenty over the length of one flight
+        double east = (data.data[LON] - ref.data[LON]) * DEG_TO_RAD * EARTH_RADIUS * cos(ref.data[LAT] * DEG_TO_RAD);
+        double north = (data.data[LAT] - ref.data[LAT]) * DEG_TO_RAD * EARTH_RADIUS;
+
+        // heading is clockwise from north, pitch is nose up about the right wing and roll is right wing down
+        Mat cameraToWorld = rotationZ(-data.data[YAW] * DEG_TO_RAD) * rotationX(data.data[PITCH] * DEG_TO_RAD)
+                          * rotationY(data.data[ROLL] * DEG_TO_RAD) * nadir;
+
+        Pose& pose = poses[i];
+        pose.rotation = cameraToWorld.t();
+        pose.position = (Mat_<double>(3,1) << east, north, data.data[ALT]);
+        pose.valid = true;
+    }
+}
+
+bool TelemetryPrior::hasPose(int index) const {
+    return index >= 0 && index < (int)poses.size() && poses[index].valid;
+}
+
+Mat TelemetryPrior::groundToImage(const Pose &pose, Size imageSize) const {
+    Mat K = (Mat_<double>(3,3) << focalLength, 0, imageSize.width / 2.0,
+                                  0, focalLength, imageSize.height / 2.0,
+                                  0, 0, 1);
+    Mat t = -pose.rotation * pose.position;
+    Mat G(3, 3, CV_64FC1);
+    pose.rotation.col(0).copyTo(G.col(0));
+    pose.rotation.col(1).copyTo(G.col(1));
+    t.copyTo(G.col(2));
+    return K * G;
+}
+
+bool TelemetryPrior::predictHomography(int from, int to, Size imageSize, Mat &homography) const {
+    if (!hasPose(from) || !hasPose(to)) return false;
+    Mat H = groundToImage(poses[to], imageSize) * groundToImage(poses[from], imageSize).inv();
+    if (std::abs(H.at<double>(2,2)) < 1e-12) return false;
+    homography = H / H.at<double>(2,2);
+    return true;
+}
+
+bool TelemetryPrior::groundPosition(int index, Point2f pixel, Size imageSize, Point2d &lonLat) const {
+    if (!hasPose(index)) return false;
+    Mat ground = groundToImage(poses[index], imageSize).inv() * (Mat_<double>(3,1) << pixel.x, pixel.y, 1.0);
+    double w = ground.at<double>(2);
+    if (std::abs(w) < 1e-12) return false;
+    double east = ground.at<double>(0) / w;
+    double north = ground.at<double>(1) / w;
+    lonLat.y = originLat + north / EARTH_RADIUS / DEG_TO_RAD;
+    lonLat.x = originLon + east / (EARTH_RADIUS * cos(originLat * DEG_TO_RAD)) / DEG_TO_RAD;
+    return true;
+}
+
+bool TelemetryPrior::predictOverlap(int index, int neighbour, Size imageSize, int margin, Rect &overlap) const {
+    Mat H;
+    if (!predictHomography(neighbour, index, imageSize, H)) return false;
+    Rect footprint;
+    if (!predictFootprint(H, imageSize, margin, footprint)) return false;
+    overlap = footprint & Rect(0, 0, imageSize.width, imageSize.height);
+    return true;
+}
+
+bool TelemetryPrior::predictFootprint(const Mat &homography, Size imageSize, int margin, Rect &footprint) {
+    double corners[4][2] = { {0, 0}, {(double)imageSize.width, 0},
+                             {(double)imageSize.width, (double)imageSize.height}, {0, (double)imageSize.height} };
+    std::vector< Point2f > projected;
+    for (int i = 0; i < 4; i++) {
+        Mat p = homography * (Mat_<double>(3,1) << corners[i][0], corners[i][1], 1.0);
+        double w = p.at<double>(2);
+        if (w <= 0) {
+            return false;   // the image reaches the horizon, nothing sensible to restrict to
+        }
+        projected.push_back(Point2f(p.at<double>(0) / w, p.at<double>(1) / w));
+    }
+    footprint = boundingRect(projected);
+    footprint.x -= margin;
+    footprint.y -= margin;
+    footprint.width += 2 * margin;
+    footprint.height += 2 * margin;
+    return true;
+}
+
+void TelemetryPrior::rejectMatches(std::vector<DMatch> &matches, const std::vector<KeyPoint> &keypoints_object,
+                                   const std::vector<KeyPoint> &keypoints_scene, const Mat &homography, double maxDistance) {
+    if (matches.empty()) return;
+    std::vector< Point2f > predicted(matches.size());
+    for (unsigned i = 0; i < matches.size(); i++) {
+        predicted[i] = keypoints_object[ matches[i].queryIdx ].pt;
+    }
+    perspectiveTransform(predicted, predicted, homography);
+
+    double maxDistanceSquared = maxDistance * maxDistance;
+    unsigned kept = 0;
+    for (unsigned i = 0; i < matches.size(); i++) {
+        Point2f d = keypoints_scene[ matches[i].trainIdx ].pt - predicted[i];
+        if (d.dot(d) <= maxDistanceSquared) {
+            matches[kept++] = matches[i];
+        }
+    }
+    matches.resize(kept);
+}
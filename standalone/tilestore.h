@@ -0,0 +1,87 @@
+#ifndef TILESTORE_H
+#define TILESTORE_H
+
+#include <QSharedPointer>
+#include <QString>
+
+#include <list>
+#include <map>
+#include <opencv2/opencv.hpp>
+
+// A tile that has been PNG compressed into a file and memory mapped. The file is
+// unlinked as soon as it is mapped so the data lives in the page cache (the kernel
+// can drop it and read it back whenever it likes) and disappears with the mapping.
+class MappedTile
+{
+public:
+    static QSharedPointer<MappedTile> create(const cv::Mat &tile, const QString &directory);
+    ~MappedTile();
+    cv::Mat decode() const;
+    size_t compressedSize() const;
+private:
+    MappedTile(uchar* data, size_t size);
+    uchar* data;
+    size_t size;
+};
+
+// Holds the tiles of a MosaicCanvas. Tiles are resident (plain cv::Mat) until more
+// than the memory budget is resident, then the least recently used ones are
+// compressed out to MappedTiles. Using an evicted tile decodes it again. A tile that
+// has only been read since it was decoded keeps its compressed copy, evicting it
+// again costs nothing.
+class TileStore
+{
+public:
+    typedef std::pair<int, int> TileIndex;  // (column, row)
+    enum Access {
+        READ,
+        WRITE
+    };
+
+    TileStore(int type, int tileSize);
+    ~TileStore();
+    void clear();
+
+    // 0 keeps everything resident. Evicted tiles go to directory (the system temp dir if empty).
+    void setMemoryBudget(size_t bytes, const QString &directory = QString());
+    size_t memoryBudget() const;
+
+    bool contains(const TileIndex &index) const;
+    int numTiles() const;
+    int numResident() const;
+
+    // The tile, made resident and most recently used. WRITE creates it (black) if it doesn't exist,
+    // READ returns an empty Mat instead. Never evicts, the returned header stays valid until trim().
+    // A tile a snapshot still holds is copied before it is written (see share()).
+    cv::Mat acquire(const TileIndex &index, Access access);
+    // The tile as it is now without making it resident: its pixels if they are in memory, otherwise
+    // the compressed copy. Nothing is copied, a later WRITE leaves what this hands out alone.
+    // False if the tile doesn't exist.
+    bool share(const TileIndex &index, cv::Mat &pixels, QSharedPointer<MappedTile> &compressed) const;
+    // evicts least recently used tiles until the resident ones fit the budget
+    void trim();
+
+private:
+    struct Entry {
+        Entry() : dirty(false) {}
+        cv::Mat resident;                       // empty while evicted
+        QSharedPointer<MappedTile> compressed;  // up to date unless dirty
+        bool dirty;
+        std::list<TileIndex>::iterator lruPosition;
+    };
+    typedef std::map<TileIndex, Entry> EntryMap;
+
+    TileStore(const TileStore&);
+    TileStore& operator=(const TileStore&);
+
+    void touch(const TileIndex &index, Entry &entry);
+
+    EntryMap entries;
+    std::list<TileIndex> lru;   // resident tiles, most recently used at the front
+    int type;
+    int tileSize;
+    size_t budget;
+    QString spillDirectory;
+};
+
+#endif // TILESTORE_H
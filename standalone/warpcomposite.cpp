@@ -0,0 +1,260 @@
+#include "warpcomposite.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WARPCOMPOSITE_AVX2 1
+#include <immintrin.h>
+#endif
+
+using namespace cv;
+
+namespace {
+
+// The corners of the area bilinear sampling can reach (pixel centres are at integer
+// coordinates, as in warpPerspective) projected through homography. False if some of
+// them are behind the camera, the quad is then not a quad.
+bool projectCorners(Size imageSize, const Matx33d &homography, Point2d corners[4]) {
+    const double xs[4] = {0, imageSize.width - 1.0, imageSize.width - 1.0, 0};
+    const double ys[4] = {0, 0, imageSize.height - 1.0, imageSize.height - 1.0};
+    for (int i = 0; i < 4; i++) {
+        double w = homography(2,0) * xs[i] + homography(2,1) * ys[i] + homography(2,2);
+        if (w <= DBL_EPSILON) return false;
+        corners[i].x = (homography(0,0) * xs[i] + homography(0,1) * ys[i] + homography(0,2)) / w;
+        corners[i].y = (homography(1,0) * xs[i] + homography(1,1) * ys[i] + homography(1,2)) / w;
+    }
+    return true;
+}
+
+// where row y crosses the quad, false if it misses it
+bool rowSpan(const Point2d corners[4], double y, double &xMin, double &xMax) {
+    bool crossed = false;
+    for (int i = 0; i < 4; i++) {
+        const Point2d &p = corners[i];
+        const Point2d &q = corners[(i + 1) % 4];
+        if (y < std::min(p.y, q.y) || y > std::max(p.y, q.y)) continue;
+        double x = p.y == q.y ? p.x : p.x + (y - p.y) * (q.x - p.x) / (q.y - p.y);
+        double x2 = p.y == q.y ? q.x : x;
+        if (!crossed) {
+            xMin = std::min(x, x2);
+            xMax = std::max(x, x2);
+            crossed = true;
+        } else {
+            xMin = std::min(xMin, std::min(x, x2));
+            xMax = std::max(xMax, std::max(x, x2));
+        }
+    }
+    return crossed;
+}
+
+// Bilinear sample at (sx, sy), false without writing anything if it is outside the image.
+// The last row and column sample themselves instead of reading past the edge.
+inline bool samplePixel(const Mat &image, float sx, float sy, uchar* out) {
+    // written so NaN fails too
+    if (!(sx >= 0 && sy >= 0 && sx <= image.cols - 1 && sy <= image.rows - 1)) return false;
+    int x0 = (int)sx;
+    int y0 = (int)sy;
+    float fx = sx - x0;
+    float fy = sy - y0;
+    int cn = image.channels();
+    int dx = x0 < image.cols - 1 ? cn : 0;
+    int dy = y0 < image.rows - 1 ? (int)image.step : 0;
+    const uchar* p = image.ptr(y0) + x0 * cn;
+    for (int c = 0; c < cn; c++) {
+        float top = p[c] + fx * (p[c + dx] - p[c]);
+        float bottom = p[c + dy] + fx * (p[c + dy + dx] - p[c + dy]);
+        out[c] = saturate_cast<uchar>(cvRound(top + fy * (bottom - top)));
+    }
+    return true;
+}
+
+// Destination pixels x = begin + k for k < count of one row. base is the inverse homography
+// times (begin, y, 1) and step its first column, the source position of pixel k is
+// (base + k * step) divided through, worked out the same way by both versions.
+void compositeRowScalar(const Mat &image, const float base[3], const float step[3], int count, uchar* dst) {
+    int cn = image.channels();
+    for (int k = 0; k < count; k++) {
+        float kf = (float)k;
+        float X = base[0] + kf * step[0];
+        float Y = base[1] + kf * step[1];
+        float W = base[2] + kf * step[2];
+        samplePixel(image, X / W, Y / W, dst + k * cn);
+    }
+}
+
+#ifdef WARPCOMPOSITE_AVX2
+
+// Eight pixels at a time: the mapping, the inside test and the tap offsets are vectors, the
+// four taps of every pixel are gathered as 32 bit words (all the channels at once) and
+// blended per channel. A pixel whose taps would read past the end of the image data goes
+// through samplePixel instead, that only happens at the very last pixel.
+__attribute__((target("avx2")))
+void compositeRowAvx2(const Mat &image, const float base[3], const float step[3], int count, uchar* dst) {
+    int cn = image.channels();
+    const uchar* src = image.data;
+    int lastSafe = (int)((image.rows - 1) * image.step + image.cols * cn) - 4;
+
+    const __m256 iota = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 maxX = _mm256_set1_ps((float)(image.cols - 1));
+    const __m256 maxY = _mm256_set1_ps((float)(image.rows - 1));
+    const __m256i lastColumn = _mm256_set1_epi32(image.cols - 1);
+    const __m256i lastRow = _mm256_set1_epi32(image.rows - 1);
+    const __m256i channels = _mm256_set1_epi32(cn);
+    const __m256i rowStep = _mm256_set1_epi32((int)image.step);
+    const __m256i safeLimit = _mm256_set1_epi32(lastSafe + 1);
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+
+    int packed[8];
+    for (int k = 0; k < count; k += 8) {
+        __m256 kf = _mm256_add_ps(_mm256_set1_ps((float)k), iota);
+        __m256 X = _mm256_add_ps(_mm256_set1_ps(base[0]), _mm256_mul_ps(kf, _mm256_set1_ps(step[0])));
+        __m256 Y = _mm256_add_ps(_mm256_set1_ps(base[1]), _mm256_mul_ps(kf, _mm256_set1_ps(step[1])));
+        __m256 W = _mm256_add_ps(_mm256_set1_ps(base[2]), _mm256_mul_ps(kf, _mm256_set1_ps(step[2])));
+        __m256 sx = _mm256_div_ps(X, W);
+        __m256 sy = _mm256_div_ps(Y, W);
+
+        __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(sx, zero, _CMP_GE_OQ), _mm256_cmp_ps(sy, zero, _CMP_GE_OQ)),
+                                      _mm256_and_ps(_mm256_cmp_ps(sx, maxX, _CMP_LE_OQ), _mm256_cmp_ps(sy, maxY, _CMP_LE_OQ)));
+        int lanes = std::min(8, count - k);
+        int insideBits = _mm256_movemask_ps(inside) & ((1 << lanes) - 1);
+        if (insideBits == 0) continue;
+
+        // outside lanes sample (0, 0) so their offsets stay in range, they are not written
+        sx = _mm256_and_ps(sx, inside);
+        sy = _mm256_and_ps(sy, inside);
+        __m256 x0f = _mm256_floor_ps(sx);
+        __m256 y0f = _mm256_floor_ps(sy);
+        __m256 fx = _mm256_sub_ps(sx, x0f);
+        __m256 fy = _mm256_sub_ps(sy, y0f);
+        __m256i x0 = _mm256_cvttps_epi32(x0f);
+        __m256i y0 = _mm256_cvttps_epi32(y0f);
+        __m256i dx = _mm256_and_si256(_mm256_cmpgt_epi32(lastColumn, x0), channels);
+        __m256i dy = _mm256_and_si256(_mm256_cmpgt_epi32(lastRow, y0), rowStep);
+        __m256i o00 = _mm256_add_epi32(_mm256_mullo_epi32(y0, rowStep), _mm256_mullo_epi32(x0, channels));
+        __m256i o01 = _mm256_add_epi32(o00, dx);
+        __m256i o10 = _mm256_add_epi32(o00, dy);
+        __m256i o11 = _mm256_add_epi32(o10, dx);
+        // o11 is the furthest of the four
+        __m256i safe = _mm256_and_si256(_mm256_castps_si256(inside), _mm256_cmpgt_epi32(safeLimit, o11));
+        int safeBits = _mm256_movemask_ps(_mm256_castsi256_ps(safe)) & insideBits;
+
+        if (safeBits != 0) {
+            const int* base32 = (const int*)src;
+            __m256i none = _mm256_setzero_si256();
+            __m256i p00 = _mm256_mask_i32gather_epi32(none, base32, o00, safe, 1);
+            __m256i p01 = _mm256_mask_i32gather_epi32(none, base32, o01, safe, 1);
+            __m256i p10 = _mm256_mask_i32gather_epi32(none, base32, o10, safe, 1);
+            __m256i p11 = _mm256_mask_i32gather_epi32(none, base32, o11, safe, 1);
+            __m256i result = _mm256_setzero_si256();
+            for (int c = 0; c < cn; c++) {
+                __m256 a = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p00, 8 * c), byteMask));
+                __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p01, 8 * c), byteMask));
+                __m256 d = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p10, 8 * c), byteMask));
+                __m256 e = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p11, 8 * c), byteMask));
+                __m256 top = _mm256_add_ps(a, _mm256_mul_ps(fx, _mm256_sub_ps(b, a)));
+                __m256 bottom = _mm256_add_ps(d, _mm256_mul_ps(fx, _mm256_sub_ps(e, d)));
+                __m256 value = _mm256_add_ps(top, _mm256_mul_ps(fy, _mm256_sub_ps(bottom, top)));
+                // bilinear weights keep it within 0..255, rounding is to nearest like cvRound
+                result = _mm256_or_si256(result, _mm256_slli_epi32(_mm256_cvtps_epi32(value), 8 * c));
+            }
+            _mm256_storeu_si256((__m256i*)packed, result);
+        }
+
+        for (int lane = 0; lane < lanes; lane++) {
+            int bit = 1 << lane;
+            if (!(insideBits & bit)) continue;
+            uchar* out = dst + (k + lane) * cn;
+            if (safeBits & bit) {
+                for (int c = 0; c < cn; c++) out[c] = (uchar)(packed[lane] >> (8 * c));
+            } else {
+                float kf = (float)(k + lane);
+                float Xs = base[0] + kf * step[0];
+                float Ys = base[1] + kf * step[1];
+                float Ws = base[2] + kf * step[2];
+                samplePixel(image, Xs / Ws, Ys / Ws, out);
+            }
+        }
+    }
+}
+
+#endif
+
+}
+
+bool WarpComposite::usingAvx2() {
+#ifdef WARPCOMPOSITE_AVX2
+    static bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+Rect WarpComposite::footprint(Size imageSize, const Mat &homography) {
+    if (imageSize.area() == 0) return Rect();
+    Point2d corners[4];
+    if (!projectCorners(imageSize, Matx33d(homography), corners)) {
+        // through the horizon, the best there is is where the image corners end up
+        std::vector< Point2f > projected(4);
+        projected[0] = Point2f(0, 0);
+        projected[1] = Point2f(imageSize.width, 0);
+        projected[2] = Point2f(imageSize.width, imageSize.height);
+        projected[3] = Point2f(0, imageSize.height);
+        perspectiveTransform(projected, projected, homography);
+        return boundingRect(projected);
+    }
+    double minX = corners[0].x, maxX = corners[0].x, minY = corners[0].y, maxY = corners[0].y;
+    for (int i = 1; i < 4; i++) {
+        minX = std::min(minX, corners[i].x);
+        maxX = std::max(maxX, corners[i].x);
+        minY = std::min(minY, corners[i].y);
+        maxY = std::max(maxY, corners[i].y);
+    }
+    int left = cvCeil(minX), top = cvCeil(minY);
+    int right = cvFloor(maxX), bottom = cvFloor(maxY);
+    if (right < left || bottom < top) return Rect();
+    return Rect(left, top, right - left + 1, bottom - top + 1);
+}
+
+Rect WarpComposite::draw(const Mat &image, const Mat &homography, Mat &dst) {
+    if (image.empty() || dst.empty()) return Rect();
+    CV_Assert(image.type() == dst.type());
+    Rect dstRect(0, 0, dst.cols, dst.rows);
+    Matx33d forward(homography);
+    Point2d corners[4];
+    int cn = image.channels();
+
+    if (image.depth() != CV_8U || cn > 4 || !projectCorners(image.size(), forward, corners)) {
+        // nothing this can bound or sample, the general warp over all of dst
+        warpPerspective(image, dst, homography, dst.size(), INTER_LINEAR, BORDER_TRANSPARENT);
+        return dstRect;
+    }
+    Rect bounds = footprint(image.size(), homography) & dstRect;
+    if (bounds.area() == 0) return Rect();
+
+    Matx33d inverse = forward.inv();
+    float step[3] = { (float)inverse(0,0), (float)inverse(1,0), (float)inverse(2,0) };
+    for (int y = bounds.y; y < bounds.y + bounds.height; y++) {
+        double xMin, xMax;
+        if (!rowSpan(corners, y, xMin, xMax)) continue;
+        // a pixel either side of the exact span, samplePixel has the last word
+        int begin = std::max(bounds.x, cvFloor(xMin) - 1);
+        int end = std::min(bounds.x + bounds.width, cvCeil(xMax) + 2);
+        if (end <= begin) continue;
+
+        float base[3];
+        for (int r = 0; r < 3; r++) {
+            base[r] = (float)(inverse(r,0) * begin + inverse(r,1) * y + inverse(r,2));
+        }
+        uchar* row = dst.ptr(y) + begin * cn;
+#ifdef WARPCOMPOSITE_AVX2
+        if (usingAvx2()) {
+            compositeRowAvx2(image, base, step, end - begin, row);
+            continue;
+        }
+#endif
+        compositeRowScalar(image, base, step, end - begin, row);
+    }
+    return bounds;
+}
@@ -0,0 +1,28 @@
+#ifndef WARPCOMPOSITE_H
+#define WARPCOMPOSITE_H
+
+#include <opencv2/opencv.hpp>
+
+// Warps an image straight onto a bigger one in a single pass, instead of warping into a
+// buffer the size of the destination, masking and copying. The image corners projected
+// through the homography bound the work: each destination row is only walked between
+// the edges of the projected quad, every pixel there is mapped back into the image and
+// sampled bilinearly, and written if it came from inside the image. The mapping and
+// sampling run eight pixels at a time with AVX2 where the CPU has it.
+class WarpComposite
+{
+public:
+    // Draws image warped with homography (image -> dst coordinates) onto dst, on top of what
+    // is there. Both 8 bit with the same number of channels. Returns the part of dst that
+    // may have changed, empty if the image lands outside it.
+    static cv::Rect draw(const cv::Mat &image, const cv::Mat &homography, cv::Mat &dst);
+    // the pixels image covers once warped, not clipped to anything
+    static cv::Rect footprint(cv::Size imageSize, const cv::Mat &homography);
+
+    static bool usingAvx2();
+
+private:
+    WarpComposite();
+};
+
+#endif // WARPCOMPOSITE_H
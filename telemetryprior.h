@@ -0,0 +1,57 @@
+#ifndef TELEMETRYPRIOR_H
+#define TELEMETRYPRIOR_H
+
+#include <opencv2/opencv.hpp>
+
+#include "metadataparser.h"
+
+// Predicts where images land relative to each other from the position and
+// attitude logged with every image. The ground is taken to be flat with the
+// altitude being the height above it, so each image gets a homography from
+// the ground plane (metres east and north) to its pixels:
+//      G = K [r1 r2 t]
+// with R the world to camera rotation built from yaw, pitch and roll (a level
+// camera looks straight down with the top of the image to the north) and
+// t = -R * position. Image a maps onto image b with Gb * Ga^-1.
+class TelemetryPrior
+{
+public:
+    TelemetryPrior();
+    void clear();
+    // one entry per input image, scale is the resize applied to the images
+    void setFrames(const std::vector<MetaData> &frames, double scale);
+    bool hasPose(int index) const;
+
+    // homography taking pixels of image from onto image to, false if either has no telemetry
+    bool predictHomography(int from, int to, cv::Size imageSize, cv::Mat &homography) const;
+    // longitude (x) and latitude (y) of the ground under pixel of image index
+    bool groundPosition(int index, cv::Point2f pixel, cv::Size imageSize, cv::Point2d &lonLat) const;
+    // bounding box of image neighbour predicted inside image index, grown by margin pixels
+    // and clipped to the image. An empty rect means no overlap is expected.
+    bool predictOverlap(int index, int neighbour, cv::Size imageSize, int margin, cv::Rect &overlap) const;
+
+    // bounding box of an image of imageSize placed with homography, grown by margin.
+    // False when the image would reach the horizon.
+    static bool predictFootprint(const cv::Mat &homography, cv::Size imageSize, int margin, cv::Rect &footprint);
+    // drops the matches whose scene keypoint is further than maxDistance from where
+    // homography (object -> scene keypoint coordinates) puts the object keypoint
+    static void rejectMatches(std::vector<cv::DMatch> &matches, const std::vector<cv::KeyPoint> &keypoints_object,
+                              const std::vector<cv::KeyPoint> &keypoints_scene, const cv::Mat &homography, double maxDistance);
+
+private:
+    struct Pose {
+        Pose() : valid(false) {}
+        bool valid;
+        cv::Mat rotation;   // world -> camera
+        cv::Mat position;   // metres east, north and up from the first image with telemetry
+    };
+
+    cv::Mat groundToImage(const Pose &pose, cv::Size imageSize) const;
+
+    std::vector<Pose> poses;
+    double focalLength;     // pixels at the working scale
+    double originLat;       // degrees, where the local east/north frame starts
+    double originLon;
+};
+
+#endif // TELEMETRYPRIOR_H
@@ -0,0 +1,205 @@
+#include "tilestore.h"
+
+#include <QDir>
+#include <QFile>
+
+#include <iostream>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace cv;
+
+namespace {
+
+// Compresses the evicted tiles, each is independent so they run in parallel
+class CompressTiles : public ParallelLoopBody {
+public:
+    CompressTiles(const std::vector<Mat> &tiles, std::vector< QSharedPointer<MappedTile> > &results, const QString &directory)
+        : tiles(tiles), results(results), directory(directory) {}
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; i++) {
+            results[i] = MappedTile::create(tiles[i], directory);
+        }
+    }
+
+private:
+    const std::vector<Mat> &tiles;
+    std::vector< QSharedPointer<MappedTile> > &results;
+    const QString &directory;
+};
+
+}
+
+QSharedPointer<MappedTile> MappedTile::create(const Mat &tile, const QString &directory) {
+    std::vector< uchar > buffer;
+    std::vector< int > params;
+    params.push_back(CV_IMWRITE_PNG_COMPRESSION);
+    params.push_back(1);    // tiles are written far more often than they are read, keep it fast
+    if (!imencode(".png", tile, buffer, params)) {
+        std::cout << "Could not compress mosaic tile" << std::endl;
+        return QSharedPointer<MappedTile>();
+    }
+
+    QByteArray nameTemplate = QFile::encodeName(QDir(directory).filePath("visor_tile_XXXXXX"));
+    int fd = mkstemp(nameTemplate.data());
+    if (fd < 0) {
+        std::cout << "Could not create mosaic tile file in " << directory.toStdString() << std::endl;
+        return QSharedPointer<MappedTile>();
+    }
+    unlink(nameTemplate.constData());   // gone once the mapping is
+
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t n = write(fd, &buffer[written], buffer.size() - written);
+        if (n <= 0) break;
+        written += n;
+    }
+    void* data = MAP_FAILED;
+    if (written == buffer.size()) {
+        data = mmap(NULL, buffer.size(), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cout << "Could not map mosaic tile file" << std::endl;
+        return QSharedPointer<MappedTile>();
+    }
+    return QSharedPointer<MappedTile>(new MappedTile(static_cast<uchar*>(data), buffer.size()));
+}
+
+MappedTile::MappedTile(uchar* data, size_t size) : data(data), size(size)
+{
+}
+
+MappedTile::~MappedTile() {
+    munmap(data, size);
+}
+
+Mat MappedTile::decode() const {
+    return imdecode(Mat(1, size, CV_8UC1, data), CV_LOAD_IMAGE_UNCHANGED);
+}
+
+size_t MappedTile::compressedSize() const {
+    return size;
+}
+
+TileStore::TileStore(int type, int tileSize) : type(type), tileSize(tileSize), budget(0)
+{
+}
+
+TileStore::~TileStore() {
+}
+
+void TileStore::clear() {
+    entries.clear();
+    lru.clear();
+}
+
+void TileStore::setMemoryBudget(size_t bytes, const QString &directory) {
+    budget = bytes;
+    spillDirectory = directory.isEmpty() ? QDir::tempPath() : directory;
+}
+
+size_t TileStore::memoryBudget() const {
+    return budget;
+}
+
+bool TileStore::contains(const TileIndex &index) const {
+    return entries.find(index) != entries.end();
+}
+
+int TileStore::numTiles() const {
+    return entries.size();
+}
+
+int TileStore::numResident() const {
+    return lru.size();
+}
+
+void TileStore::touch(const TileIndex &index, Entry &entry) {
+    if (!entry.resident.empty()) {
+        lru.erase(entry.lruPosition);
+    }
+    lru.push_front(index);
+    entry.lruPosition = lru.begin();
+}
+
+Mat TileStore::acquire(const TileIndex &index, Access access) {
+    EntryMap::iterator it = entries.find(index);
+    if (it == entries.end()) {
+        if (access == READ) return Mat();
+        it = entries.insert(std::make_pair(index, Entry())).first;
+    }
+    Entry& entry = it->second;
+
+    Mat tile = entry.resident;
+    if (tile.empty()) {
+        if (!entry.compressed.isNull()) {
+            tile = entry.compressed->decode();
+        }
+        if (tile.empty()) {
+            tile = Mat::zeros(tileSize, tileSize, type);
+        }
+    }
+    touch(index, entry);
+    if (access == WRITE && tile.refcount && *tile.refcount > 2) {
+        // shared with a snapshot (besides entry.resident and tile), the snapshot keeps the old pixels
+        tile = tile.clone();
+    }
+    entry.resident = tile;
+    if (access == WRITE) {
+        entry.dirty = true;
+        entry.compressed.clear();
+    }
+    return tile;
+}
+
+bool TileStore::share(const TileIndex &index, Mat &pixels, QSharedPointer<MappedTile> &compressed) const {
+    EntryMap::const_iterator it = entries.find(index);
+    if (it == entries.end()) return false;
+    pixels = it->second.resident;
+    compressed = pixels.empty() ? it->second.compressed : QSharedPointer<MappedTile>();
+    return true;
+}
+
+void TileStore::trim() {
+    if (budget == 0) return;
+    size_t tileBytes = (size_t)tileSize * tileSize * CV_ELEM_SIZE(type);
+    size_t maxResident = std::max((size_t)1, budget / tileBytes);
+    if (lru.size() <= maxResident) return;
+
+    std::vector< TileIndex > victims;
+    std::vector< Mat > dirtyTiles;
+    std::vector< TileIndex > dirtyIndices;
+    while (lru.size() > maxResident) {
+        TileIndex index = lru.back();
+        lru.pop_back();
+        Entry& entry = entries[index];
+        if (entry.dirty || entry.compressed.isNull()) {
+            dirtyTiles.push_back(entry.resident);
+            dirtyIndices.push_back(index);
+        }
+        victims.push_back(index);
+    }
+
+    std::vector< QSharedPointer<MappedTile> > compressed(dirtyTiles.size());
+    parallel_for_(Range(0, dirtyTiles.size()), CompressTiles(dirtyTiles, compressed, spillDirectory));
+    for (unsigned i = 0; i < dirtyIndices.size(); i++) {
+        Entry& entry = entries[dirtyIndices[i]];
+        if (compressed[i].isNull()) {
+            // could not spill it, keep it in memory rather than lose it
+            lru.push_front(dirtyIndices[i]);
+            entry.lruPosition = lru.begin();
+            continue;
+        }
+        entry.compressed = compressed[i];
+        entry.dirty = false;
+    }
+    for (unsigned i = 0; i < victims.size(); i++) {
+        Entry& entry = entries[victims[i]];
+        if (!entry.compressed.isNull() && !entry.dirty) {
+            entry.resident = Mat();
+        }
+    }
+}
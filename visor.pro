@@ -17,7 +17,26 @@ SOURCES += main.cpp\
     sharedfunctions.cpp \
     customgraphicsview.cpp \
     customslider.cpp \
-    metadataparser.cpp
+    metadataparser.cpp \
+    mosaicfeaturemap.cpp \
+    framepipeline.cpp \
+    imageloader.cpp \
+    telemetryprior.cpp \
+    mosaiccanvas.cpp \
+    tilestore.cpp \
+    mosaicexporter.cpp \
+    globalaligner.cpp \
+    matchfilter.cpp \
+    hammingmatcher.cpp \
+    warpcomposite.cpp \
+    mosaicblender.cpp \
+    featurestore.cpp \
+    matchexplorer.cpp \
+    matchpreview.cpp \
+    homographyestimator.cpp \
+    phasecorrelator.cpp \
+    featuretracker.cpp \
+    griddetector.cpp
 
 HEADERS  += mainwindow.h \
     imagestitcher.h \
@@ -25,7 +44,26 @@ HEADERS  += mainwindow.h \
     sharedfunctions.h \
     customgraphicsview.h \
     customslider.h \
-    metadataparser.h
+    metadataparser.h \
+    mosaicfeaturemap.h \
+    framepipeline.h \
+    imageloader.h \
+    telemetryprior.h \
+    mosaiccanvas.h \
+    tilestore.h \
+    mosaicexporter.h \
+    globalaligner.h \
+    matchfilter.h \
+    hammingmatcher.h \
+    warpcomposite.h \
+    mosaicblender.h \
+    featurestore.h \
+    matchexplorer.h \
+    matchpreview.h \
+    homographyestimator.h \
+    phasecorrelator.h \
+    featuretracker.h \
+    griddetector.h
 
 FORMS    += mainwindow.ui
 
@@ -33,3 +71,5 @@ INCLUDEPATH +=  `pkg-config --cflags opencv`
 
 LIBS += -L/usr/local/lib
 LIBS +=         `pkg-config --libs opencv`
+LIBS += -ljpeg
+LIBS += -lz